@@ -0,0 +1,1550 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   tf-bench - Microbenchmarks for the libthinkfinger hot paths
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   The library is compiled into this program as a single translation unit
+ *   so that the static protocol helpers can be timed directly.  USB traffic
+ *   is served by tf-sim, no reader is needed.
+ *
+ *   Results are written to stdout as JSON.  Benchmark names, their order and
+ *   their iteration counts are fixed, so the output of different library
+ *   versions can be compared line by line.  What the record, image and
+ *   matching code computes, and how tasks, the published state and the
+ *   lease behave with tf-sim, is checked first; tf-bench fails without
+ *   timing anything if a result is wrong.
+ */
+
+/* the library is included rather than linked: the frame builders, the
+ * parser and the template loader are static and have no other way in */
+#include "libthinkfinger.c"
+#include "libthinkfinger-bir.c"
+#include "libthinkfinger-crc.c"
+#include "libthinkfinger-stitch.c"
+#include "libthinkfinger-extract.c"
+#include "libthinkfinger-identify.c"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "tf-sim.h"
+
+#define BENCH_REPEAT   7
+#define BENCH_TEMPLATE 560
+#define BENCH_STRIPS   64
+#define BENCH_ROWS     384
+#define BENCH_BATCH    64
+#define BENCH_PROBES   64
+/* threads waiting for the state of one handle, and the tasks they watch */
+#define BENCH_WATCHERS 4
+#define BENCH_TASKS    50
+/* processes queued for the reader, and the time in ms they are given */
+#define BENCH_QUEUE    3
+#define BENCH_WAIT     5000
+/* strips of a checked capture, more than the ring holds */
+#define BENCH_CAPTURE  600
+/* score from which a candidate counts as the finger, taken more or less
+ * again scores 80 and up here, another finger less than 10 */
+#define BENCH_MATCH    40
+
+typedef void (*bench_fn) (libthinkfinger *tf, unsigned long iterations);
+
+struct bench {
+	const char *name;
+	bench_fn fn;
+	unsigned long iterations;
+	unsigned long bytes;
+};
+
+static unsigned char reply_scan[29] = {
+	0x43, 0x69, 0x61, 0x6f, 0x00, 0x80, 0x14, 0x28,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x9f
+};
+
+static unsigned char reply_verdict[28] = {
+	0x43, 0x69, 0x61, 0x6f, 0x00, 0xa0, 0x13, 0x28,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x20, 0xfd
+};
+
+static unsigned char reply_busy[10] = {
+	0x43, 0x69, 0x61, 0x6f, 0x00, 0x00, 0x01, 0xa1,
+	0xfa, 0x96
+};
+
+static unsigned char reply_ack[18] = {
+	0x43, 0x69, 0x61, 0x6f, 0x00, 0x60, 0x09, 0x28,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xa2, 0x45
+};
+
+static unsigned char crc_data[4096];
+static unsigned char template_frame[BENCH_TEMPLATE + 18];
+static char template_path[] = "/tmp/tf-bench-XXXXXX";
+static volatile u16 crc_sink;
+
+/* a record of TF_BIR_FINGERS templates, intact and with the last byte of
+ * the last template flipped, which is found last */
+static u8 bir_record[BIR_SIZE_MAX];
+static u8 bir_corrupt[BIR_SIZE_MAX];
+static size_t bir_size;
+static volatile int bir_sink;
+/* the damaged record in a file, and a handle which verifies against it */
+static char corrupt_path[] = "/tmp/tf-bench-XXXXXX";
+static libthinkfinger *corrupt_tf;
+
+static struct stitch stitch;
+static u8 stitch_image[TF_IMAGE_WIDTH * TF_IMAGE_HEIGHT];
+static u8 stitch_strips[BENCH_STRIPS][TF_STRIP_SIZE];
+
+static u8 extract_image[TF_IMAGE_WIDTH * BENCH_ROWS];
+static libthinkfinger_image extract_images[BENCH_BATCH];
+static libthinkfinger_features extract_found[BENCH_BATCH];
+
+/* galleries of 256, 1024 and 4096 templates */
+static libthinkfinger_index *identify_index[3];
+static libthinkfinger_features identify_probe[BENCH_PROBES];
+static libthinkfinger_candidate identify_found[8];
+
+/* a handle of its own, verify closes the template file of the handle; it
+ * opts in to the re-arm, which tf-sim understands */
+static libthinkfinger *verify_tf;
+/* timed verifications which went wrong: tf-sim always matches, and a
+ * damaged record is always refused */
+static unsigned long verify_failures;
+
+/* live handles without and with TF_FLAG_PIPELINE, the first handshake runs
+ * in lock-step on both, every further one is timed */
+static libthinkfinger *handshake_tf[2];
+static unsigned long handshake_failures;
+
+static unsigned long long bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare (const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_crc (unsigned int size, unsigned long iterations)
+{
+	u16 crc = 0;
+
+	while (iterations--)
+		crc = udf_crc (crc_data, size, crc);
+	crc_sink = crc;
+}
+
+static void bench_crc_16 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_crc (16, iterations);
+}
+
+static void bench_crc_64 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_crc (64, iterations);
+}
+
+static void bench_crc_256 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_crc (256, iterations);
+}
+
+static void bench_crc_1024 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_crc (1024, iterations);
+}
+
+static void bench_crc_4096 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_crc (4096, iterations);
+}
+
+/* the barrier makes every frame reach memory, else the stores of all but
+ * the last iteration are dropped and nothing is left to time */
+static void bench_frame_scan_sequence (libthinkfinger *tf, unsigned long iterations)
+{
+	while (iterations--) {
+		_libthinkfinger_scan_frame (tf->scan, iterations & 0xff, 0x01);
+		__asm__ __volatile__ ("" : : "r" (tf->scan) : "memory");
+	}
+	crc_sink = udf_crc ((u8 *) tf->scan, sizeof (tf->scan), 0);
+}
+
+/* streams the upload frame to tf-sim and takes its acknowledgement */
+static void bench_frame_upload (libthinkfinger *tf, unsigned long iterations)
+{
+	char reply[DEFAULT_BULK_SIZE];
+
+	_libthinkfinger_load_template (tf);
+	while (iterations--) {
+		_libthinkfinger_upload (tf, tf->upload, sizeof (tf->upload));
+		_libthinkfinger_usb_read (tf, reply, sizeof (reply));
+	}
+	_libthinkfinger_unload_template (tf);
+}
+
+static void bench_parse (libthinkfinger *tf, unsigned char *frame, unsigned long iterations)
+{
+	while (iterations--) {
+		tf->state = TF_STATE_INITIAL;
+		_libthinkfinger_parse (tf, frame);
+	}
+}
+
+static void bench_parse_scan (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_parse (tf, reply_scan, iterations);
+}
+
+static void bench_parse_verdict (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_parse (tf, reply_verdict, iterations);
+}
+
+static void bench_parse_busy (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_parse (tf, reply_busy, iterations);
+}
+
+static void bench_parse_ack (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_parse (tf, reply_ack, iterations);
+}
+
+static void bench_template_store (libthinkfinger *tf, unsigned long iterations)
+{
+	int tail = sizeof (template_frame) - DEFAULT_BULK_SIZE;
+
+	while (iterations--) {
+		lseek (tf->fd, 0, SEEK_SET);
+		tf_sim_queue (template_frame + DEFAULT_BULK_SIZE, tail);
+		_libthinkfinger_store_fingerprint (tf, template_frame);
+	}
+}
+
+static void bench_template_load (libthinkfinger *tf, unsigned long iterations)
+{
+	while (iterations--) {
+		_libthinkfinger_load_template (tf);
+		_libthinkfinger_unload_template (tf);
+	}
+}
+
+static void bench_bir_read (libthinkfinger *tf, unsigned long iterations)
+{
+	struct bir_template templates[TF_BIR_FINGERS];
+
+	while (iterations--)
+		bir_sink = bir_read (bir_record, bir_size, templates);
+}
+
+static void bench_bir_corrupt (libthinkfinger *tf, unsigned long iterations)
+{
+	struct bir_template templates[TF_BIR_FINGERS];
+
+	while (iterations--)
+		if (bir_read (bir_corrupt, bir_size, templates) != -1)
+			verify_failures++;
+}
+
+static void bench_startup (int flags, unsigned long iterations)
+{
+	libthinkfinger_init_status init_status;
+
+	while (iterations--)
+		libthinkfinger_free (libthinkfinger_new_flags (&init_status, flags));
+}
+
+static void bench_startup_new (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_startup (TF_FLAG_DEFAULT, iterations);
+}
+
+static void bench_startup_probe (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_startup (TF_FLAG_PROBE, iterations);
+}
+
+/* the initialization sequence on a claimed reader, after the endpoints
+ * were cleared and drained, as the first tier of the recovery sends it */
+static void bench_handshake (libthinkfinger *tf, unsigned long iterations)
+{
+	while (iterations--)
+		if (_libthinkfinger_resync (tf) < 0 || _libthinkfinger_handshake (tf) < 0)
+			handshake_failures++;
+}
+
+static void bench_startup_handshake (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_handshake (handshake_tf[0], iterations);
+}
+
+static void bench_startup_pipelined (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_handshake (handshake_tf[1], iterations);
+}
+
+static void bench_sad (unsigned int (*sad) (const u8 *a, const u8 *b), unsigned long iterations)
+{
+	unsigned int sum = 0;
+
+	while (iterations--)
+		sum += sad (stitch_strips[0] + STITCH_MARGIN, stitch_strips[1] + STITCH_MARGIN + (iterations & 7));
+	crc_sink = sum;
+}
+
+static void bench_stitch_sad (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_sad (stitch.sad, iterations);
+}
+
+static void bench_stitch_sad_scalar (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_sad (stitch_sad_scalar, iterations);
+}
+
+/* a swipe of BENCH_STRIPS strips, stitched over and over */
+static void bench_stitch_strip (libthinkfinger *tf, unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++) {
+		if (i % BENCH_STRIPS == 0)
+			stitch_reset (&stitch);
+		stitch_strip (&stitch, stitch_strips[i % BENCH_STRIPS], i * 1000);
+	}
+}
+
+static void bench_extract_frame (libthinkfinger *tf, unsigned long iterations)
+{
+	while (iterations--)
+		libthinkfinger_extract (tf, &extract_images[0], &extract_found[0]);
+}
+
+/* on every online CPU, the time is per image */
+static void bench_extract_batch (libthinkfinger *tf, unsigned long iterations)
+{
+	while (iterations > 0) {
+		libthinkfinger_extract_batch (extract_images, extract_found,
+					      iterations < BENCH_BATCH ? iterations : BENCH_BATCH, 0);
+		iterations -= iterations < BENCH_BATCH ? iterations : BENCH_BATCH;
+	}
+}
+
+static void bench_identify (int gallery, unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++)
+		libthinkfinger_identify (identify_index[gallery], &identify_probe[i % BENCH_PROBES],
+					 identify_found, 8, 0);
+}
+
+/* on every online CPU */
+static void bench_identify_256 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_identify (0, iterations);
+}
+
+static void bench_identify_1024 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_identify (1, iterations);
+}
+
+static void bench_identify_4096 (libthinkfinger *tf, unsigned long iterations)
+{
+	bench_identify (2, iterations);
+}
+
+/* what pam_thinkfinger does for every attempt: a new handle, the template
+ * read and uploaded */
+static void bench_verify_full (libthinkfinger *tf, unsigned long iterations)
+{
+	libthinkfinger_init_status init_status;
+	libthinkfinger *full;
+
+	while (iterations--) {
+		full = libthinkfinger_new (&init_status);
+		libthinkfinger_set_file (full, template_path);
+		if (libthinkfinger_verify (full) != TF_RESULT_VERIFY_SUCCESS)
+			verify_failures++;
+		libthinkfinger_free (full);
+	}
+}
+
+/* the same file again on a live handle, with the re-arm the upload is
+ * skipped */
+static void bench_verify_again (libthinkfinger *tf, unsigned long iterations)
+{
+	while (iterations--)
+		if (libthinkfinger_verify (verify_tf) != TF_RESULT_VERIFY_SUCCESS)
+			verify_failures++;
+}
+
+/* the template stays on the reader, only the scan is started again */
+static void bench_verify_retry (libthinkfinger *tf, unsigned long iterations)
+{
+	while (iterations--)
+		if (libthinkfinger_verify_retry (verify_tf) != TF_RESULT_VERIFY_SUCCESS)
+			verify_failures++;
+}
+
+/* a damaged record is refused before the reader is opened.  The library
+ * reports every refusal on stderr, which goes to /dev/null meanwhile */
+static void bench_verify_corrupt (libthinkfinger *tf, unsigned long iterations)
+{
+	int null;
+	int err;
+
+	fflush (stderr);
+	err = dup (STDERR_FILENO);
+	null = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (null >= 0) {
+		dup2 (null, STDERR_FILENO);
+		close (null);
+	}
+
+	while (iterations--)
+		if (libthinkfinger_verify (corrupt_tf) != TF_RESULT_BIR_CORRUPT)
+			verify_failures++;
+
+	fflush (stderr);
+	if (err >= 0) {
+		dup2 (err, STDERR_FILENO);
+		close (err);
+	}
+}
+
+static struct bench benchmarks[] = {
+	{ "udf_crc/16",          bench_crc_16,              4000000, 16 },
+	{ "udf_crc/64",          bench_crc_64,              1000000, 64 },
+	{ "udf_crc/256",         bench_crc_256,              250000, 256 },
+	{ "udf_crc/1024",        bench_crc_1024,              60000, 1024 },
+	{ "udf_crc/4096",        bench_crc_4096,              15000, 4096 },
+	{ "frame/scan_sequence", bench_frame_scan_sequence, 2000000, sizeof (scan_sequence) },
+	{ "frame/upload",        bench_frame_upload,          60000, sizeof (upload_header) + BENCH_TEMPLATE + 2 },
+	{ "parse/scan_reply",    bench_parse_scan,          4000000, sizeof (reply_scan) },
+	{ "parse/verdict",       bench_parse_verdict,       4000000, sizeof (reply_verdict) },
+	{ "parse/busy",          bench_parse_busy,          4000000, sizeof (reply_busy) },
+	{ "parse/ack",           bench_parse_ack,           4000000, sizeof (reply_ack) },
+	{ "template/store",      bench_template_store,        20000, BENCH_TEMPLATE },
+	{ "template/load",       bench_template_load,         50000, BENCH_TEMPLATE },
+	{ "bir/read",            bench_bir_read,             100000, TF_BIR_FINGERS * BENCH_TEMPLATE },
+	{ "bir/corrupt",         bench_bir_corrupt,          100000, TF_BIR_FINGERS * BENCH_TEMPLATE },
+	{ "startup/new",         bench_startup_new,           20000, 0 },
+	{ "startup/new_probe",   bench_startup_probe,         20000, 0 },
+	{ "startup/handshake",   bench_startup_handshake,     50000, 0 },
+	{ "startup/pipelined",   bench_startup_pipelined,     50000, 0 },
+	{ "stitch/sad",          bench_stitch_sad,          4000000, STITCH_SPAN },
+	{ "stitch/sad_scalar",   bench_stitch_sad_scalar,   1000000, STITCH_SPAN },
+	{ "stitch/strip",        bench_stitch_strip,          50000, TF_STRIP_SIZE },
+	{ "extract/frame",       bench_extract_frame,           200, TF_IMAGE_WIDTH * BENCH_ROWS },
+	{ "extract/batch",       bench_extract_batch,          1024, TF_IMAGE_WIDTH * BENCH_ROWS },
+	{ "identify/256",        bench_identify_256,           2000, 0 },
+	{ "identify/1024",       bench_identify_1024,          1000, 0 },
+	{ "identify/4096",       bench_identify_4096,           250, 0 },
+	{ "verify/full",         bench_verify_full,           10000, BENCH_TEMPLATE },
+	{ "verify/again",        bench_verify_again,          20000, 0 },
+	{ "verify/retry",        bench_verify_retry,          20000, 0 },
+	{ "verify/corrupt",      bench_verify_corrupt,        20000, TF_BIR_FINGERS * BENCH_TEMPLATE },
+	{ NULL,                  NULL,                            0, 0 }
+};
+
+static void bench_run (libthinkfinger *tf, const struct bench *bench, int last)
+{
+	double ns[BENCH_REPEAT];
+	unsigned long long start;
+	int i;
+
+	bench->fn (tf, bench->iterations / 10 + 1);
+	for (i = 0; i < BENCH_REPEAT; i++) {
+		start = bench_now ();
+		bench->fn (tf, bench->iterations);
+		ns[i] = (double) (bench_now () - start) / bench->iterations;
+	}
+	qsort (ns, BENCH_REPEAT, sizeof (double), bench_compare);
+
+	printf ("    { \"name\": \"%s\", \"iterations\": %lu, \"bytes\": %lu, "
+		"\"ns_per_op\": %.2f, \"ns_per_op_min\": %.2f, \"ops_per_sec\": %.0f }%s\n",
+		bench->name, bench->iterations, bench->bytes,
+		ns[BENCH_REPEAT / 2], ns[0], 1e9 / ns[BENCH_REPEAT / 2], last ? "" : ",");
+}
+
+static unsigned int bench_hash (unsigned int a, unsigned int b)
+{
+	unsigned int h = a * 0x9e3779b1U ^ b * 0x85ebca6bU;
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6dU;
+	h ^= h >> 12;
+	return h;
+}
+
+/* minutiae scattered over an image, the same ones for the same number */
+static void bench_minutiae (libthinkfinger_features *features, unsigned int n)
+{
+	libthinkfinger_minutia *m;
+	unsigned int i;
+
+	features->width = TF_IMAGE_WIDTH;
+	features->height = BENCH_ROWS;
+	features->count = 40 + n % 24;
+	for (i = 0; i < features->count; i++) {
+		m = &features->minutiae[i];
+		m->x = 8 + bench_hash (n, 4 * i) % (TF_IMAGE_WIDTH - 16);
+		m->y = 8 + bench_hash (n, 4 * i + 1) % (BENCH_ROWS - 16);
+		m->angle = bench_hash (n, 4 * i + 2) % 360;
+		m->type = bench_hash (n, 4 * i + 3) & 1 ? TF_MINUTIA_ENDING : TF_MINUTIA_BIFURCATION;
+		m->quality = 100 - i;
+	}
+}
+
+/* the galleries, and probes which are templates of them taken again: the
+ * finger turned by a few degrees and moved, some minutiae missed */
+static int bench_identify_setup (void)
+{
+	libthinkfinger_features features;
+	libthinkfinger_minutia *m;
+	unsigned int gallery, i, j;
+	float turn;
+
+	for (gallery = 0; gallery < 3; gallery++) {
+		identify_index[gallery] = libthinkfinger_index_new ();
+		if (identify_index[gallery] == NULL)
+			return -1;
+		for (i = 0; i < 256U << (2 * gallery); i++) {
+			bench_minutiae (&features, i);
+			if (libthinkfinger_index_add (identify_index[gallery], i, &features) < 0)
+				return -1;
+		}
+	}
+
+	for (i = 0; i < BENCH_PROBES; i++) {
+		bench_minutiae (&features, i * 3);
+		turn = ((int) (i % 9) - 4) * IDENTIFY_PI / 180.0f;
+		identify_probe[i] = features;
+		identify_probe[i].count = 0;
+		for (j = 0; j < features.count; j++) {
+			if (j % 5 == 4)
+				continue;
+			m = &identify_probe[i].minutiae[identify_probe[i].count++];
+			*m = features.minutiae[j];
+			m->x = features.minutiae[j].x * cosf (turn) + features.minutiae[j].y * sinf (turn) + 6;
+			m->y = features.minutiae[j].y * cosf (turn) - features.minutiae[j].x * sinf (turn) - 4;
+			m->angle = (features.minutiae[j].angle + (int) (i % 9) - 4 + 360) % 360;
+		}
+	}
+
+	return 0;
+}
+
+static int bench_bir_setup (void)
+{
+	libthinkfinger_init_status init_status;
+	struct bir_template templates[TF_BIR_FINGERS];
+	char path[] = "/tmp/tf-bench-XXXXXX";
+	ssize_t size;
+	int fd;
+	int i;
+
+	for (i = 0; i < TF_BIR_FINGERS; i++) {
+		templates[i].finger = i + 1;
+		templates[i].data = template_frame + 18;
+		templates[i].size = BENCH_TEMPLATE;
+	}
+
+	fd = mkstemp (path);
+	if (fd < 0) {
+		fprintf (stderr, "Error while creating \"%s\": %s.\n", path, strerror (errno));
+		return -1;
+	}
+	unlink (path);
+	size = -1;
+	if (bir_write (fd, templates, TF_BIR_FINGERS) == 0)
+		size = pread (fd, bir_record, sizeof (bir_record), 0);
+	close (fd);
+	if (size <= 0)
+		return -1;
+
+	bir_size = size;
+	memcpy (bir_corrupt, bir_record, bir_size);
+	bir_corrupt[bir_size - BIR_ROUND (BENCH_TEMPLATE) + BENCH_TEMPLATE - 1] ^= 0x01;
+
+	fd = mkstemp (corrupt_path);
+	if (fd < 0) {
+		fprintf (stderr, "Error while creating \"%s\": %s.\n", corrupt_path, strerror (errno));
+		return -1;
+	}
+	size = write (fd, bir_corrupt, bir_size);
+	close (fd);
+	if (size != (ssize_t) bir_size)
+		return -1;
+
+	corrupt_tf = libthinkfinger_new (&init_status);
+	if (corrupt_tf == NULL || libthinkfinger_set_file (corrupt_tf, corrupt_path) < 0)
+		return -1;
+	return 0;
+}
+
+static int bench_setup (libthinkfinger *tf)
+{
+	libthinkfinger_init_status init_status;
+	unsigned int i, x, y, row;
+	int dx, dy;
+
+	for (i = 0; i < sizeof (crc_data); i++)
+		crc_data[i] = (i * 131 + 17) & 0xff;
+
+	/* strips of a ridge pattern, each one to three rows further down */
+	for (i = 0, row = 0; i < BENCH_STRIPS; row += 1 + i++ % 3)
+		for (y = 0; y < TF_STRIP_HEIGHT; y++)
+			for (x = 0; x < TF_STRIP_WIDTH; x++)
+				stitch_strips[i][y * TF_STRIP_WIDTH + x] =
+					((x * 3 + (row + y) * 5) % 11 < 5 ? 48 : 208) + ((x * 7 + (row + y) * 13) & 15);
+	stitch_init (&stitch, stitch_image);
+
+	/* a whorl of ridges nine pixels apart, broken up now and then */
+	for (y = 0; y < BENCH_ROWS; y++) {
+		for (x = 0; x < TF_IMAGE_WIDTH; x++) {
+			dx = (int) x - TF_IMAGE_WIDTH / 2;
+			dy = (int) y - BENCH_ROWS / 2;
+			extract_image[y * TF_IMAGE_WIDTH + x] =
+				((int) sqrt (dx * dx + dy * dy) % 9 < 4 && (x * 5 + y * 3) % 97 > 4 ? 48 : 208) +
+				((x * 7 + y * 13) & 15);
+		}
+	}
+	for (i = 0; i < BENCH_BATCH; i++) {
+		extract_images[i].pixels = extract_image;
+		extract_images[i].width = TF_IMAGE_WIDTH;
+		extract_images[i].height = BENCH_ROWS;
+	}
+
+	if (bench_identify_setup () < 0) {
+		fprintf (stderr, "Error while indexing the galleries.\n");
+		return -1;
+	}
+
+	/* an enrollment reply as the reader sends it, see tf-sim */
+	memcpy (template_frame, reply_ack, 8);
+	template_frame[5] = ((BENCH_TEMPLATE + 9) >> 8) & 0x0f;
+	template_frame[6] = (BENCH_TEMPLATE + 9) & 0xff;
+	for (i = 18; i < sizeof (template_frame); i++)
+		template_frame[i] = (i * 31 + 7) & 0xff;
+
+	tf->fd = mkstemp (template_path);
+	if (tf->fd < 0) {
+		fprintf (stderr, "Error while creating \"%s\": %s.\n", template_path, strerror (errno));
+		return -1;
+	}
+	libthinkfinger_set_file (tf, template_path);
+	_libthinkfinger_store_fingerprint (tf, template_frame);
+
+	verify_tf = libthinkfinger_new_flags (&init_status, TF_FLAG_REARM);
+	if (verify_tf == NULL || libthinkfinger_set_file (verify_tf, template_path) < 0)
+		return -1;
+
+	handshake_tf[0] = libthinkfinger_new_flags (&init_status, TF_FLAG_DEFAULT);
+	handshake_tf[1] = libthinkfinger_new_flags (&init_status, TF_FLAG_PIPELINE);
+	if (handshake_tf[0] == NULL || handshake_tf[1] == NULL)
+		return -1;
+
+	return bench_bir_setup ();
+}
+
+/* the skin of a synthetic finger, no two rows of it alike */
+static u8 bench_texture (int x, int y)
+{
+	return bench_hash (x + 4096, y + 4096) >> 24;
+}
+
+/* stitches a swipe of synthetic strips: every strip is advance rows further
+ * down the finger and drift columns further to the side, the columns from
+ * ridged on show no ridges; returns the verdict */
+static int bench_swipe (struct stitch *check, int strips, int advance, int drift, int ridged)
+{
+	u8 strip[TF_STRIP_SIZE];
+	int i, x, y;
+
+	stitch_reset (check);
+	for (i = 0; i < strips; i++) {
+		for (y = 0; y < TF_STRIP_HEIGHT; y++)
+			for (x = 0; x < TF_STRIP_WIDTH; x++)
+				strip[y * TF_STRIP_WIDTH + x] =
+					x < ridged ? bench_texture (x + i * drift, i * advance + y) : 208;
+		if (stitch_strip (check, strip, i * 4000ULL) != 0)
+			break;
+	}
+	stitch_finish (check);
+
+	return check->swipe.verdict;
+}
+
+/* the intact record reads back, a damaged one is refused whatever the
+ * damage: the header CRC, the version and the size are checked as well as
+ * every template, and a finger is stored once only.  A verification
+ * against the damaged record fails without opening the reader */
+static int bench_check_bir (void)
+{
+	static const char *damages[] = {
+		"a damaged template", "a wrong header CRC", "an unknown version",
+		"a wrong size", "a finger stored twice", NULL
+	};
+	static u8 record[BIR_SIZE_MAX];
+	struct bir_template templates[TF_BIR_FINGERS];
+	struct tf_sim_stats stats;
+	int i;
+
+	if (bir_read (bir_record, bir_size, templates) != TF_BIR_FINGERS) {
+		fprintf (stderr, "tf-bench: the record did not read back.\n");
+		return -1;
+	}
+	for (i = 0; i < TF_BIR_FINGERS; i++) {
+		if (templates[i].finger != (unsigned int) i + 1 || templates[i].size != BENCH_TEMPLATE ||
+		    memcmp (templates[i].data, template_frame + 18, BENCH_TEMPLATE) != 0) {
+			fprintf (stderr, "tf-bench: template %d of the record did not read back.\n", i);
+			return -1;
+		}
+	}
+
+	/* every damage but the first two comes with a header CRC which fits */
+	for (i = 0; damages[i] != NULL; i++) {
+		memcpy (record, bir_record, bir_size);
+		switch (i) {
+			case 0:
+				memcpy (record, bir_corrupt, bir_size);
+				break;
+			case 1:
+				record[BIR_CRC + 2] ^= 0x01;
+				break;
+			case 2:
+				bir_put16 (record + 4, BIR_VERSION + 1);
+				break;
+			case 3:
+				bir_put32 (record + 8, bir_size + BIR_ALIGN);
+				break;
+			case 4:
+				record[BIR_HEADER + BIR_ENTRY + 10] = record[BIR_HEADER + 10];
+				break;
+		}
+		if (i > 1)
+			bir_put16 (record + BIR_CRC, bir_header_crc (record));
+		if (bir_read (record, bir_size, templates) != -1) {
+			fprintf (stderr, "tf-bench: a record with %s was read.\n", damages[i]);
+			return -1;
+		}
+	}
+
+	tf_sim_reset_stats ();
+	if (libthinkfinger_verify (corrupt_tf) != TF_RESULT_BIR_CORRUPT) {
+		fprintf (stderr, "tf-bench: a verification against a damaged record did not fail.\n");
+		return -1;
+	}
+	tf_sim_get_stats (&stats);
+	if (stats.opens != 0) {
+		fprintf (stderr, "tf-bench: a damaged record opened the reader.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_check_stitch (void)
+{
+	struct stitch check;
+	unsigned int (*sad[3]) (const u8 *a, const u8 *b) = { stitch_sad_scalar, NULL, NULL };
+	int i, j, k;
+
+	stitch_init (&check, stitch_image);
+	if (bench_swipe (&check, 32, 3, 1, TF_STRIP_WIDTH) != TF_SWIPE_OK ||
+	    check.swipe.height != TF_STRIP_HEIGHT + 31 * 3 || check.swipe.skew != -31 ||
+	    check.swipe.lost != 0) {
+		fprintf (stderr, "tf-bench: swipe stitched to %u rows, skew %d, verdict 0x%02x.\n",
+			 check.swipe.height, check.swipe.skew, check.swipe.verdict);
+		return -1;
+	}
+	if (bench_swipe (&check, 64, TF_STRIP_HEIGHT + 1, 0, TF_STRIP_WIDTH) != TF_SWIPE_TOO_FAST ||
+	    bench_swipe (&check, 64, 2, 2, TF_STRIP_WIDTH) != TF_SWIPE_SKEWED ||
+	    bench_swipe (&check, 64, 2, 0, TF_STRIP_WIDTH / 3) != TF_SWIPE_PARTIAL) {
+		fprintf (stderr, "tf-bench: bad swipe not rejected.\n");
+		return -1;
+	}
+
+	/* every SAD the CPU has gives what the scalar one does */
+#ifdef STITCH_X86
+	if (__builtin_cpu_supports ("sse2"))
+		sad[1] = stitch_sad_sse2;
+	if (__builtin_cpu_supports ("avx2"))
+		sad[2] = stitch_sad_avx2;
+#endif
+	for (i = 1; i < 3; i++) {
+		if (sad[i] == NULL)
+			continue;
+		for (j = 0; j < BENCH_STRIPS; j++) {
+			for (k = 0; k <= 2 * STITCH_MARGIN; k++) {
+				if (sad[i] (stitch_strips[j], stitch_strips[(j + 1) % BENCH_STRIPS] + k) !=
+				    stitch_sad_scalar (stitch_strips[j], stitch_strips[(j + 1) % BENCH_STRIPS] + k)) {
+					fprintf (stderr, "tf-bench: %s SAD differs from the scalar one.\n",
+						 i == 1 ? "SSE2" : "AVX2");
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* parallel ridges nine pixels apart, dislocated at two points: right of
+ * the first a ridge forks, right of the second one ends */
+static const libthinkfinger_minutia extract_expected[2] = {
+	{ .x = 80, .y = 128, .type = TF_MINUTIA_BIFURCATION },
+	{ .x = 170, .y = 256, .type = TF_MINUTIA_ENDING }
+};
+
+static void bench_ridges (u8 *pixels)
+{
+	float phase;
+	int x, y;
+
+	for (y = 0; y < BENCH_ROWS; y++) {
+		for (x = 0; x < TF_IMAGE_WIDTH; x++) {
+			phase = 2.0f * EXTRACT_PI * y / GABOR_PERIOD +
+				atan2f (y - extract_expected[0].y, x - extract_expected[0].x) -
+				atan2f (y - extract_expected[1].y, x - extract_expected[1].x);
+			pixels[y * TF_IMAGE_WIDTH + x] = (cosf (phase) > 0.0f ? 48 : 208) + ((x * 7 + y * 13) & 15);
+		}
+	}
+}
+
+/* the minutiae of the dislocations are found, within a ridge of where they
+ * are, and every Gabor filter the CPU has gives what the scalar one does */
+static int bench_check_extract (void)
+{
+	void (*gabor[3]) (const float *src, const float *kernel, float *dst) = { extract_gabor_scalar, NULL, NULL };
+	static u8 ridges[TF_IMAGE_WIDTH * BENCH_ROWS];
+	libthinkfinger_image images[2] = {
+		{ .pixels = ridges, .width = TF_IMAGE_WIDTH, .height = BENCH_ROWS },
+		{ .pixels = extract_image, .width = TF_IMAGE_WIDTH, .height = BENCH_ROWS }
+	};
+	libthinkfinger_features features[2];
+	const libthinkfinger_minutia *m;
+	struct extract *extract;
+	size_t size = BENCH_ROWS * EXTRACT_COLS;
+	float *scalar = NULL;
+	int retval = -1;
+	int i, j, n;
+	size_t k;
+
+	extract = extract_new ();
+	scalar = malloc (size * sizeof (float));
+	if (extract == NULL || scalar == NULL)
+		goto out;
+	bench_ridges (ridges);
+
+	extract->gabor = extract_gabor_scalar;
+	extract_features (extract, &images[0], &features[0]);
+	if (features[0].count != 2) {
+		fprintf (stderr, "tf-bench: %u minutiae found instead of 2.\n", features[0].count);
+		goto out;
+	}
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			m = &features[0].minutiae[j];
+			if (m->type == extract_expected[i].type &&
+			    abs ((int) m->x - (int) extract_expected[i].x) <= 4 &&
+			    abs ((int) m->y - (int) extract_expected[i].y) <= 4)
+				break;
+		}
+		if (j == 2) {
+			fprintf (stderr, "tf-bench: minutia at %u,%u not found.\n",
+				 extract_expected[i].x, extract_expected[i].y);
+			goto out;
+		}
+	}
+
+#ifdef EXTRACT_X86
+	if (__builtin_cpu_supports ("sse2"))
+		gabor[1] = extract_gabor_sse2;
+	if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+		gabor[2] = extract_gabor_avx2;
+#endif
+	for (n = 0; n < 2; n++) {
+		extract->gabor = extract_gabor_scalar;
+		extract_features (extract, &images[n], &features[0]);
+		memcpy (scalar, extract->enhanced, size * sizeof (float));
+		for (i = 1; i < 3; i++) {
+			if (gabor[i] == NULL)
+				continue;
+			extract->gabor = gabor[i];
+			extract_features (extract, &images[n], &features[1]);
+			/* FMA rounds once where the scalar code rounds twice */
+			for (k = 0; k < size; k++)
+				if (fabsf (extract->enhanced[k] - scalar[k]) > 1e-4f * (fabsf (scalar[k]) + 1.0f))
+					break;
+			if (k < size || features[1].count != features[0].count ||
+			    memcmp (features[1].minutiae, features[0].minutiae,
+				    features[0].count * sizeof (features[0].minutiae[0])) != 0) {
+				fprintf (stderr, "tf-bench: %s Gabor filter differs from the scalar one.\n",
+					 i == 1 ? "SSE2" : "AVX2");
+				goto out;
+			}
+		}
+	}
+	retval = 0;
+out:
+	free (scalar);
+	extract_free (extract);
+	return retval;
+}
+
+/* every probe finds the template it was taken from first, in every
+ * gallery, and fingers which were not enrolled match none */
+static int bench_check_identify (void)
+{
+	libthinkfinger_features stranger;
+	unsigned int gallery, i;
+	int n;
+
+	for (gallery = 0; gallery < 3; gallery++) {
+		for (i = 0; i < BENCH_PROBES; i++) {
+			n = libthinkfinger_identify (identify_index[gallery], &identify_probe[i], identify_found, 8, 0);
+			if (n < 1 || identify_found[0].id != i * 3 || identify_found[0].score < BENCH_MATCH) {
+				fprintf (stderr, "tf-bench: probe %u of %u templates not found first.\n",
+					 i, 256U << (2 * gallery));
+				return -1;
+			}
+		}
+		/* templates are numbered from 0, beyond the largest gallery */
+		for (i = 0; i < 8; i++) {
+			bench_minutiae (&stranger, 100000 + i);
+			n = libthinkfinger_identify (identify_index[gallery], &stranger, identify_found, 8, 0);
+			if (n < 0 || (n > 0 && identify_found[0].score >= BENCH_MATCH)) {
+				fprintf (stderr, "tf-bench: finger not enrolled matched template %u of %u.\n",
+					 identify_found[0].id, 256U << (2 * gallery));
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* a verification and a retry on a live handle match, and only re-arm the
+ * reader when the handle opted in; else the template is uploaded again */
+static int bench_check_verify (void)
+{
+	static const int handles[2] = { TF_FLAG_DEFAULT, TF_FLAG_REARM };
+	libthinkfinger_init_status init_status;
+	struct tf_sim_stats stats;
+	libthinkfinger *check;
+	int flags = 0;
+	int retval = -1;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		flags = handles[i];
+		check = libthinkfinger_new_flags (&init_status, flags);
+		if (check == NULL || libthinkfinger_set_file (check, template_path) < 0 ||
+		    libthinkfinger_verify (check) != TF_RESULT_VERIFY_SUCCESS)
+			goto out;
+		tf_sim_reset_stats ();
+		if (libthinkfinger_verify (check) != TF_RESULT_VERIFY_SUCCESS ||
+		    libthinkfinger_verify_retry (check) != TF_RESULT_VERIFY_SUCCESS)
+			goto out;
+		tf_sim_get_stats (&stats);
+		if (stats.verdicts != 2 || stats.rearms != (flags ? 2 : 0) || stats.uploads != (flags ? 0 : 2))
+			goto out;
+		libthinkfinger_free (check);
+	}
+	check = NULL;
+	retval = 0;
+out:
+	if (retval < 0)
+		fprintf (stderr, "tf-bench: verification on a live handle of flags 0x%02x went wrong.\n", flags);
+	if (check != NULL)
+		libthinkfinger_free (check);
+	return retval;
+}
+
+static unsigned int continuous_failed;
+
+static void bench_continuous_state (libthinkfinger_state state, void *data)
+{
+	if (state == TF_STATE_VERIFY_FAILED)
+		continuous_failed++;
+}
+
+static void *bench_continuous_cancel (void *data)
+{
+	usleep (20000);
+	libthinkfinger_cancel (data);
+	return NULL;
+}
+
+/* a continuous verification goes on after the swipes which do not match,
+ * telling the callback of each, and uploads the template for every swipe
+ * unless the handle opted in to the re-arm; one which never matches ends
+ * once it is cancelled */
+static int bench_check_continuous (void)
+{
+	static const int handles[2] = { TF_FLAG_DEFAULT, TF_FLAG_REARM };
+	struct tf_sim_config config = {
+		1,              /* present */
+		1,              /* verdict */
+		2,              /* swipe_polls */
+		0,              /* busy_replies */
+		BENCH_TEMPLATE, /* template_size */
+		0,              /* latency_us */
+		0,              /* idle_us */
+		BENCH_STRIPS,   /* strips */
+		3               /* misses */
+	};
+	libthinkfinger_init_status init_status;
+	libthinkfinger_result result;
+	libthinkfinger_stats tf_stats;
+	struct tf_sim_stats stats;
+	libthinkfinger *check;
+	pthread_t thread;
+	int flags = 0;
+	int retval = -1;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		flags = handles[i];
+		check = libthinkfinger_new_flags (&init_status, flags);
+		if (check == NULL || libthinkfinger_set_file (check, template_path) < 0 ||
+		    libthinkfinger_set_callback (check, bench_continuous_state, NULL) < 0)
+			goto out;
+
+		continuous_failed = 0;
+		config.misses = 3;
+		tf_sim_configure (&config);
+		tf_sim_reset_stats ();
+		result = libthinkfinger_verify_continuous (check);
+		tf_sim_get_stats (&stats);
+		libthinkfinger_get_stats (check, &tf_stats);
+		if (result != TF_RESULT_VERIFY_SUCCESS || continuous_failed != 3 || stats.verdicts != 4 ||
+		    stats.uploads != (flags ? 1 : 4) || stats.rearms != (flags ? 3 : 0) ||
+		    tf_stats.verify_rearms != (flags ? 3 : 0))
+			goto out;
+
+		config.misses = INT_MAX;
+		tf_sim_configure (&config);
+		if (pthread_create (&thread, NULL, bench_continuous_cancel, check) != 0)
+			goto out;
+		result = libthinkfinger_verify_continuous (check);
+		pthread_join (thread, NULL);
+		if (result != TF_RESULT_SIGINT)
+			goto out;
+		libthinkfinger_free (check);
+	}
+	check = NULL;
+	retval = 0;
+out:
+	if (retval < 0)
+		fprintf (stderr, "tf-bench: continuous verification on a handle of flags 0x%02x went wrong.\n", flags);
+	if (check != NULL)
+		libthinkfinger_free (check);
+	config.misses = 0;
+	tf_sim_configure (&config);
+	return retval;
+}
+
+/* a pipelined handshake the reader does not take falls back to lock-step,
+ * which the task then goes on with, and pipelining stays off */
+static int bench_check_pipeline (void)
+{
+	static const int handles[2] = { TF_FLAG_DEFAULT, TF_FLAG_PIPELINE };
+	libthinkfinger_init_status init_status;
+	libthinkfinger_stats stats;
+	libthinkfinger *check;
+	int flags = 0;
+	int retval = -1;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		flags = handles[i];
+		check = libthinkfinger_new_flags (&init_status, flags);
+		if (check == NULL || libthinkfinger_set_file (check, template_path) < 0 ||
+		    libthinkfinger_verify (check) != TF_RESULT_VERIFY_SUCCESS)
+			goto out;
+		/* the reader is wedged after the upload, the recovery sends the
+		 * initialization sequence again */
+		tf_sim_inject (TF_SIM_FAULT_DESYNC);
+		if (libthinkfinger_verify (check) != TF_RESULT_VERIFY_SUCCESS)
+			goto out;
+		libthinkfinger_get_stats (check, &stats);
+		if (stats.init_pipeline_fallback != (flags ? 1 : 0) || (check->flags & TF_FLAG_PIPELINE) != 0)
+			goto out;
+		if (libthinkfinger_verify (check) != TF_RESULT_VERIFY_SUCCESS)
+			goto out;
+		libthinkfinger_get_stats (check, &stats);
+		if (stats.init_pipeline_fallback != (flags ? 1 : 0))
+			goto out;
+		libthinkfinger_free (check);
+	}
+	check = NULL;
+	retval = 0;
+out:
+	if (retval < 0)
+		fprintf (stderr, "tf-bench: a wedged reader on a handle of flags 0x%02x went wrong.\n", flags);
+	if (check != NULL)
+		libthinkfinger_free (check);
+	return retval;
+}
+
+static libthinkfinger *state_tf;
+/* the sequence of the last transition, 0 while the tasks run */
+static unsigned long state_final;
+static unsigned int state_errors;
+static unsigned int state_ready;
+
+/* a snapshot is never torn: only a running task is named */
+static int bench_state_consistent (const libthinkfinger_snapshot *snapshot)
+{
+	_Bool named = snapshot->task != TF_TASK_IDLE && snapshot->task != TF_TASK_UNDEFINED;
+
+	return snapshot->task_running == named;
+}
+
+/* follows the transitions until the last one.  The tasks leave no gap
+ * near the deadline, a waiter which only returns then was not woken */
+static void *bench_state_watch (void *data)
+{
+	libthinkfinger_snapshot seen, now;
+	unsigned long long start;
+	unsigned long final;
+	unsigned long wakeups = 0;
+	int r;
+
+	libthinkfinger_get_snapshot (state_tf, &seen);
+	__atomic_fetch_add (&state_ready, 1, __ATOMIC_SEQ_CST);
+	while (true) {
+		start = bench_now ();
+		r = libthinkfinger_wait_state (state_tf, seen.sequence, 200, &now);
+		final = __atomic_load_n (&state_final, __ATOMIC_SEQ_CST);
+		if (r < 0 || !bench_state_consistent (&now) ||
+		    (r == 0 && (now.sequence <= seen.sequence || now.time_us < seen.time_us ||
+				bench_now () - start >= 200000000ULL)) ||
+		    (r == 1 && (now.sequence != seen.sequence || final != seen.sequence)))
+			goto out_error;
+		if (r == 0)
+			wakeups++;
+		seen = now;
+		if (final != 0 && seen.sequence == final)
+			break;
+		if (final != 0 && seen.sequence > final)
+			goto out_error;
+	}
+	if (wakeups == 0 || seen.state != TF_STATE_VERIFY_SUCCESS)
+		goto out_error;
+	return NULL;
+out_error:
+	__atomic_fetch_add (&state_errors, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/* reads the snapshot as fast as it can, for as long as the tasks run */
+static void *bench_state_read (void *data)
+{
+	libthinkfinger_snapshot last, now;
+
+	libthinkfinger_get_snapshot (state_tf, &last);
+	__atomic_fetch_add (&state_ready, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n (&state_final, __ATOMIC_SEQ_CST) == 0) {
+		libthinkfinger_get_snapshot (state_tf, &now);
+		if (!bench_state_consistent (&now) || now.sequence < last.sequence ||
+		    now.time_us < last.time_us) {
+			__atomic_fetch_add (&state_errors, 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+		last = now;
+	}
+	return NULL;
+}
+
+/* the published state is read and waited for by several threads while
+ * verifications run: every snapshot is whole, the sequence only grows,
+ * each waiter is woken and sees the last transition, and a wait without
+ * one ends at its deadline */
+static int bench_check_state (void)
+{
+	libthinkfinger_init_status init_status;
+	libthinkfinger_snapshot snapshot;
+	pthread_t threads[BENCH_WATCHERS + 1];
+	unsigned long long start;
+	int started = 0;
+	int retval = -1;
+	int i;
+
+	state_final = 0;
+	state_errors = 0;
+	state_ready = 0;
+	state_tf = libthinkfinger_new_flags (&init_status, TF_FLAG_DEFAULT);
+	if (state_tf == NULL || libthinkfinger_set_file (state_tf, template_path) < 0)
+		goto out;
+
+	for (started = 0; started <= BENCH_WATCHERS; started++)
+		if (pthread_create (&threads[started], NULL,
+				    started < BENCH_WATCHERS ? bench_state_watch : bench_state_read, NULL) != 0)
+			break;
+	/* every thread has seen the state before the first task */
+	while (__atomic_load_n (&state_ready, __ATOMIC_SEQ_CST) < (unsigned int) started)
+		sched_yield ();
+	for (i = 0; i < BENCH_TASKS; i++)
+		if (libthinkfinger_verify (state_tf) != TF_RESULT_VERIFY_SUCCESS)
+			state_errors++;
+	libthinkfinger_get_snapshot (state_tf, &snapshot);
+	__atomic_store_n (&state_final, snapshot.sequence, __ATOMIC_SEQ_CST);
+	while (started > 0)
+		pthread_join (threads[--started], NULL);
+	if (state_errors > 0 || snapshot.task_running || snapshot.state != TF_STATE_VERIFY_SUCCESS)
+		goto out;
+
+	start = bench_now ();
+	if (libthinkfinger_wait_state (state_tf, snapshot.sequence, 20, &snapshot) != 1 ||
+	    bench_now () - start < 20000000ULL)
+		goto out;
+	retval = 0;
+out:
+	if (retval < 0)
+		fprintf (stderr, "tf-bench: the state as other threads see it went wrong (%u).\n", state_errors);
+	if (state_tf != NULL)
+		libthinkfinger_free (state_tf);
+	return retval;
+}
+
+/* a process which holds the reader until it is killed, its verification
+ * never sees a swipe */
+static void bench_lease_hold (void)
+{
+	struct tf_sim_config config = {
+		1,              /* present */
+		1,              /* verdict */
+		INT_MAX,        /* swipe_polls */
+		0,              /* busy_replies */
+		BENCH_TEMPLATE, /* template_size */
+		1000,           /* latency_us */
+		0,              /* idle_us */
+		BENCH_STRIPS,   /* strips */
+		0               /* misses */
+	};
+	libthinkfinger_init_status init_status;
+	libthinkfinger *hold;
+
+	tf_sim_configure (&config);
+	hold = libthinkfinger_new_flags (&init_status, TF_FLAG_LEASE | TF_FLAG_PROBE);
+	if (hold != NULL && libthinkfinger_set_file (hold, template_path) == 0)
+		libthinkfinger_verify (hold);
+	_exit (1);
+}
+
+/* a process which queues for the reader and tells when its turn came */
+static void bench_lease_queue (int fd, char id)
+{
+	libthinkfinger_init_status init_status;
+	libthinkfinger *queued;
+	int retval = 1;
+
+	queued = libthinkfinger_new_flags (&init_status, TF_FLAG_LEASE | TF_FLAG_PROBE);
+	if (queued != NULL && libthinkfinger_set_file (queued, template_path) == 0 &&
+	    libthinkfinger_set_lease_timeout (queued, BENCH_WAIT * 2) == 0 &&
+	    libthinkfinger_verify (queued) == TF_RESULT_VERIFY_SUCCESS)
+		retval = 0;
+	if (write (fd, &id, 1) != 1)
+		retval = 1;
+	if (queued != NULL)
+		libthinkfinger_free (queued);
+	_exit (retval);
+}
+
+/* waits until the lease shows the holder and the waiters */
+static int bench_lease_wait (libthinkfinger *check, pid_t holder, unsigned int waiters)
+{
+	libthinkfinger_lease lease;
+	int i;
+
+	for (i = 0; i < BENCH_WAIT; i++) {
+		if (libthinkfinger_get_lease (check, &lease) < 0)
+			break;
+		if (lease.holder == holder && lease.waiters == waiters)
+			return 0;
+		usleep (1000);
+	}
+	return -1;
+}
+
+/* processes queued for a held reader: one which may not wait long enough
+ * is told the reader is busy, the others get it in the order they asked
+ * for it once the holder died, and it is free again after them */
+static int bench_check_lease (void)
+{
+	libthinkfinger_init_status init_status;
+	libthinkfinger_lease lease;
+	libthinkfinger *check;
+	unsigned long long start;
+	pid_t pids[BENCH_QUEUE + 1] = { 0 };
+	char order[BENCH_QUEUE + 1];
+	int status;
+	int fds[2] = { -1, -1 };
+	int retval = -1;
+	int i;
+
+	check = libthinkfinger_new_flags (&init_status, TF_FLAG_LEASE | TF_FLAG_PROBE);
+	if (check == NULL || libthinkfinger_set_file (check, template_path) < 0)
+		goto out;
+	if (libthinkfinger_get_lease (check, &lease) < 0) {
+		fprintf (stderr, "tf-bench: the reader is not arbitrated, the lease is not checked.\n");
+		retval = 0;
+		goto out;
+	}
+	if (pipe (fds) < 0)
+		goto out;
+
+	if ((pids[0] = fork ()) == 0)
+		bench_lease_hold ();
+	if (pids[0] < 0 || bench_lease_wait (check, pids[0], 0) < 0)
+		goto out;
+
+	libthinkfinger_set_lease_timeout (check, 50);
+	start = bench_now ();
+	if (libthinkfinger_verify (check) != TF_RESULT_DEVICE_BUSY || bench_now () - start < 50000000ULL)
+		goto out;
+
+	for (i = 1; i <= BENCH_QUEUE; i++) {
+		if ((pids[i] = fork ()) == 0)
+			bench_lease_queue (fds[1], '0' + i);
+		if (pids[i] < 0 || bench_lease_wait (check, pids[0], i) < 0)
+			goto out;
+	}
+	close (fds[1]);
+	fds[1] = -1;
+
+	/* nobody hands the reader on, the queue has to notice */
+	kill (pids[0], SIGKILL);
+	waitpid (pids[0], NULL, 0);
+	pids[0] = 0;
+	for (i = 1; i <= BENCH_QUEUE; i++) {
+		if (waitpid (pids[i], &status, 0) < 0)
+			goto out;
+		pids[i] = 0;
+		if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+			goto out;
+	}
+	if (read (fds[0], order, sizeof (order)) != BENCH_QUEUE || memcmp (order, "123", BENCH_QUEUE) != 0)
+		goto out;
+
+	libthinkfinger_set_lease_timeout (check, BENCH_WAIT);
+	if (libthinkfinger_verify (check) != TF_RESULT_VERIFY_SUCCESS)
+		goto out;
+	retval = 0;
+out:
+	if (retval < 0)
+		fprintf (stderr, "tf-bench: processes queued for the reader went wrong.\n");
+	for (i = 0; i <= BENCH_QUEUE; i++) {
+		if (pids[i] <= 0)
+			continue;
+		kill (pids[i], SIGKILL);
+		waitpid (pids[i], NULL, 0);
+	}
+	if (fds[0] >= 0)
+		close (fds[0]);
+	if (fds[1] >= 0)
+		close (fds[1]);
+	if (check != NULL)
+		libthinkfinger_free (check);
+	return retval;
+}
+
+static void *bench_capture_run (void *data)
+{
+	return (void *) (long) libthinkfinger_capture (data);
+}
+
+/* takes the strips of one capture.  The first pass copies them; the second
+ * compares them to the copies while it releases every pair of strips the
+ * other way round and keeps the first strip until every slot of the ring is
+ * taken, so that the capture has to wait for it instead of dropping or
+ * overwriting a strip */
+static int bench_capture_pass (libthinkfinger *check, u8 *copies, int pass)
+{
+	libthinkfinger_strip strip, first, pending, extra;
+	unsigned long n = 0;
+	pthread_t thread;
+	void *result;
+	int retval = -1;
+	int r;
+
+	memset (&pending, 0, sizeof (pending));
+	if (pthread_create (&thread, NULL, bench_capture_run, check) != 0)
+		goto out;
+	while ((r = libthinkfinger_strip_next (check, &strip, 1000)) == 0) {
+		if (strip.sequence != n || n >= BENCH_CAPTURE)
+			break;
+		if (pass == 0) {
+			memcpy (copies + n * TF_STRIP_SIZE, strip.pixels, TF_STRIP_SIZE);
+			libthinkfinger_strip_release (check, &strip);
+		} else {
+			if (memcmp (copies + n * TF_STRIP_SIZE, strip.pixels, TF_STRIP_SIZE) != 0)
+				break;
+			if (n == 0)
+				first = strip;
+			else if (n % 2 == 1)
+				pending = strip;
+			else {
+				libthinkfinger_strip_release (check, &strip);
+				libthinkfinger_strip_release (check, &pending);
+				pending.pixels = NULL;
+			}
+			if (n == CAPTURE_RING_LEN - 1) {
+				if (libthinkfinger_strip_next (check, &extra, 50) != 1)
+					break;
+				libthinkfinger_strip_release (check, &first);
+			}
+		}
+		n++;
+	}
+	if (pending.pixels != NULL)
+		libthinkfinger_strip_release (check, &pending);
+	pthread_join (thread, &result);
+	if (r == 1 && n == BENCH_CAPTURE && (long) result == TF_RESULT_CAPTURE_SUCCESS)
+		retval = 0;
+	else
+		fprintf (stderr, "tf-bench: pass %d of the capture went wrong after %lu strips.\n", pass, n);
+out:
+	return retval;
+}
+
+/* a capture of more strips than the ring holds is taken whole and in order
+ * however the strips are released, and the capture waits for a slot */
+static int bench_check_capture (void)
+{
+	struct tf_sim_config config = {
+		1,              /* present */
+		1,              /* verdict */
+		2,              /* swipe_polls */
+		0,              /* busy_replies */
+		BENCH_TEMPLATE, /* template_size */
+		0,              /* latency_us */
+		0,              /* idle_us */
+		BENCH_CAPTURE,  /* strips */
+		0               /* misses */
+	};
+	libthinkfinger_init_status init_status;
+	libthinkfinger_stats stats;
+	libthinkfinger *check;
+	u8 *copies;
+	int retval = -1;
+
+	copies = malloc (BENCH_CAPTURE * TF_STRIP_SIZE);
+	check = libthinkfinger_new_flags (&init_status, TF_FLAG_CAPTURE);
+	if (copies == NULL || check == NULL)
+		goto out;
+
+	tf_sim_configure (&config);
+	if (bench_capture_pass (check, copies, 0) < 0 || bench_capture_pass (check, copies, 1) < 0)
+		goto out;
+	libthinkfinger_get_stats (check, &stats);
+	if (stats.strips_captured != 2 * BENCH_CAPTURE || stats.capture_stalls == 0) {
+		fprintf (stderr, "tf-bench: %lu strips captured, %lu stalls.\n",
+			 stats.strips_captured, stats.capture_stalls);
+		goto out;
+	}
+	retval = 0;
+out:
+	config.strips = BENCH_STRIPS;
+	tf_sim_configure (&config);
+	if (check != NULL)
+		libthinkfinger_free (check);
+	free (copies);
+	return retval;
+}
+
+/* run before anything is timed, a benchmark of wrong results is worthless */
+static int (*checks[]) (void) = {
+	bench_check_bir,
+	bench_check_stitch,
+	bench_check_extract,
+	bench_check_identify,
+	bench_check_verify,
+	bench_check_continuous,
+	bench_check_state,
+	bench_check_lease,
+	bench_check_pipeline,
+	bench_check_capture,
+	NULL
+};
+
+int main (int argc, char *argv[])
+{
+	libthinkfinger *tf;
+	libthinkfinger_init_status init_status;
+	int i;
+
+	tf = libthinkfinger_new (&init_status);
+	if (init_status != TF_INIT_SUCCESS) {
+		fprintf (stderr, "tf-bench: simulated reader did not initialize (0x%02x).\n", init_status);
+		return 1;
+	}
+	if (_libthinkfinger_usb_init (tf) != TF_INIT_USB_INIT_SUCCESS || bench_setup (tf) < 0)
+		return 1;
+	for (i = 0; checks[i] != NULL; i++)
+		if (checks[i] () < 0)
+			return 1;
+
+	printf ("{\n  \"suite\": \"libthinkfinger-micro\",\n  \"version\": \"%s\",\n"
+		"  \"repeat\": %d,\n  \"benchmarks\": [\n", PACKAGE_VERSION, BENCH_REPEAT);
+	for (i = 0; benchmarks[i].name != NULL; i++)
+		bench_run (tf, &benchmarks[i], benchmarks[i+1].name == NULL);
+	printf ("  ]\n}\n");
+
+	if (verify_failures > 0)
+		fprintf (stderr, "tf-bench: %lu timed verifications went wrong.\n", verify_failures);
+	if (handshake_failures > 0 || handshake_tf[1]->stats.init_pipeline_fallback > 0) {
+		fprintf (stderr, "tf-bench: %lu timed handshakes went wrong, %lu pipelined ones fell back.\n",
+			 handshake_failures, handshake_tf[1]->stats.init_pipeline_fallback);
+		verify_failures++;
+	}
+
+	unlink (template_path);
+	unlink (corrupt_path);
+	for (i = 0; i < 3; i++)
+		libthinkfinger_index_free (identify_index[i]);
+	libthinkfinger_free (verify_tf);
+	libthinkfinger_free (handshake_tf[0]);
+	libthinkfinger_free (handshake_tf[1]);
+	libthinkfinger_free (corrupt_tf);
+	libthinkfinger_free (tf);
+
+	return verify_failures > 0;
+}
@@ -0,0 +1,404 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   tf-pam-bench - End-to-end latency of pam_thinkfinger through libpam
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   The harness writes a private PAM service file which stacks the module
+ *   given on the command line with its options, then runs pam_start/pam_authenticate/pam_end
+ *   in a loop with a scripted conversation.
+ *
+ *   This program is linked with tf-sim and exports its symbols, so the
+ *   libthinkfinger loaded by the module talks to the simulated reader.  It
+ *   also interposes getpwnam (to point the user's home at a scratch BIR) and
+ *   the module's uinput helpers (the carriage return which ends the prompt
+ *   is delivered to the conversation instead of /dev/uinput).  Each
+ *   interposed call timestamps the phase it belongs to.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <security/pam_appl.h>
+
+#include "tf-sim.h"
+
+#define BENCH_SERVICE    "tf-pam-bench"
+#define BENCH_ITERATIONS 2000
+#define BENCH_TEMPLATE   560
+#define BENCH_PROMPT_MS  5000
+
+typedef enum {
+	MARK_START,
+	MARK_AUTH,
+	MARK_GETPWNAM_BEGIN,
+	MARK_GETPWNAM_END,
+	MARK_UINPUT_BEGIN,
+	MARK_UINPUT_END,
+	MARK_PROBE_CLOSE,
+	MARK_VERIFY_OPEN,
+	MARK_UPLOAD,
+	MARK_VERDICT,
+	MARK_CR,
+	MARK_END,
+	MARK_COUNT
+} bench_mark;
+
+struct bench_phase {
+	const char *name;
+	bench_mark from;
+	bench_mark to;
+};
+
+static const struct bench_phase phases[] = {
+	{ "pam_start",        MARK_START,          MARK_AUTH },
+	{ "pam_dispatch",     MARK_AUTH,           MARK_GETPWNAM_BEGIN },
+	{ "getpwnam",         MARK_GETPWNAM_BEGIN, MARK_GETPWNAM_END },
+	{ "bir_check",        MARK_GETPWNAM_END,   MARK_UINPUT_BEGIN },
+	{ "uinput_open",      MARK_UINPUT_BEGIN,   MARK_UINPUT_END },
+	{ "libthinkfinger_new", MARK_UINPUT_END,   MARK_PROBE_CLOSE },
+	{ "thread_start",     MARK_PROBE_CLOSE,    MARK_VERIFY_OPEN },
+	{ "verify_init",      MARK_VERIFY_OPEN,    MARK_UPLOAD },
+	{ "verify_scan",      MARK_UPLOAD,         MARK_VERDICT },
+	{ "verdict_report",   MARK_VERDICT,        MARK_CR },
+	{ "teardown_join",    MARK_CR,             MARK_END },
+	{ "total",            MARK_AUTH,           MARK_END },
+	{ NULL,               0,                   0 }
+};
+
+static pthread_mutex_t mark_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cr_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long long marks[MARK_COUNT];
+static int usb_opens;
+static int usb_closes;
+static int cr_sent;
+
+static char bench_home[] = "/tmp/tf-pam-bench-XXXXXX";
+static struct passwd bench_passwd;
+
+static unsigned long long bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_mark_set (bench_mark mark)
+{
+	pthread_mutex_lock (&mark_mutex);
+	marks[mark] = bench_now ();
+	pthread_mutex_unlock (&mark_mutex);
+}
+
+static void bench_sim_hook (tf_sim_event event, void *data)
+{
+	unsigned long long now = bench_now ();
+
+	pthread_mutex_lock (&mark_mutex);
+	switch (event) {
+		case TF_SIM_EVENT_OPEN:
+			/* the first session is the probe in libthinkfinger_new */
+			if (++usb_opens == 2)
+				marks[MARK_VERIFY_OPEN] = now;
+			break;
+		case TF_SIM_EVENT_CLOSE:
+			if (++usb_closes == 1)
+				marks[MARK_PROBE_CLOSE] = now;
+			break;
+		case TF_SIM_EVENT_UPLOAD:
+			marks[MARK_UPLOAD] = now;
+			break;
+		case TF_SIM_EVENT_VERDICT:
+			marks[MARK_VERDICT] = now;
+			break;
+	}
+	pthread_mutex_unlock (&mark_mutex);
+}
+
+/* interposed functions, see the header */
+
+struct passwd *getpwnam (const char *name)
+{
+	static struct passwd *(*real_getpwnam) (const char *);
+	struct passwd *pw;
+
+	bench_mark_set (MARK_GETPWNAM_BEGIN);
+	if (real_getpwnam == NULL)
+		real_getpwnam = (struct passwd *(*) (const char *)) dlsym (RTLD_NEXT, "getpwnam");
+	pw = real_getpwnam (name);
+	if (pw != NULL) {
+		bench_passwd = *pw;
+		bench_passwd.pw_dir = bench_home;
+		pw = &bench_passwd;
+	}
+	bench_mark_set (MARK_GETPWNAM_END);
+
+	return pw;
+}
+
+int uinput_open (int *fd);
+int uinput_cr (int *fd);
+int uinput_close (int *fd);
+
+int uinput_open (int *fd)
+{
+	bench_mark_set (MARK_UINPUT_BEGIN);
+	*fd = 0;
+	bench_mark_set (MARK_UINPUT_END);
+
+	return 0;
+}
+
+int uinput_cr (int *fd)
+{
+	pthread_mutex_lock (&mark_mutex);
+	marks[MARK_CR] = bench_now ();
+	cr_sent = 1;
+	pthread_cond_broadcast (&cr_cond);
+	pthread_mutex_unlock (&mark_mutex);
+
+	return 0;
+}
+
+int uinput_close (int *fd)
+{
+	return 0;
+}
+
+/* the user types nothing, the prompt returns with the CR the module sends */
+static int bench_conv (int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata)
+{
+	struct pam_response *reply;
+	struct timespec deadline;
+	int i;
+
+	reply = calloc (num_msg, sizeof (struct pam_response));
+	if (reply == NULL)
+		return PAM_BUF_ERR;
+
+	for (i = 0; i < num_msg; i++) {
+		if (msg[i]->msg_style != PAM_PROMPT_ECHO_OFF && msg[i]->msg_style != PAM_PROMPT_ECHO_ON)
+			continue;
+
+		clock_gettime (CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += BENCH_PROMPT_MS / 1000;
+		pthread_mutex_lock (&mark_mutex);
+		while (!cr_sent)
+			if (pthread_cond_timedwait (&cr_cond, &mark_mutex, &deadline) == ETIMEDOUT)
+				break;
+		pthread_mutex_unlock (&mark_mutex);
+		reply[i].resp = strdup ("");
+	}
+	*resp = reply;
+
+	return PAM_SUCCESS;
+}
+
+static int bench_compare (const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int bench_setup (const char *module, char **options, char *confdir, size_t len)
+{
+	unsigned char template[BENCH_TEMPLATE];
+	char path[PATH_MAX];
+	FILE *service;
+	int plen;
+	int fd;
+	int i;
+
+	if (mkdtemp (bench_home) == NULL) {
+		fprintf (stderr, "Error while creating \"%s\": %s.\n", bench_home, strerror (errno));
+		return -1;
+	}
+
+	for (i = 0; i < BENCH_TEMPLATE; i++)
+		template[i] = (i * 31 + 7) & 0xff;
+	snprintf (path, sizeof (path), "%s/.thinkfinger.bir", bench_home);
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || write (fd, template, sizeof (template)) != sizeof (template)) {
+		fprintf (stderr, "Error while writing \"%s\": %s.\n", path, strerror (errno));
+		return -1;
+	}
+	close (fd);
+
+	snprintf (confdir, len, "%s/pam.d", bench_home);
+	mkdir (confdir, 0700);
+	plen = snprintf (path, sizeof (path), "%s/%s", confdir, BENCH_SERVICE);
+	if (plen < 0 || (size_t) plen >= sizeof (path)) {
+		fprintf (stderr, "Error: \"%s/%s\" is too long.\n", confdir, BENCH_SERVICE);
+		return -1;
+	}
+	service = fopen (path, "w");
+	if (service == NULL) {
+		fprintf (stderr, "Error while writing \"%s\": %s.\n", path, strerror (errno));
+		return -1;
+	}
+	fprintf (service, "auth required %s", module);
+	for (i = 0; options[i] != NULL; i++)
+		fprintf (service, " %s", options[i]);
+	fprintf (service, "\n");
+	fclose (service);
+
+	return 0;
+}
+
+static void bench_cleanup (const char *confdir)
+{
+	char path[PATH_MAX];
+	int len;
+
+	len = snprintf (path, sizeof (path), "%s/%s", confdir, BENCH_SERVICE);
+	if (len >= 0 && (size_t) len < sizeof (path))
+		unlink (path);
+	rmdir (confdir);
+	snprintf (path, sizeof (path), "%s/.thinkfinger.bir", bench_home);
+	unlink (path);
+	rmdir (bench_home);
+}
+
+static int bench_authenticate (const char *confdir, const char *user)
+{
+	struct pam_conv conv = { bench_conv, NULL };
+	pam_handle_t *pamh;
+	int retval;
+
+	pthread_mutex_lock (&mark_mutex);
+	memset (marks, 0, sizeof (marks));
+	usb_opens = 0;
+	usb_closes = 0;
+	cr_sent = 0;
+	pthread_mutex_unlock (&mark_mutex);
+
+	bench_mark_set (MARK_START);
+#ifdef HAVE_PAM_START_CONFDIR
+	retval = pam_start_confdir (BENCH_SERVICE, user, &conv, confdir, &pamh);
+#else
+	retval = pam_start (BENCH_SERVICE, user, &conv, &pamh);
+#endif
+	if (retval != PAM_SUCCESS)
+		return retval;
+
+	bench_mark_set (MARK_AUTH);
+	retval = pam_authenticate (pamh, 0);
+	bench_mark_set (MARK_END);
+	pam_end (pamh, retval);
+
+	return retval;
+}
+
+int main (int argc, char *argv[])
+{
+	const char *module;
+	char confdir[PATH_MAX];
+	struct passwd *pw;
+	unsigned long long *samples;
+	int iterations = BENCH_ITERATIONS;
+	int success = 0;
+	int i, j, n;
+
+	if (argc < 2) {
+		fprintf (stderr, "Usage: %s <path to pam_thinkfinger.so> [iterations [module options]]\n", argv[0]);
+		return 1;
+	}
+	module = argv[1];
+	if (argc > 2)
+		iterations = atoi (argv[2]);
+	if (iterations < 1)
+		iterations = 1;
+
+	pw = getpwuid (getuid ());
+	if (pw == NULL) {
+		fprintf (stderr, "Could not determine the current user.\n");
+		return 1;
+	}
+	pw->pw_name = strdup (pw->pw_name);
+
+	tf_sim_configure_env ();
+	tf_sim_set_hook (bench_sim_hook, NULL);
+	if (bench_setup (module, argc > 3 ? argv + 3 : argv + argc, confdir, sizeof (confdir)) < 0)
+		return 1;
+#ifndef HAVE_PAM_START_CONFDIR
+	fprintf (stderr, "Warning: libpam lacks pam_start_confdir, copy %s/%s to /etc/pam.d.\n", confdir, BENCH_SERVICE);
+#endif
+
+	samples = calloc ((size_t) iterations * MARK_COUNT, sizeof (unsigned long long));
+	if (samples == NULL)
+		return 1;
+
+	for (i = 0; i < iterations; i++) {
+		if (bench_authenticate (confdir, pw->pw_name) == PAM_SUCCESS)
+			success++;
+		pthread_mutex_lock (&mark_mutex);
+		memcpy (samples + (size_t) i * MARK_COUNT, marks, sizeof (marks));
+		pthread_mutex_unlock (&mark_mutex);
+	}
+
+	printf ("{\n  \"suite\": \"pam-authenticate\",\n  \"version\": \"%s\",\n"
+		"  \"iterations\": %d,\n  \"success\": %d,\n  \"phases\": [\n",
+		PACKAGE_VERSION, iterations, success);
+	for (j = 0; phases[j].name != NULL; j++) {
+		unsigned long long *values = calloc (iterations, sizeof (unsigned long long));
+		unsigned long long sum = 0;
+
+		if (values == NULL)
+			return 1;
+		for (i = 0, n = 0; i < iterations; i++) {
+			unsigned long long *m = samples + (size_t) i * MARK_COUNT;
+
+			/* phases which did not happen (e.g. a failed init) are skipped */
+			if (m[phases[j].from] == 0 || m[phases[j].to] < m[phases[j].from])
+				continue;
+			values[n] = m[phases[j].to] - m[phases[j].from];
+			sum += values[n++];
+		}
+		qsort (values, n, sizeof (unsigned long long), bench_compare);
+		printf ("    { \"name\": \"%s\", \"samples\": %d, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+			"\"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f }%s\n",
+			phases[j].name, n,
+			n ? sum / 1000.0 / n : 0.0,
+			n ? values[n / 2] / 1000.0 : 0.0,
+			n ? values[n * 9 / 10] / 1000.0 : 0.0,
+			n ? values[n * 99 / 100] / 1000.0 : 0.0,
+			n ? values[n - 1] / 1000.0 : 0.0,
+			phases[j+1].name != NULL ? "," : "");
+		free (values);
+	}
+	printf ("  ]\n}\n");
+
+	free (samples);
+	bench_cleanup (confdir);
+
+	return success == iterations ? 0 : 1;
+}
@@ -0,0 +1,765 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   tf-sim - A libusb-0.1 stand-in emulating the fingerprint reader
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   The simulated reader answers every frame written to the bulk OUT
+ *   endpoint with the reply the real device would send:
+ *
+ *   - init and deinit frames are acknowledged,
+ *   - a template upload (0x03 0x02) or an enroll request (0x02 0x02) starts
+ *     a scripted swipe which is played back one reply per scan poll,
+ *   - verification ends with a verdict, enrollment with the template frame,
+ *   - the uploaded template stays on the reader until an enrollment or a
+ *     port reset; a re-arm request (0x05 0x02) verifies the next swipe
+ *     against it, without one the request fails,
+ *   - a capture request (0x04 0x02) is acknowledged and followed by the strips
+ *     of a synthetic swipe and an empty frame, one frame per read.
+ *
+ *   A fault injected with tf_sim_inject wedges the reader as soon as the
+ *   next template upload or enroll request has been acknowledged.  It stays
+ *   until the host does what clears it, see tf_sim_fault.
+ *
+ *   Frames may be written in several transfers, they are collected until
+ *   their length field is satisfied like the device does.
+ *
+ *   Reads on an empty endpoint time out after idle_us instead of the caller's
+ *   timeout, so a missing reply never stalls a benchmark.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <usb.h>
+
+#include "tf-sim.h"
+
+#define SIM_VENDOR_ID     0x0483
+#define SIM_PRODUCT_ID    0x2016
+#define SIM_WR_EP         0x02
+#define SIM_RD_EP         0x81
+#define SIM_FRAME_MAX     4200
+#define SIM_QUEUE_LEN     32
+#define SIM_MAX_PACKET    64
+#define SIM_STRIP_WIDTH   248
+#define SIM_STRIP_HEIGHT  4
+
+typedef enum {
+	SIM_TASK_NONE,
+	SIM_TASK_VERIFY,
+	SIM_TASK_ENROLL,
+	SIM_TASK_CAPTURE
+} sim_task;
+
+struct sim_frame {
+	unsigned char data[SIM_FRAME_MAX];
+	int len;
+	int offset;
+	int verdict;
+};
+
+struct usb_dev_handle {
+	struct usb_device *dev;
+};
+
+struct usb_bus *usb_busses = NULL;
+
+static struct usb_bus sim_bus;
+static struct usb_device sim_device;
+
+static struct usb_endpoint_descriptor sim_endpoints[2];
+static struct usb_interface_descriptor sim_altsetting;
+static struct usb_interface sim_interface;
+static struct usb_config_descriptor sim_config_descriptor;
+
+static struct tf_sim_config sim_config = {
+	1,    /* present */
+	1,    /* verdict */
+	2,    /* swipe_polls */
+	0,    /* busy_replies */
+	560,  /* template_size */
+	0,    /* latency_us */
+	0,    /* idle_us */
+	64,   /* strips */
+	0     /* misses */
+};
+
+static struct tf_sim_stats sim_stats;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sim_frame sim_queue[SIM_QUEUE_LEN];
+static int sim_queue_head;
+static int sim_queue_count;
+
+static unsigned char sim_rx[SIM_FRAME_MAX];
+static int sim_rx_len;
+
+static sim_task sim_current_task = SIM_TASK_NONE;
+static int sim_step;
+static int sim_strip_row;
+/* a template has been uploaded; the verdicts given since the configuration */
+static int sim_template_resident;
+static int sim_attempts;
+
+static tf_sim_hook sim_hook;
+static void *sim_hook_data;
+
+static tf_sim_fault sim_fault = TF_SIM_FAULT_NONE;
+static tf_sim_fault sim_fault_armed = TF_SIM_FAULT_NONE;
+
+static unsigned short sim_crc (const unsigned char *data, int size)
+{
+	unsigned short crc = 0;
+	int i;
+
+	while (size-- > 0) {
+		crc ^= *(data++) << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+static void sim_queue_reset (void)
+{
+	sim_queue_head = 0;
+	sim_queue_count = 0;
+	sim_rx_len = 0;
+	sim_current_task = SIM_TASK_NONE;
+	sim_step = 0;
+}
+
+static struct sim_frame *sim_queue_tail (void)
+{
+	struct sim_frame *frame;
+
+	if (sim_queue_count == SIM_QUEUE_LEN) {
+		fprintf (stderr, "tf-sim: reply queue overflow.\n");
+		return NULL;
+	}
+
+	frame = &sim_queue[(sim_queue_head + sim_queue_count++) % SIM_QUEUE_LEN];
+	frame->len = 0;
+	frame->offset = 0;
+	frame->verdict = 0;
+
+	return frame;
+}
+
+/* lays out a reply frame: "Ciao", flags, sequence/length, type, payload, CRC */
+static unsigned char *sim_reply_begin (unsigned char seq, int length, unsigned char type)
+{
+	struct sim_frame *frame;
+
+	frame = sim_queue_tail ();
+	if (frame == NULL)
+		return NULL;
+
+	frame->len = length + 9;
+	memset (frame->data, 0, frame->len);
+	memcpy (frame->data, "Ciao", 4);
+	frame->data[5] = (seq & 0xf0) | ((length >> 8) & 0x0f);
+	frame->data[6] = length & 0xff;
+	frame->data[7] = type;
+
+	return frame->data;
+}
+
+static void sim_reply_end (unsigned char *data)
+{
+	int len = (((data[5] & 0x0f) << 8) | data[6]) + 9;
+	unsigned short crc = sim_crc (data+4, len-6);
+
+	data[len-2] = crc & 0xff;
+	data[len-1] = crc >> 8;
+}
+
+static void sim_reply_ack (unsigned char seq)
+{
+	unsigned char *data = sim_reply_begin (seq, 0x09, 0x28);
+
+	if (data != NULL)
+		sim_reply_end (data);
+}
+
+static void sim_reply_scan (unsigned char seq, unsigned char code)
+{
+	unsigned char *data = sim_reply_begin (seq, 0x14, 0x28);
+
+	if (data != NULL) {
+		data[18] = code;
+		sim_reply_end (data);
+	}
+}
+
+static void sim_reply_comm_failed (unsigned char seq)
+{
+	unsigned char *data = sim_reply_begin (seq, 0x07, 0x28);
+
+	if (data != NULL)
+		sim_reply_end (data);
+}
+
+static void sim_fault_engage (void)
+{
+	if (sim_fault_armed != TF_SIM_FAULT_NONE) {
+		sim_fault = sim_fault_armed;
+		sim_fault_armed = TF_SIM_FAULT_NONE;
+	}
+}
+
+static void sim_reply_busy (void)
+{
+	unsigned char *data = sim_reply_begin (0x00, 0x01, 0xa1);
+
+	if (data != NULL)
+		sim_reply_end (data);
+}
+
+static void sim_reply_verdict (unsigned char seq)
+{
+	unsigned char *data = sim_reply_begin (seq, 0x13, 0x28);
+
+	if (data != NULL) {
+		data[14] = sim_config.verdict && sim_attempts++ >= sim_config.misses ? 0x01 : 0x00;
+		sim_reply_end (data);
+		sim_queue[(sim_queue_head + sim_queue_count - 1) % SIM_QUEUE_LEN].verdict = 1;
+	}
+	sim_stats.verdicts++;
+}
+
+static void sim_reply_template (unsigned char seq)
+{
+	const unsigned char fingerprint_is[] = {
+		0x00, 0x00, 0x00, 0x02, 0x12, 0xff, 0xff, 0xff,
+		0xff
+	};
+	unsigned char *data;
+	int i;
+
+	data = sim_reply_begin (seq, sim_config.template_size + 9, 0x28);
+	if (data == NULL)
+		return;
+
+	memcpy (data+9, fingerprint_is, sizeof (fingerprint_is));
+	for (i = 18; i < sim_config.template_size + 16; i++)
+		data[i] = (i * 31 + 7) & 0xff;
+	sim_reply_end (data);
+}
+
+static int sim_isqrt (int n)
+{
+	int root = 0;
+	int bit;
+
+	for (bit = 1 << 14; bit > 0; bit >>= 1)
+		if ((root + bit) * (root + bit) <= n)
+			root += bit;
+
+	return root;
+}
+
+/* a strip of a finger with concentric ridges; each strip advances by one
+ * to three rows, so neighbouring strips overlap */
+static void sim_reply_strip (void)
+{
+	unsigned char *data;
+	int x, y, dx, dy;
+
+	data = sim_reply_begin (0x00, SIM_STRIP_WIDTH * SIM_STRIP_HEIGHT, 0x00);
+	if (data == NULL)
+		return;
+
+	data[4] = 0x0a;
+	for (y = 0; y < SIM_STRIP_HEIGHT; y++) {
+		for (x = 0; x < SIM_STRIP_WIDTH; x++) {
+			dx = x - SIM_STRIP_WIDTH / 2;
+			dy = (sim_strip_row + y) - 96;
+			data[7 + y * SIM_STRIP_WIDTH + x] =
+				(sim_isqrt (dx * dx + dy * dy) % 9 < 4 ? 48 : 208) +
+				((x * 7 + (sim_strip_row + y) * 13) & 15);
+		}
+	}
+	sim_reply_end (data);
+	sim_strip_row += 1 + sim_step % 3;
+}
+
+/* the strips of the swipe are made as they are read */
+static void sim_capture_next (void)
+{
+	unsigned char *data;
+
+	if (sim_step++ < sim_config.strips) {
+		sim_reply_strip ();
+		return;
+	}
+
+	data = sim_reply_begin (0x00, 0x00, 0x00);
+	if (data != NULL) {
+		data[4] = 0x0a;
+		sim_reply_end (data);
+	}
+	sim_current_task = SIM_TASK_NONE;
+}
+
+/* plays back the next reply of the scripted swipe */
+static void sim_reply_next (unsigned char seq)
+{
+	int polls = sim_config.swipe_polls + 1;
+	int busy = sim_config.busy_replies;
+	int step = sim_step++;
+	int swipe;
+
+	switch (sim_current_task) {
+		case SIM_TASK_VERIFY:
+			if (step < polls)
+				sim_reply_scan (seq, 0x0c);
+			else if (step == polls)
+				sim_reply_scan (seq, 0x20);
+			else if (step <= polls + busy)
+				sim_reply_busy ();
+			else if (step == polls + busy + 1)
+				sim_reply_verdict (seq);
+			else
+				sim_reply_ack (seq);
+			break;
+		case SIM_TASK_ENROLL:
+			swipe = step / (polls + 1);
+			if (swipe < 3) {
+				step = step % (polls + 1);
+				sim_reply_scan (seq, step < polls ? 0x0c + swipe : 0x20);
+				break;
+			}
+			step -= 3 * (polls + 1);
+			if (step < busy)
+				sim_reply_busy ();
+			else if (step == busy)
+				sim_reply_scan (seq, 0x00);
+			else if (step == busy + 1)
+				sim_reply_template (seq);
+			else
+				sim_reply_ack (seq);
+			break;
+		default:
+			sim_reply_ack (seq);
+			break;
+	}
+}
+
+static void sim_event (tf_sim_event event)
+{
+	if (sim_hook != NULL)
+		sim_hook (event, sim_hook_data);
+}
+
+static void sim_receive (const unsigned char *data, int size)
+{
+	unsigned short crc;
+
+	if (size < 9 || memcmp (data, "Ciao", 4)) {
+		fprintf (stderr, "tf-sim: ignoring malformed frame (0x%x bytes).\n", size);
+		return;
+	}
+
+	crc = data[size-2] | (data[size-1] << 8);
+	if (crc != sim_crc (data+4, size-6))
+		sim_stats.crc_errors++;
+
+	if (sim_fault == TF_SIM_FAULT_DESYNC || sim_fault == TF_SIM_FAULT_BUSY) {
+		if (sim_fault == TF_SIM_FAULT_BUSY && data[4] == 0x07) {
+			sim_fault = TF_SIM_FAULT_NONE;
+			sim_current_task = SIM_TASK_NONE;
+			sim_reply_ack (0x00);
+		} else
+			sim_reply_comm_failed (data[5]);
+		return;
+	}
+
+	switch (data[4]) {
+		case 0x07:
+			/* deinit */
+			sim_current_task = SIM_TASK_NONE;
+			sim_reply_ack (0x00);
+			break;
+		case 0x09:
+			/* device busy, the host asks for the pending result */
+			sim_reply_next (data[5]);
+			break;
+		case 0x00:
+			if (size > 14 && data[12] == 0x03 && data[13] == 0x02) {
+				sim_current_task = SIM_TASK_VERIFY;
+				sim_step = 0;
+				sim_template_resident = 1;
+				sim_stats.uploads++;
+				sim_reply_ack (data[5]);
+				sim_fault_engage ();
+				sim_event (TF_SIM_EVENT_UPLOAD);
+			} else if (size > 13 && data[12] == 0x05 && data[13] == 0x02) {
+				if (sim_template_resident) {
+					sim_current_task = SIM_TASK_VERIFY;
+					sim_step = 0;
+					sim_stats.rearms++;
+					sim_reply_ack (data[5]);
+				} else
+					sim_reply_comm_failed (data[5]);
+			} else if (size > 14 && data[12] == 0x02 && data[13] == 0x02) {
+				sim_current_task = SIM_TASK_ENROLL;
+				sim_step = 0;
+				sim_template_resident = 0;
+				sim_reply_ack (data[5]);
+				sim_fault_engage ();
+			} else if (size > 13 && data[12] == 0x04 && data[13] == 0x02) {
+				sim_current_task = SIM_TASK_CAPTURE;
+				sim_step = 0;
+				sim_strip_row = 0;
+				sim_reply_ack (data[5]);
+			} else if (size > 14 && data[12] == 0x00 && data[13] == 0x30) {
+				if (data[14] == 0x00) {
+					/* termination request */
+					sim_current_task = SIM_TASK_NONE;
+					sim_reply_ack (data[5]);
+				} else
+					sim_reply_next (data[5]);
+			} else
+				sim_reply_ack (data[5]);
+			break;
+		default:
+			sim_reply_ack (data[5]);
+			break;
+	}
+}
+
+/* collects written data until a whole frame is there, then handles it */
+static void sim_collect (const unsigned char *data, int size)
+{
+	int len;
+
+	if (sim_rx_len + size > SIM_FRAME_MAX) {
+		fprintf (stderr, "tf-sim: dropping overlong frame (0x%x bytes).\n", sim_rx_len + size);
+		sim_rx_len = 0;
+		return;
+	}
+	memcpy (sim_rx + sim_rx_len, data, size);
+	sim_rx_len += size;
+
+	while (sim_rx_len >= 7) {
+		if (memcmp (sim_rx, "Ciao", 4)) {
+			sim_receive (sim_rx, sim_rx_len);
+			sim_rx_len = 0;
+			return;
+		}
+
+		len = (((sim_rx[5] & 0x0f) << 8) | sim_rx[6]) + 9;
+		if (sim_rx_len < len)
+			return;
+		sim_receive (sim_rx, len);
+		sim_rx_len -= len;
+		memmove (sim_rx, sim_rx + len, sim_rx_len);
+	}
+}
+
+static void sim_delay (int usec)
+{
+	if (usec > 0)
+		usleep (usec);
+}
+
+static int sim_env (const char *name, int fallback)
+{
+	const char *value = getenv (name);
+
+	return value != NULL ? atoi (value) : fallback;
+}
+
+void tf_sim_configure (const struct tf_sim_config *config)
+{
+	pthread_mutex_lock (&sim_mutex);
+	sim_config = *config;
+	sim_attempts = 0;
+	pthread_mutex_unlock (&sim_mutex);
+}
+
+void tf_sim_configure_env (void)
+{
+	struct tf_sim_config config = sim_config;
+
+	config.present = sim_env ("TF_SIM_PRESENT", config.present);
+	config.verdict = sim_env ("TF_SIM_VERDICT", config.verdict);
+	config.swipe_polls = sim_env ("TF_SIM_SWIPE_POLLS", config.swipe_polls);
+	config.busy_replies = sim_env ("TF_SIM_BUSY_REPLIES", config.busy_replies);
+	config.template_size = sim_env ("TF_SIM_TEMPLATE_SIZE", config.template_size);
+	config.latency_us = sim_env ("TF_SIM_LATENCY_US", config.latency_us);
+	config.idle_us = sim_env ("TF_SIM_IDLE_US", config.idle_us);
+	config.strips = sim_env ("TF_SIM_STRIPS", config.strips);
+	config.misses = sim_env ("TF_SIM_MISSES", config.misses);
+
+	tf_sim_configure (&config);
+}
+
+void tf_sim_get_stats (struct tf_sim_stats *stats)
+{
+	pthread_mutex_lock (&sim_mutex);
+	*stats = sim_stats;
+	pthread_mutex_unlock (&sim_mutex);
+}
+
+void tf_sim_reset_stats (void)
+{
+	pthread_mutex_lock (&sim_mutex);
+	memset (&sim_stats, 0, sizeof (sim_stats));
+	pthread_mutex_unlock (&sim_mutex);
+}
+
+void tf_sim_queue (const unsigned char *data, int size)
+{
+	struct sim_frame *frame;
+
+	if (size > SIM_FRAME_MAX)
+		size = SIM_FRAME_MAX;
+
+	pthread_mutex_lock (&sim_mutex);
+	frame = sim_queue_tail ();
+	if (frame != NULL) {
+		memcpy (frame->data, data, size);
+		frame->len = size;
+	}
+	pthread_mutex_unlock (&sim_mutex);
+}
+
+void tf_sim_set_hook (tf_sim_hook hook, void *data)
+{
+	pthread_mutex_lock (&sim_mutex);
+	sim_hook = hook;
+	sim_hook_data = data;
+	pthread_mutex_unlock (&sim_mutex);
+}
+
+void tf_sim_inject (tf_sim_fault fault)
+{
+	pthread_mutex_lock (&sim_mutex);
+	sim_fault_armed = fault;
+	pthread_mutex_unlock (&sim_mutex);
+}
+
+/* libusb-0.1 API */
+
+void usb_init (void)
+{
+	return;
+}
+
+int usb_find_busses (void)
+{
+	pthread_mutex_lock (&sim_mutex);
+	memset (&sim_bus, 0, sizeof (sim_bus));
+	strcpy (sim_bus.dirname, "001");
+	usb_busses = sim_config.present ? &sim_bus : NULL;
+	pthread_mutex_unlock (&sim_mutex);
+
+	return usb_busses != NULL;
+}
+
+int usb_find_devices (void)
+{
+	pthread_mutex_lock (&sim_mutex);
+	memset (&sim_device, 0, sizeof (sim_device));
+	strcpy (sim_device.filename, "002");
+	sim_device.bus = &sim_bus;
+	sim_device.descriptor.idVendor = SIM_VENDOR_ID;
+	sim_device.descriptor.idProduct = SIM_PRODUCT_ID;
+
+	sim_endpoints[0].bEndpointAddress = SIM_RD_EP;
+	sim_endpoints[0].wMaxPacketSize = SIM_MAX_PACKET;
+	sim_endpoints[1].bEndpointAddress = SIM_WR_EP;
+	sim_endpoints[1].wMaxPacketSize = SIM_MAX_PACKET;
+	sim_altsetting.bNumEndpoints = 2;
+	sim_altsetting.endpoint = sim_endpoints;
+	sim_interface.altsetting = &sim_altsetting;
+	sim_interface.num_altsetting = 1;
+	sim_config_descriptor.bNumInterfaces = 1;
+	sim_config_descriptor.interface = &sim_interface;
+	sim_device.config = &sim_config_descriptor;
+	sim_bus.devices = sim_config.present ? &sim_device : NULL;
+	pthread_mutex_unlock (&sim_mutex);
+
+	return sim_config.present;
+}
+
+usb_dev_handle *usb_open (struct usb_device *dev)
+{
+	usb_dev_handle *handle;
+
+	handle = calloc (1, sizeof (usb_dev_handle));
+	if (handle == NULL)
+		return NULL;
+	handle->dev = dev;
+
+	pthread_mutex_lock (&sim_mutex);
+	sim_queue_reset ();
+	sim_stats.opens++;
+	sim_event (TF_SIM_EVENT_OPEN);
+	pthread_mutex_unlock (&sim_mutex);
+
+	return handle;
+}
+
+int usb_close (usb_dev_handle *dev)
+{
+	pthread_mutex_lock (&sim_mutex);
+	sim_stats.closes++;
+	sim_event (TF_SIM_EVENT_CLOSE);
+	pthread_mutex_unlock (&sim_mutex);
+
+	free (dev);
+	return 0;
+}
+
+int usb_claim_interface (usb_dev_handle *dev, int interface)
+{
+	pthread_mutex_lock (&sim_mutex);
+	sim_stats.claims++;
+	pthread_mutex_unlock (&sim_mutex);
+
+	return 0;
+}
+
+int usb_release_interface (usb_dev_handle *dev, int interface)
+{
+	return 0;
+}
+
+int usb_control_msg (usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout)
+{
+	if (sim_fault == TF_SIM_FAULT_STUCK)
+		return -EIO;
+
+	/* the reader greets the host once the HELLO sequence completed */
+	if (request == 0x0c) {
+		pthread_mutex_lock (&sim_mutex);
+		sim_reply_ack (0x00);
+		pthread_mutex_unlock (&sim_mutex);
+	}
+
+	return size;
+}
+
+int usb_clear_halt (usb_dev_handle *dev, unsigned int ep)
+{
+	int retval = 0;
+
+	pthread_mutex_lock (&sim_mutex);
+	sim_stats.clear_halts++;
+	if (ep == SIM_WR_EP)
+		sim_rx_len = 0;
+	if (sim_fault == TF_SIM_FAULT_STUCK)
+		retval = -EIO;
+	else if (sim_fault == TF_SIM_FAULT_DESYNC)
+		sim_fault = TF_SIM_FAULT_NONE;
+	pthread_mutex_unlock (&sim_mutex);
+
+	return retval;
+}
+
+int usb_reset (usb_dev_handle *dev)
+{
+	int retval = 0;
+
+	pthread_mutex_lock (&sim_mutex);
+	sim_stats.resets++;
+	if (sim_fault == TF_SIM_FAULT_BUSY) {
+		retval = -EPERM;
+	} else {
+		sim_fault = TF_SIM_FAULT_NONE;
+		sim_queue_reset ();
+		sim_template_resident = 0;
+	}
+	pthread_mutex_unlock (&sim_mutex);
+
+	return retval;
+}
+
+int usb_bulk_write (usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+	if (dev == NULL || ep != SIM_WR_EP)
+		return -EINVAL;
+	if (sim_fault == TF_SIM_FAULT_STUCK)
+		return -EIO;
+
+	sim_delay (sim_config.latency_us);
+
+	pthread_mutex_lock (&sim_mutex);
+	sim_stats.writes++;
+	sim_collect ((unsigned char *) bytes, size);
+	pthread_mutex_unlock (&sim_mutex);
+
+	return size;
+}
+
+int usb_bulk_read (usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+	struct sim_frame *frame;
+	int len;
+
+	if (dev == NULL || ep != SIM_RD_EP)
+		return -EINVAL;
+	if (sim_fault == TF_SIM_FAULT_STUCK)
+		return -EIO;
+
+	sim_delay (sim_config.latency_us);
+
+	pthread_mutex_lock (&sim_mutex);
+	sim_stats.reads++;
+	if (sim_queue_count == 0 && sim_current_task == SIM_TASK_CAPTURE)
+		sim_capture_next ();
+	if (sim_queue_count == 0) {
+		sim_stats.timeouts++;
+		pthread_mutex_unlock (&sim_mutex);
+		sim_delay (sim_config.idle_us < timeout * 1000 ? sim_config.idle_us : timeout * 1000);
+		return -ETIMEDOUT;
+	}
+
+	/* short replies are padded up to the requested transfer size */
+	frame = &sim_queue[sim_queue_head];
+	len = frame->len - frame->offset;
+	if (len > size)
+		len = size;
+	memcpy (bytes, frame->data + frame->offset, len);
+	memset (bytes + len, 0, size - len);
+	frame->offset += len;
+	if (frame->offset == frame->len) {
+		if (frame->verdict)
+			sim_event (TF_SIM_EVENT_VERDICT);
+		sim_queue_head = (sim_queue_head + 1) % SIM_QUEUE_LEN;
+		sim_queue_count--;
+	}
+	pthread_mutex_unlock (&sim_mutex);
+
+	return size;
+}
+
+char *usb_strerror (void)
+{
+	return "simulated reader";
+}
@@ -0,0 +1,82 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   tf-sim - A libusb-0.1 stand-in emulating the fingerprint reader
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef TF_SIM_H
+#define TF_SIM_H
+
+/* tf-sim implements the subset of the libusb-0.1 API used by libthinkfinger
+ * and answers the device protocol like the reader does.  Linking it into a
+ * program (and exporting its symbols) replaces libusb for libthinkfinger, so
+ * no hardware is needed. */
+
+struct tf_sim_config {
+	int present;          /* 0 simulates a reader which is not plugged in */
+	int verdict;          /* 1 = fingerprint matches, 0 = does not match */
+	int swipe_polls;      /* scan replies before the finger is swiped */
+	int busy_replies;     /* "device busy" round trips before each verdict */
+	int template_size;    /* size of the template returned by enrollment */
+	int latency_us;       /* simulated latency of every bulk transfer */
+	int idle_us;          /* time until a read on an empty endpoint times out */
+	int strips;           /* strips of a captured swipe */
+	int misses;           /* verdicts which do not match before one does, from tf_sim_configure */
+};
+
+typedef enum {
+	TF_SIM_EVENT_OPEN,      /* usb_open */
+	TF_SIM_EVENT_CLOSE,     /* usb_close */
+	TF_SIM_EVENT_UPLOAD,    /* template upload received */
+	TF_SIM_EVENT_VERDICT    /* verdict read by the host */
+} tf_sim_event;
+
+typedef void (*tf_sim_hook) (tf_sim_event event, void *data);
+
+typedef enum {
+	TF_SIM_FAULT_NONE,      /* reader works */
+	TF_SIM_FAULT_DESYNC,    /* "communication failed" until the endpoints are cleared */
+	TF_SIM_FAULT_STUCK,     /* every transfer fails until the port is reset */
+	TF_SIM_FAULT_BUSY       /* "communication failed" until deinitialized, no port reset */
+} tf_sim_fault;
+
+struct tf_sim_stats {
+	unsigned long opens;
+	unsigned long closes;
+	unsigned long claims;
+	unsigned long writes;
+	unsigned long reads;
+	unsigned long timeouts;
+	unsigned long crc_errors;
+	unsigned long verdicts;
+	unsigned long resets;
+	unsigned long clear_halts;
+	unsigned long uploads;
+	unsigned long rearms;
+};
+
+void tf_sim_configure (const struct tf_sim_config *config);
+void tf_sim_configure_env (void);
+void tf_sim_get_stats (struct tf_sim_stats *stats);
+void tf_sim_reset_stats (void);
+void tf_sim_queue (const unsigned char *data, int size);
+void tf_sim_set_hook (tf_sim_hook hook, void *data);
+void tf_sim_inject (tf_sim_fault fault);
+
+#endif /* TF_SIM_H */
@@ -0,0 +1,326 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   tf-soak - Long-running lifecycle test of libthinkfinger
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   Every cycle creates a handle, runs one to three verifications (matching
+ *   and non-matching) and now and then an enrollment on it, then frees it.
+ *   The reader is simulated by tf-sim, which this program exports to the
+ *   shared libthinkfinger.  Every SOAK_FAULT_EVERY cycles the reader is
+ *   wedged in one of the ways tf-sim knows, which the library has to
+ *   recover from without failing the verification.  Every other cycle
+ *   the state changes go through the callback queue and are dispatched
+ *   after each task.
+ *
+ *   After every sample interval the resident set size, the number of open
+ *   file descriptors, threads and USB handles, and the mean cycle latency
+ *   are printed as one JSON object per line.  The first sample is the
+ *   baseline; the run fails as soon as any of them grows beyond it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <libthinkfinger.h>
+
+#include "tf-sim.h"
+
+#define SOAK_CYCLES        1000000
+#define SOAK_INTERVAL      10000
+#define SOAK_RSS_SLACK_KB  1024
+#define SOAK_DRIFT_FACTOR  2.0
+#define SOAK_DRIFT_MIN_US  50.0
+#define SOAK_FAULT_EVERY   32
+
+struct soak_sample {
+	unsigned long cycle;
+	long rss_kb;
+	int fds;
+	int threads;
+	long usb_handles;
+	double latency_us;
+};
+
+static char soak_dir[] = "/tmp/tf-soak-XXXXXX";
+static char soak_bir[sizeof (soak_dir) + 32];
+static char soak_acquire[sizeof (soak_dir) + 32];
+static unsigned long soak_callbacks;
+static unsigned long soak_faults;
+static unsigned long soak_recoveries;
+
+static const tf_sim_fault soak_fault[] = {
+	TF_SIM_FAULT_DESYNC,
+	TF_SIM_FAULT_STUCK,
+	TF_SIM_FAULT_BUSY
+};
+
+static unsigned long long soak_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long soak_rss_kb (void)
+{
+	long size = 0, resident = 0;
+	FILE *statm;
+
+	statm = fopen ("/proc/self/statm", "r");
+	if (statm == NULL)
+		return -1;
+	if (fscanf (statm, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose (statm);
+
+	return resident < 0 ? -1 : resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static int soak_fds (void)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int fds = 0;
+
+	dir = opendir ("/proc/self/fd");
+	if (dir == NULL)
+		return -1;
+	while ((entry = readdir (dir)) != NULL)
+		if (entry->d_name[0] != '.')
+			fds++;
+	closedir (dir);
+
+	/* do not count the descriptor of the directory stream itself */
+	return fds - 1;
+}
+
+static int soak_threads (void)
+{
+	char line[256];
+	int threads = -1;
+	FILE *status;
+
+	status = fopen ("/proc/self/status", "r");
+	if (status == NULL)
+		return -1;
+	while (fgets (line, sizeof (line), status) != NULL)
+		if (sscanf (line, "Threads: %d", &threads) == 1)
+			break;
+	fclose (status);
+
+	return threads;
+}
+
+static void soak_callback (libthinkfinger_state state, void *data)
+{
+	soak_callbacks++;
+}
+
+static void soak_verdict (int match)
+{
+	struct tf_sim_config config = {
+		1,      /* present */
+		match,  /* verdict */
+		2,      /* swipe_polls */
+		1,      /* busy_replies */
+		560,    /* template_size */
+		0,      /* latency_us */
+		0,      /* idle_us */
+		0,      /* strips */
+		0       /* misses */
+	};
+
+	tf_sim_configure (&config);
+}
+
+/* one new/verify/free cycle, returns 0 if every task gave the expected result */
+static int soak_cycle (unsigned long cycle)
+{
+	libthinkfinger *tf;
+	libthinkfinger_init_status init_status;
+	libthinkfinger_result result;
+	libthinkfinger_stats stats;
+	int retval = -1;
+	unsigned long i;
+	int tier;
+
+	tf = libthinkfinger_new_flags (&init_status, cycle % 2 ? TF_FLAG_CALLBACK_QUEUE : TF_FLAG_DEFAULT);
+	if (init_status != TF_INIT_SUCCESS) {
+		fprintf (stderr, "tf-soak: libthinkfinger_new failed (0x%02x).\n", init_status);
+		goto out;
+	}
+	libthinkfinger_set_callback (tf, soak_callback, NULL);
+
+	if (cycle % 16 == 0) {
+		libthinkfinger_set_file (tf, soak_acquire);
+		result = libthinkfinger_acquire (tf);
+		libthinkfinger_dispatch (tf);
+		if (result != TF_RESULT_ACQUIRE_SUCCESS) {
+			fprintf (stderr, "tf-soak: acquire returned 0x%02x.\n", result);
+			goto out;
+		}
+	}
+
+	if (cycle % SOAK_FAULT_EVERY == 1) {
+		tf_sim_inject (soak_fault[(cycle / SOAK_FAULT_EVERY) % 3]);
+		soak_faults++;
+	}
+
+	for (i = 0; i <= cycle % 3; i++) {
+		int match = (cycle + i) % 8 != 7;
+
+		soak_verdict (match);
+		libthinkfinger_set_file (tf, soak_bir);
+		result = libthinkfinger_verify (tf);
+		libthinkfinger_dispatch (tf);
+		if (result != (match ? TF_RESULT_VERIFY_SUCCESS : TF_RESULT_VERIFY_FAILED)) {
+			fprintf (stderr, "tf-soak: verify returned 0x%02x.\n", result);
+			goto out;
+		}
+	}
+
+	libthinkfinger_get_stats (tf, &stats);
+	for (tier = 0; tier < TF_RECOVERY_COUNT; tier++)
+		soak_recoveries += stats.recovery[tier].successes;
+
+	retval = 0;
+out:
+	if (tf != NULL)
+		libthinkfinger_free (tf);
+	return retval;
+}
+
+static void soak_sample (struct soak_sample *sample, unsigned long cycle, double latency_us)
+{
+	struct tf_sim_stats stats;
+
+	tf_sim_get_stats (&stats);
+	sample->cycle = cycle;
+	sample->rss_kb = soak_rss_kb ();
+	sample->fds = soak_fds ();
+	sample->threads = soak_threads ();
+	sample->usb_handles = (long) stats.opens - (long) stats.closes;
+	sample->latency_us = latency_us;
+
+	printf ("{ \"cycle\": %lu, \"rss_kb\": %ld, \"fds\": %d, \"threads\": %d, "
+		"\"usb_handles\": %ld, \"latency_us\": %.1f, \"callbacks\": %lu, "
+		"\"faults\": %lu, \"recoveries\": %lu }\n",
+		sample->cycle, sample->rss_kb, sample->fds, sample->threads,
+		sample->usb_handles, sample->latency_us, soak_callbacks,
+		soak_faults, soak_recoveries);
+	fflush (stdout);
+}
+
+static const char *soak_check (const struct soak_sample *base, const struct soak_sample *sample)
+{
+	if (sample->fds > base->fds)
+		return "file descriptors leaked";
+	if (sample->threads > base->threads)
+		return "threads leaked";
+	if (sample->usb_handles != 0)
+		return "USB handles leaked";
+	if (soak_recoveries != soak_faults)
+		return "reader not recovered";
+	if (sample->rss_kb > base->rss_kb + SOAK_RSS_SLACK_KB)
+		return "resident set size grew";
+	if (sample->latency_us > base->latency_us * SOAK_DRIFT_FACTOR + SOAK_DRIFT_MIN_US)
+		return "cycle latency drifted";
+
+	return NULL;
+}
+
+static int soak_setup (void)
+{
+	unsigned char template[560];
+	FILE *bir;
+	unsigned int i;
+
+	if (mkdtemp (soak_dir) == NULL) {
+		fprintf (stderr, "Error while creating \"%s\": %s.\n", soak_dir, strerror (errno));
+		return -1;
+	}
+	snprintf (soak_bir, sizeof (soak_bir), "%s/verify.bir", soak_dir);
+	snprintf (soak_acquire, sizeof (soak_acquire), "%s/acquire.bir", soak_dir);
+
+	for (i = 0; i < sizeof (template); i++)
+		template[i] = (i * 31 + 7) & 0xff;
+	bir = fopen (soak_bir, "w");
+	if (bir == NULL || fwrite (template, sizeof (template), 1, bir) != 1) {
+		fprintf (stderr, "Error while writing \"%s\": %s.\n", soak_bir, strerror (errno));
+		return -1;
+	}
+	fclose (bir);
+
+	return 0;
+}
+
+int main (int argc, char *argv[])
+{
+	struct soak_sample base, sample;
+	unsigned long cycles = SOAK_CYCLES;
+	unsigned long interval = SOAK_INTERVAL;
+	unsigned long long start;
+	const char *failure = NULL;
+	unsigned long cycle;
+
+	if (argc > 1)
+		cycles = strtoul (argv[1], NULL, 10);
+	if (argc > 2)
+		interval = strtoul (argv[2], NULL, 10);
+	if (interval == 0)
+		interval = 1;
+
+	if (soak_setup () < 0)
+		return 1;
+
+	start = soak_now ();
+	for (cycle = 1; cycle <= cycles && failure == NULL; cycle++) {
+		if (soak_cycle (cycle) < 0)
+			failure = "unexpected result";
+
+		if (cycle % interval == 0) {
+			double latency_us = (soak_now () - start) / 1000.0 / interval;
+
+			if (cycle == interval) {
+				soak_sample (&base, cycle, latency_us);
+			} else {
+				soak_sample (&sample, cycle, latency_us);
+				failure = soak_check (&base, &sample);
+			}
+			start = soak_now ();
+		}
+	}
+
+	printf ("{ \"result\": \"%s\", \"cycles\": %lu%s%s%s }\n",
+		failure ? "fail" : "pass", cycle - 1,
+		failure ? ", \"reason\": \"" : "", failure ? failure : "", failure ? "\"" : "");
+
+	unlink (soak_bir);
+	unlink (soak_acquire);
+	rmdir (soak_dir);
+
+	return failure ? 1 : 0;
+}
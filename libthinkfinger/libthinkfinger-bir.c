@@ -0,0 +1,208 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   libthinkfinger-bir - Reads and writes biometric identification records
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   A record used to be the bare template the reader sent, it carried
+ *   neither a version nor a checksum and held one finger.  Records are
+ *   now containers of up to TF_BIR_FINGERS templates; all numbers are
+ *   little endian:
+ *
+ *     0    magic "TFB2"
+ *     4    u16 version, BIR_VERSION
+ *     6    u16 number of templates
+ *     8    u32 size of the record
+ *     12   u16 CRC of the header and the directory, taken with 0 in here
+ *     14   18 bytes reserved, 0
+ *     32   the directory, TF_BIR_FINGERS entries of 16 bytes:
+ *            u32 offset, u32 size, u16 CRC of the template, u8 finger
+ *            and 5 bytes reserved
+ *     192  the templates, each at an offset aligned to BIR_ALIGN
+ *
+ *   The header and the directory have a fixed size, so a mapped record is
+ *   checked without a single read, and the templates are uploaded from the
+ *   mapping.  A record without the magic is a legacy one, its template is
+ *   the whole file.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "libthinkfinger.h"
+#include "libthinkfinger-bir.h"
+#include "libthinkfinger-crc.h"
+
+#define BIR_MAGIC   "TFB2"
+#define BIR_VERSION 2
+#define BIR_HEADER  32
+#define BIR_ENTRY   16
+#define BIR_DATA    (BIR_HEADER + TF_BIR_FINGERS * BIR_ENTRY)
+#define BIR_ALIGN   64
+#define BIR_CRC     12
+
+#define BIR_ROUND(size) (((size) + BIR_ALIGN - 1) & ~(BIR_ALIGN - 1))
+
+static u16 bir_get16 (const u8 *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static u32 bir_get32 (const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static void bir_put16 (u8 *p, u16 value)
+{
+	p[0] = value & 0xff;
+	p[1] = value >> 8;
+}
+
+static void bir_put32 (u8 *p, u32 value)
+{
+	p[0] = value & 0xff;
+	p[1] = (value >> 8) & 0xff;
+	p[2] = (value >> 16) & 0xff;
+	p[3] = value >> 24;
+}
+
+/* the CRC of the header and the directory, skipping the field it goes to */
+static u16 bir_header_crc (const u8 *base)
+{
+	static u8 zero[2];
+	u16 crc;
+
+	crc = udf_crc ((u8 *) base, BIR_CRC, 0);
+	crc = udf_crc (zero, sizeof (zero), crc);
+	return udf_crc ((u8 *) base + BIR_CRC + 2, BIR_DATA - BIR_CRC - 2, crc);
+}
+
+_Bool bir_legacy (const u8 *base, size_t size)
+{
+	return size < sizeof (BIR_MAGIC) - 1 || memcmp (base, BIR_MAGIC, sizeof (BIR_MAGIC) - 1) != 0;
+}
+
+/* fills in the templates of the record at base, returns their number or -1
+ * if the record is damaged.  Every template is checked, a record which is
+ * only partly intact is not used at all */
+int bir_read (const u8 *base, size_t size, struct bir_template *templates)
+{
+	const u8 *entry;
+	u32 offset;
+	u32 length;
+	unsigned int count;
+	unsigned int i;
+	unsigned int j;
+	int retval = -1;
+
+	if (size == 0)
+		goto out;
+	if (bir_legacy (base, size) == true) {
+		templates[0].finger = 0;
+		templates[0].data = base;
+		templates[0].size = size;
+		retval = 1;
+		goto out;
+	}
+
+	if (size < BIR_DATA || bir_get16 (base + 4) != BIR_VERSION || bir_get32 (base + 8) != size)
+		goto out;
+	count = bir_get16 (base + 6);
+	if (count == 0 || count > TF_BIR_FINGERS)
+		goto out;
+	if (bir_get16 (base + BIR_CRC) != bir_header_crc (base))
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		entry = base + BIR_HEADER + i * BIR_ENTRY;
+		offset = bir_get32 (entry);
+		length = bir_get32 (entry + 4);
+		if (offset < BIR_DATA || offset % BIR_ALIGN != 0 || offset > size ||
+		    length == 0 || length > size - offset)
+			goto out;
+		templates[i].finger = entry[10];
+		templates[i].data = base + offset;
+		templates[i].size = length;
+		if (templates[i].finger > TF_BIR_FINGERS)
+			goto out;
+		for (j = 0; j < i; j++)
+			if (templates[j].finger == templates[i].finger)
+				goto out;
+		if (udf_crc ((u8 *) templates[i].data, length, 0) != bir_get16 (entry + 8))
+			goto out;
+	}
+	retval = count;
+out:
+	return retval;
+}
+
+/* writes a record of the templates to fd in one go */
+int bir_write (int fd, const struct bir_template *templates, unsigned int count)
+{
+	static u8 pad[BIR_ALIGN];
+	u8 header[BIR_DATA];
+	struct iovec iov[1 + 2 * TF_BIR_FINGERS];
+	unsigned int n = 0;
+	u32 offset = BIR_DATA;
+	u8 *entry;
+	unsigned int i;
+	ssize_t written;
+	int retval = -1;
+
+	if (count == 0 || count > TF_BIR_FINGERS) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	memset (header, 0, sizeof (header));
+	memcpy (header, BIR_MAGIC, sizeof (BIR_MAGIC) - 1);
+	bir_put16 (header + 4, BIR_VERSION);
+	bir_put16 (header + 6, count);
+
+	iov[n].iov_base = header;
+	iov[n++].iov_len = sizeof (header);
+	for (i = 0; i < count; i++) {
+		entry = header + BIR_HEADER + i * BIR_ENTRY;
+		bir_put32 (entry, offset);
+		bir_put32 (entry + 4, templates[i].size);
+		bir_put16 (entry + 8, udf_crc ((u8 *) templates[i].data, templates[i].size, 0));
+		entry[10] = templates[i].finger;
+
+		iov[n].iov_base = (void *) templates[i].data;
+		iov[n++].iov_len = templates[i].size;
+		iov[n].iov_base = pad;
+		iov[n++].iov_len = BIR_ROUND (templates[i].size) - templates[i].size;
+		offset += BIR_ROUND (templates[i].size);
+	}
+	bir_put32 (header + 8, offset);
+	bir_put16 (header + BIR_CRC, bir_header_crc (header));
+
+	written = writev (fd, iov, n);
+	if (written < 0)
+		goto out;
+	if (written != (ssize_t) offset) {
+		errno = EIO;
+		goto out;
+	}
+	retval = 0;
+out:
+	return retval;
+}
@@ -0,0 +1,20 @@
+#ifndef THINKFINGER_BIR_H
+#define THINKFINGER_BIR_H
+
+#include <stddef.h>
+
+/* the largest record read: the header, the directory and TF_BIR_FINGERS
+ * templates of the largest size a frame takes */
+#define BIR_SIZE_MAX 0xb000
+
+struct bir_template {
+	unsigned int finger;
+	const u8 *data;
+	unsigned int size;
+};
+
+_Bool bir_legacy (const u8 *base, size_t size);
+int bir_read (const u8 *base, size_t size, struct bir_template *templates);
+int bir_write (int fd, const struct bir_template *templates, unsigned int count);
+
+#endif /* THINKFINGER_BIR_H */
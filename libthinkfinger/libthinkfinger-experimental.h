@@ -0,0 +1,71 @@
+#ifndef THINKFINGER_EXPERIMENTAL_H
+#define THINKFINGER_EXPERIMENTAL_H
+
+#include "libthinkfinger.h"
+
+/* requests the reader is not documented to take and has not been seen to
+ * answer, only tf-sim does.  They are not installed with libthinkfinger.h
+ * until they have been seen to work on a real reader; tf-bench checks them
+ * against tf-sim. */
+
+typedef enum {
+	TF_FLAG_CAPTURE              = 0x10, // allocate the ring libthinkfinger_capture streams strips into
+	TF_FLAG_REARM                = 0x20  // re-arm the reader for another swipe instead of uploading again
+} libthinkfinger_experimental_flag;
+
+/* TF_FLAG_REARM lets libthinkfinger_verify, libthinkfinger_verify_retry and
+ * libthinkfinger_verify_continuous ask the reader to verify the next swipe
+ * against the template it holds instead of uploading it again.  A real
+ * reader may answer the request with a communication error, after which the
+ * reader is initialized again and the template uploaded.  Without the flag
+ * it is never sent.  What the reader holds is known per handle, so only a
+ * process which keeps its handle gains anything. */
+
+/** @brief capture the raw strips of a swipe
+ *
+ * Streams the strips the sensor produces while the finger is swiped into
+ * the ring allocated with TF_FLAG_CAPTURE, until the reader reports the
+ * end of the swipe.  The strips are read from USB straight into the slots
+ * of the ring; a consumer running on another thread takes them with
+ * libthinkfinger_strip_next and hands each slot back with
+ * libthinkfinger_strip_release.  If every slot is taken the capture waits
+ * for one to be released rather than dropping a strip.
+ *
+ * Experimental: the image mode of the reader is not documented and has not
+ * been seen to work on a real reader, which may answer the request with a
+ * communication error.  The capture is therefore never retried through
+ * the recovery of the other tasks: it fails at once with
+ * TF_RESULT_COMM_FAILED or TF_RESULT_USB_ERROR, and the next task
+ * initializes the reader again.
+ *
+ * @param tf struct libthinkfinger, created with TF_FLAG_CAPTURE
+ *
+ * @return libthinkfinger_result
+ */
+libthinkfinger_result libthinkfinger_capture(libthinkfinger *tf);
+
+/** @brief take the next strip of the capture
+ *
+ * @param tf struct libthinkfinger
+ * @param strip filled with a read-only view of the strip
+ * @param timeout time in ms to wait for a strip, 0 to wait until the capture ends
+ *
+ * @return 0 if a strip was taken, 1 if the timeout passed or the capture
+ *         ended, which is told once per capture, -1 on error
+ */
+int libthinkfinger_strip_next(libthinkfinger *tf, libthinkfinger_strip *strip, unsigned int timeout);
+
+/** @brief hand a strip back to the capture
+ *
+ * Strips may be released in any order; a slot is reused once it and all
+ * slots taken before it have been released.  Strips are taken and released
+ * by one thread.
+ *
+ * @param tf struct libthinkfinger
+ * @param strip a strip taken with libthinkfinger_strip_next
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_strip_release(libthinkfinger *tf, const libthinkfinger_strip *strip);
+
+#endif /* THINKFINGER_EXPERIMENTAL_H */
@@ -0,0 +1,627 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   libthinkfinger-extract - Finds the minutiae of a swipe image
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   The image is processed in tiles of EXTRACT_BLOCK x EXTRACT_BLOCK
+ *   pixels, which together with the border a filter needs stay in the L1
+ *   cache:
+ *
+ *   - every tile is normalized to zero mean and unit variance, tiles with
+ *     too little contrast are background,
+ *   - the ridge orientation of a tile is the least squares fit to its
+ *     gradients, smoothed over the tiles around it,
+ *   - the tile is filtered with the Gabor kernel of its orientation, tuned
+ *     to the ridge period of the sensor, which closes gaps and removes
+ *     noise along the ridges,
+ *   - the sign of the filtered image gives the ridges, which are thinned
+ *     to a skeleton of one pixel (Zhang-Suen),
+ *   - skeleton pixels with one neighbour are ridge endings, those with
+ *     three bifurcations (crossing number).
+ *
+ *   The Gabor filter takes most of the time; it is computed with AVX2 and
+ *   FMA or SSE2 where the CPU has them.  The workspace is allocated once
+ *   and used for every image, so one workspace per thread is needed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libthinkfinger.h"
+#include "libthinkfinger-extract.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EXTRACT_X86
+#endif
+
+#define EXTRACT_BLOCK       16
+/* the image padded to whole tiles */
+#define EXTRACT_COLS        ((TF_IMAGE_WIDTH + EXTRACT_BLOCK - 1) / EXTRACT_BLOCK * EXTRACT_BLOCK)
+#define EXTRACT_ROWS        ((TF_IMAGE_HEIGHT + EXTRACT_BLOCK - 1) / EXTRACT_BLOCK * EXTRACT_BLOCK)
+#define EXTRACT_TILES_X     (EXTRACT_COLS / EXTRACT_BLOCK)
+#define EXTRACT_TILES_Y     (EXTRACT_ROWS / EXTRACT_BLOCK)
+/* variance a tile needs to be part of the finger */
+#define EXTRACT_VARIANCE    64
+/* coherence a tile needs for its minutiae to count */
+#define EXTRACT_COHERENCE   0.3f
+/* candidates before the false ones are removed */
+#define EXTRACT_CANDIDATES  1024
+/* minutiae closer than this are gaps or spurs of a ridge */
+#define EXTRACT_PAIR_DIST   8
+/* pixels a ridge ending is traced back for its direction */
+#define EXTRACT_TRACE       8
+#define EXTRACT_THIN_PASSES 16
+
+#define GABOR_RADIUS        6
+#define GABOR_SIZE          (2 * GABOR_RADIUS + 1)
+#define GABOR_ORIENTATIONS  16
+/* ridge period of the sensor in pixels */
+#define GABOR_PERIOD        9.0f
+#define GABOR_SIGMA         4.0f
+
+/* rows of the normalized image start GABOR_RADIUS pixels into the border */
+#define EXTRACT_STRIDE      ((EXTRACT_COLS + 2 * GABOR_RADIUS + 7) & ~7)
+#define EXTRACT_SKELETON    (EXTRACT_COLS + 2)
+
+#define EXTRACT_PI          3.14159265358979f
+
+struct extract {
+	void (*gabor) (const float *src, const float *kernel, float *dst);
+	float *norm;					/* (EXTRACT_ROWS + 2 * GABOR_RADIUS) * EXTRACT_STRIDE */
+	float *enhanced;				/* EXTRACT_ROWS * EXTRACT_COLS */
+	u8 *skeleton;					/* (EXTRACT_ROWS + 2) * EXTRACT_SKELETON, zero border */
+	unsigned int *ridge;				/* offsets of the ridge pixels in skeleton */
+	float kernel[GABOR_ORIENTATIONS][GABOR_SIZE * GABOR_SIZE];
+	float vx[EXTRACT_TILES_Y][EXTRACT_TILES_X];	/* gradient moments of a tile */
+	float vy[EXTRACT_TILES_Y][EXTRACT_TILES_X];
+	float energy[EXTRACT_TILES_Y][EXTRACT_TILES_X];
+	float orientation[EXTRACT_TILES_Y][EXTRACT_TILES_X]; /* of the ridges, 0 to pi */
+	float coherence[EXTRACT_TILES_Y][EXTRACT_TILES_X];
+	u8 mask[EXTRACT_TILES_Y][EXTRACT_TILES_X];
+	u8 thin[2][256];				/* Zhang-Suen deletions by neighbourhood */
+	u8 crossing[256];				/* crossing number by neighbourhood */
+	libthinkfinger_minutia candidate[EXTRACT_CANDIDATES];
+	unsigned int candidates;
+	int tiles_y;
+};
+
+static void extract_gabor_scalar (const float *src, const float *kernel, float *dst)
+{
+	const float *row;
+	float acc;
+	int x, y, kx, ky;
+
+	for (y = 0; y < EXTRACT_BLOCK; y++) {
+		for (x = 0; x < EXTRACT_BLOCK; x++) {
+			acc = 0.0f;
+			for (ky = 0; ky < GABOR_SIZE; ky++) {
+				row = src + (y + ky - GABOR_RADIUS) * EXTRACT_STRIDE + x - GABOR_RADIUS;
+				for (kx = 0; kx < GABOR_SIZE; kx++)
+					acc += kernel[ky * GABOR_SIZE + kx] * row[kx];
+			}
+			dst[y * EXTRACT_COLS + x] = acc;
+		}
+	}
+}
+
+#ifdef EXTRACT_X86
+__attribute__ ((target ("sse2")))
+static void extract_gabor_sse2 (const float *src, const float *kernel, float *dst)
+{
+	__m128 acc0, acc1, acc2, acc3, k;
+	const float *row;
+	int y, kx, ky;
+
+	for (y = 0; y < EXTRACT_BLOCK; y++) {
+		acc0 = acc1 = acc2 = acc3 = _mm_setzero_ps ();
+		for (ky = 0; ky < GABOR_SIZE; ky++) {
+			row = src + (y + ky - GABOR_RADIUS) * EXTRACT_STRIDE - GABOR_RADIUS;
+			for (kx = 0; kx < GABOR_SIZE; kx++) {
+				k = _mm_set1_ps (kernel[ky * GABOR_SIZE + kx]);
+				acc0 = _mm_add_ps (acc0, _mm_mul_ps (k, _mm_loadu_ps (row + kx)));
+				acc1 = _mm_add_ps (acc1, _mm_mul_ps (k, _mm_loadu_ps (row + kx + 4)));
+				acc2 = _mm_add_ps (acc2, _mm_mul_ps (k, _mm_loadu_ps (row + kx + 8)));
+				acc3 = _mm_add_ps (acc3, _mm_mul_ps (k, _mm_loadu_ps (row + kx + 12)));
+			}
+		}
+		_mm_storeu_ps (dst + y * EXTRACT_COLS, acc0);
+		_mm_storeu_ps (dst + y * EXTRACT_COLS + 4, acc1);
+		_mm_storeu_ps (dst + y * EXTRACT_COLS + 8, acc2);
+		_mm_storeu_ps (dst + y * EXTRACT_COLS + 12, acc3);
+	}
+}
+
+__attribute__ ((target ("avx2,fma")))
+static void extract_gabor_avx2 (const float *src, const float *kernel, float *dst)
+{
+	__m256 acc0, acc1, acc2, acc3, k;
+	const float *row;
+	int y, kx, ky;
+
+	/* two rows at a time, so that four chains of FMAs hide their latency */
+	for (y = 0; y < EXTRACT_BLOCK; y += 2) {
+		acc0 = acc1 = acc2 = acc3 = _mm256_setzero_ps ();
+		for (ky = 0; ky < GABOR_SIZE; ky++) {
+			row = src + (y + ky - GABOR_RADIUS) * EXTRACT_STRIDE - GABOR_RADIUS;
+			for (kx = 0; kx < GABOR_SIZE; kx++) {
+				k = _mm256_broadcast_ss (kernel + ky * GABOR_SIZE + kx);
+				acc0 = _mm256_fmadd_ps (k, _mm256_loadu_ps (row + kx), acc0);
+				acc1 = _mm256_fmadd_ps (k, _mm256_loadu_ps (row + kx + 8), acc1);
+				acc2 = _mm256_fmadd_ps (k, _mm256_loadu_ps (row + EXTRACT_STRIDE + kx), acc2);
+				acc3 = _mm256_fmadd_ps (k, _mm256_loadu_ps (row + EXTRACT_STRIDE + kx + 8), acc3);
+			}
+		}
+		_mm256_storeu_ps (dst + y * EXTRACT_COLS, acc0);
+		_mm256_storeu_ps (dst + y * EXTRACT_COLS + 8, acc1);
+		_mm256_storeu_ps (dst + (y + 1) * EXTRACT_COLS, acc2);
+		_mm256_storeu_ps (dst + (y + 1) * EXTRACT_COLS + 8, acc3);
+	}
+}
+#endif
+
+/* the kernels vary across the ridges (along theta, the gradient) and are
+ * a plain Gaussian along them; the mean is removed so that the brightness
+ * of a tile does not leak into the result */
+static void extract_kernels (struct extract *extract)
+{
+	float theta, across, along, sum;
+	float *kernel;
+	int i, x, y;
+
+	for (i = 0; i < GABOR_ORIENTATIONS; i++) {
+		theta = EXTRACT_PI * i / GABOR_ORIENTATIONS;
+		kernel = extract->kernel[i];
+		sum = 0.0f;
+		for (y = -GABOR_RADIUS; y <= GABOR_RADIUS; y++) {
+			for (x = -GABOR_RADIUS; x <= GABOR_RADIUS; x++) {
+				across = x * cosf (theta) + y * sinf (theta);
+				along = -x * sinf (theta) + y * cosf (theta);
+				kernel[(y + GABOR_RADIUS) * GABOR_SIZE + x + GABOR_RADIUS] =
+					expf (-(across * across + along * along) / (2.0f * GABOR_SIGMA * GABOR_SIGMA)) *
+					cosf (2.0f * EXTRACT_PI * across / GABOR_PERIOD);
+				sum += kernel[(y + GABOR_RADIUS) * GABOR_SIZE + x + GABOR_RADIUS];
+			}
+		}
+		for (x = 0; x < GABOR_SIZE * GABOR_SIZE; x++)
+			kernel[x] -= sum / (GABOR_SIZE * GABOR_SIZE);
+	}
+}
+
+/* neighbours are numbered clockwise from north, P2 is bit 0 up to P9 in bit 7 */
+static void extract_tables (struct extract *extract)
+{
+	int n, i, p[9], a, b;
+
+	for (n = 0; n < 256; n++) {
+		for (i = 0; i < 8; i++)
+			p[i] = (n >> i) & 1;
+		p[8] = p[0];
+		for (i = 0, a = 0, b = 0; i < 8; i++) {
+			a += !p[i] && p[i+1];
+			b += p[i];
+		}
+		extract->crossing[n] = a;
+		/* p[0] = P2 (north), p[2] = P4 (east), p[4] = P6 (south), p[6] = P8 (west) */
+		extract->thin[0][n] = b >= 2 && b <= 6 && a == 1 &&
+				      !(p[0] && p[2] && p[4]) && !(p[2] && p[4] && p[6]);
+		extract->thin[1][n] = b >= 2 && b <= 6 && a == 1 &&
+				      !(p[0] && p[2] && p[6]) && !(p[0] && p[4] && p[6]);
+	}
+}
+
+static unsigned int extract_neighbours (const u8 *p)
+{
+	return (p[-EXTRACT_SKELETON] != 0) |
+	       (p[-EXTRACT_SKELETON+1] != 0) << 1 |
+	       (p[1] != 0) << 2 |
+	       (p[EXTRACT_SKELETON+1] != 0) << 3 |
+	       (p[EXTRACT_SKELETON] != 0) << 4 |
+	       (p[EXTRACT_SKELETON-1] != 0) << 5 |
+	       (p[-1] != 0) << 6 |
+	       (p[-EXTRACT_SKELETON-1] != 0) << 7;
+}
+
+struct extract *extract_new (void)
+{
+	struct extract *extract;
+
+	extract = calloc (1, sizeof (*extract));
+	if (extract == NULL)
+		goto out;
+
+	if (posix_memalign ((void **) &extract->norm, 64,
+			    (EXTRACT_ROWS + 2 * GABOR_RADIUS) * EXTRACT_STRIDE * sizeof (float)) != 0 ||
+	    posix_memalign ((void **) &extract->enhanced, 64,
+			    EXTRACT_ROWS * EXTRACT_COLS * sizeof (float)) != 0 ||
+	    posix_memalign ((void **) &extract->skeleton, 64,
+			    (EXTRACT_ROWS + 2) * EXTRACT_SKELETON) != 0 ||
+	    posix_memalign ((void **) &extract->ridge, 64,
+			    TF_IMAGE_WIDTH * TF_IMAGE_HEIGHT * sizeof (unsigned int)) != 0) {
+		extract_free (extract);
+		extract = NULL;
+		goto out;
+	}
+
+	extract->gabor = extract_gabor_scalar;
+#ifdef EXTRACT_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+		extract->gabor = extract_gabor_avx2;
+	else if (__builtin_cpu_supports ("sse2"))
+		extract->gabor = extract_gabor_sse2;
+#endif
+	extract_kernels (extract);
+	extract_tables (extract);
+out:
+	return extract;
+}
+
+void extract_free (struct extract *extract)
+{
+	if (extract == NULL)
+		return;
+
+	free (extract->norm);
+	free (extract->enhanced);
+	free (extract->skeleton);
+	free (extract->ridge);
+	free (extract);
+}
+
+static float *extract_norm (struct extract *extract, int x, int y)
+{
+	return extract->norm + (y + GABOR_RADIUS) * EXTRACT_STRIDE + x + GABOR_RADIUS;
+}
+
+/* normalizes every tile and tells the finger from the background */
+static void extract_normalize (struct extract *extract, const libthinkfinger_image *image)
+{
+	const unsigned char *src;
+	float mean, scale, *dst;
+	unsigned long long sum, squares, n;
+	int tx, ty, x, y, x1, y1;
+
+	memset (extract->norm, 0, (extract->tiles_y * EXTRACT_BLOCK + 2 * GABOR_RADIUS) *
+		EXTRACT_STRIDE * sizeof (float));
+
+	for (ty = 0; ty < extract->tiles_y; ty++) {
+		y1 = (ty + 1) * EXTRACT_BLOCK < (int) image->height ? (ty + 1) * EXTRACT_BLOCK : (int) image->height;
+		for (tx = 0; tx < EXTRACT_TILES_X; tx++) {
+			x1 = (tx + 1) * EXTRACT_BLOCK < TF_IMAGE_WIDTH ? (tx + 1) * EXTRACT_BLOCK : TF_IMAGE_WIDTH;
+			sum = squares = n = 0;
+			for (y = ty * EXTRACT_BLOCK; y < y1; y++) {
+				src = image->pixels + y * image->width;
+				for (x = tx * EXTRACT_BLOCK; x < x1; x++) {
+					sum += src[x];
+					squares += src[x] * src[x];
+				}
+				n += x1 - tx * EXTRACT_BLOCK;
+			}
+
+			extract->mask[ty][tx] = n > 0 && squares * n - sum * sum >= EXTRACT_VARIANCE * n * n;
+			if (extract->mask[ty][tx] == 0)
+				continue;
+
+			mean = (float) sum / n;
+			scale = 1.0f / sqrtf ((float) squares / n - mean * mean);
+			for (y = ty * EXTRACT_BLOCK; y < y1; y++) {
+				src = image->pixels + y * image->width;
+				dst = extract_norm (extract, 0, y);
+				for (x = tx * EXTRACT_BLOCK; x < x1; x++)
+					dst[x] = (src[x] - mean) * scale;
+			}
+		}
+	}
+}
+
+/* least squares orientation of the gradients, averaged as doubled angles
+ * over the tile and its neighbours */
+static void extract_orientation (struct extract *extract)
+{
+	const float *p;
+	float gx, gy, gxx, gyy, gxy, vx, vy, energy;
+	int tx, ty, x, y, i, j;
+
+	for (ty = 0; ty < extract->tiles_y; ty++) {
+		for (tx = 0; tx < EXTRACT_TILES_X; tx++) {
+			gxx = gyy = gxy = 0.0f;
+			if (extract->mask[ty][tx]) {
+				for (y = ty * EXTRACT_BLOCK; y < (ty + 1) * EXTRACT_BLOCK; y++) {
+					p = extract_norm (extract, tx * EXTRACT_BLOCK, y);
+					for (x = 0; x < EXTRACT_BLOCK; x++, p++) {
+						gx = (p[-EXTRACT_STRIDE+1] + 2 * p[1] + p[EXTRACT_STRIDE+1]) -
+						     (p[-EXTRACT_STRIDE-1] + 2 * p[-1] + p[EXTRACT_STRIDE-1]);
+						gy = (p[EXTRACT_STRIDE-1] + 2 * p[EXTRACT_STRIDE] + p[EXTRACT_STRIDE+1]) -
+						     (p[-EXTRACT_STRIDE-1] + 2 * p[-EXTRACT_STRIDE] + p[-EXTRACT_STRIDE+1]);
+						gxx += gx * gx;
+						gyy += gy * gy;
+						gxy += gx * gy;
+					}
+				}
+			}
+			extract->vx[ty][tx] = 2.0f * gxy;
+			extract->vy[ty][tx] = gxx - gyy;
+			extract->energy[ty][tx] = gxx + gyy;
+		}
+	}
+
+	for (ty = 0; ty < extract->tiles_y; ty++) {
+		for (tx = 0; tx < EXTRACT_TILES_X; tx++) {
+			vx = vy = energy = 0.0f;
+			for (j = ty - 1; j <= ty + 1; j++) {
+				for (i = tx - 1; i <= tx + 1; i++) {
+					if (j < 0 || j >= extract->tiles_y || i < 0 || i >= EXTRACT_TILES_X)
+						continue;
+					vx += extract->vx[j][i];
+					vy += extract->vy[j][i];
+					energy += extract->energy[j][i];
+				}
+			}
+			/* the gradient is across the ridges */
+			extract->orientation[ty][tx] = 0.5f * atan2f (vx, vy) + EXTRACT_PI / 2;
+			extract->coherence[ty][tx] = energy > 0.0f ? sqrtf (vx * vx + vy * vy) / energy : 0.0f;
+		}
+	}
+}
+
+/* filters every tile of the finger with the kernel of its orientation */
+static void extract_enhance (struct extract *extract)
+{
+	float *dst;
+	float theta;
+	int tx, ty, y, k;
+
+	for (ty = 0; ty < extract->tiles_y; ty++) {
+		for (tx = 0; tx < EXTRACT_TILES_X; tx++) {
+			dst = extract->enhanced + ty * EXTRACT_BLOCK * EXTRACT_COLS + tx * EXTRACT_BLOCK;
+			if (extract->mask[ty][tx] == 0) {
+				for (y = 0; y < EXTRACT_BLOCK; y++)
+					memset (dst + y * EXTRACT_COLS, 0, EXTRACT_BLOCK * sizeof (float));
+				continue;
+			}
+
+			/* the kernel is indexed by the direction across the ridges */
+			theta = extract->orientation[ty][tx] - EXTRACT_PI / 2;
+			if (theta < 0.0f)
+				theta += EXTRACT_PI;
+			k = (int) (theta * GABOR_ORIENTATIONS / EXTRACT_PI + 0.5f) % GABOR_ORIENTATIONS;
+			extract->gabor (extract_norm (extract, tx * EXTRACT_BLOCK, ty * EXTRACT_BLOCK),
+					extract->kernel[k], dst);
+		}
+	}
+}
+
+/* ridges are dark, they come out of the filter below zero */
+static void extract_binarize (struct extract *extract, int height)
+{
+	const float *src;
+	u8 *dst;
+	int x, y;
+
+	memset (extract->skeleton, 0, (extract->tiles_y * EXTRACT_BLOCK + 2) * EXTRACT_SKELETON);
+	for (y = 0; y < height; y++) {
+		src = extract->enhanced + y * EXTRACT_COLS;
+		dst = extract->skeleton + (y + 1) * EXTRACT_SKELETON + 1;
+		for (x = 0; x < TF_IMAGE_WIDTH; x++)
+			dst[x] = src[x] < 0.0f;
+	}
+}
+
+/* Zhang-Suen over the list of ridge pixels, which shrinks with every
+ * pass: pixels to be deleted are marked with 2 and still count as ridge
+ * until the pass is over */
+static void extract_thin (struct extract *extract, int height)
+{
+	unsigned int *ridge = extract->ridge;
+	unsigned int n = 0, i, kept;
+	u8 *skeleton = extract->skeleton;
+	int pass, sub, x, y, changed;
+
+	for (y = 1; y <= height; y++)
+		for (x = 1; x <= TF_IMAGE_WIDTH; x++)
+			if (skeleton[y * EXTRACT_SKELETON + x])
+				ridge[n++] = y * EXTRACT_SKELETON + x;
+
+	for (pass = 0; pass < EXTRACT_THIN_PASSES; pass++) {
+		changed = 0;
+		for (sub = 0; sub < 2; sub++) {
+			for (i = 0; i < n; i++) {
+				if (extract->thin[sub][extract_neighbours (skeleton + ridge[i])]) {
+					skeleton[ridge[i]] = 2;
+					changed = 1;
+				}
+			}
+			for (i = 0, kept = 0; i < n; i++) {
+				if (skeleton[ridge[i]] == 2)
+					skeleton[ridge[i]] = 0;
+				else
+					ridge[kept++] = ridge[i];
+			}
+			n = kept;
+		}
+		if (changed == 0)
+			break;
+	}
+}
+
+/* a minutia needs finger all around it, the ends of the ridges at the edge
+ * of the finger are not minutiae */
+static int extract_inside (struct extract *extract, int x, int y)
+{
+	int tx = x / EXTRACT_BLOCK, ty = y / EXTRACT_BLOCK;
+	int i, j;
+
+	for (j = ty - 1; j <= ty + 1; j++)
+		for (i = tx - 1; i <= tx + 1; i++)
+			if (j < 0 || j >= extract->tiles_y || i < 0 || i >= EXTRACT_TILES_X ||
+			    (i + 1) * EXTRACT_BLOCK > TF_IMAGE_WIDTH || extract->mask[j][i] == 0)
+				return 0;
+
+	return extract->coherence[ty][tx] >= EXTRACT_COHERENCE;
+}
+
+/* follows the ridge from its end, returns the direction it points to in degrees */
+static int extract_trace (struct extract *extract, int x, int y)
+{
+	static const int dx[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+	static const int dy[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+	int cx = x, cy = y, px = x, py = y;
+	int step, i, nx, ny, next;
+	const u8 *p;
+	int angle;
+
+	for (step = 0; step < EXTRACT_TRACE; step++) {
+		p = extract->skeleton + (cy + 1) * EXTRACT_SKELETON + cx + 1;
+		next = -1;
+		for (i = 0; i < 8; i++) {
+			if (p[dy[i] * EXTRACT_SKELETON + dx[i]] == 0)
+				continue;
+			nx = cx + dx[i];
+			ny = cy + dy[i];
+			/* do not step back, nor onto a neighbour of the pixel before */
+			if ((nx - px) * (nx - px) <= 1 && (ny - py) * (ny - py) <= 1 && step > 0)
+				continue;
+			if (next >= 0) {
+				/* an ending may touch its ridge with two pixels */
+				if (step == 0)
+					continue;
+				next = -2;
+				break;
+			}
+			next = i;
+		}
+		if (next < 0)
+			break;
+		px = cx;
+		py = cy;
+		cx += dx[next];
+		cy += dy[next];
+	}
+
+	/* counterclockwise from the x axis with y up */
+	angle = (int) lroundf (atan2f ((float) (cy - y), (float) (x - cx)) * 180.0f / EXTRACT_PI);
+	return (angle + 360) % 360;
+}
+
+static void extract_detect (struct extract *extract, int height)
+{
+	libthinkfinger_minutia *minutia;
+	unsigned int crossing;
+	const u8 *p;
+	int x, y, tx, ty;
+
+	extract->candidates = 0;
+	for (y = 0; y < height; y++) {
+		p = extract->skeleton + (y + 1) * EXTRACT_SKELETON + 1;
+		for (x = 0; x < TF_IMAGE_WIDTH; x++) {
+			if (p[x] == 0)
+				continue;
+			crossing = extract->crossing[extract_neighbours (p + x)];
+			if (crossing != 1 && crossing != 3)
+				continue;
+			if (extract_inside (extract, x, y) == 0)
+				continue;
+			if (extract->candidates == EXTRACT_CANDIDATES)
+				return;
+
+			tx = x / EXTRACT_BLOCK;
+			ty = y / EXTRACT_BLOCK;
+			minutia = &extract->candidate[extract->candidates++];
+			minutia->x = x;
+			minutia->y = y;
+			minutia->quality = (unsigned int) (extract->coherence[ty][tx] * 100.0f);
+			if (minutia->quality > 100)
+				minutia->quality = 100;
+			if (crossing == 1) {
+				minutia->type = TF_MINUTIA_ENDING;
+				minutia->angle = extract_trace (extract, x, y);
+			} else {
+				minutia->type = TF_MINUTIA_BIFURCATION;
+				/* the orientation is measured with y down */
+				minutia->angle = (180 - (int) lroundf (extract->orientation[ty][tx] * 180.0f / EXTRACT_PI) % 180) % 180;
+			}
+		}
+	}
+}
+
+static int extract_compare (const void *a, const void *b)
+{
+	const libthinkfinger_minutia *m = a, *n = b;
+
+	if (m->quality != n->quality)
+		return m->quality < n->quality ? 1 : -1;
+	if (m->y != n->y)
+		return m->y - n->y;
+	return m->x - n->x;
+}
+
+/* drops minutiae close to each other, which are breaks and spurs of a
+ * ridge rather than minutiae, and keeps the best TF_MINUTIAE_MAX */
+static void extract_select (struct extract *extract, libthinkfinger_features *features)
+{
+	libthinkfinger_minutia *c = extract->candidate;
+	unsigned char drop[EXTRACT_CANDIDATES];
+	unsigned int i, j, n = 0;
+	int dx, dy;
+
+	memset (drop, 0, extract->candidates);
+	for (i = 0; i < extract->candidates; i++) {
+		for (j = i + 1; j < extract->candidates; j++) {
+			dy = c[j].y - c[i].y;
+			/* the candidates are ordered by row */
+			if (dy >= EXTRACT_PAIR_DIST)
+				break;
+			dx = c[j].x - c[i].x;
+			if (dx * dx + dy * dy < EXTRACT_PAIR_DIST * EXTRACT_PAIR_DIST)
+				drop[i] = drop[j] = 1;
+		}
+	}
+	for (i = 0; i < extract->candidates; i++)
+		if (drop[i] == 0)
+			c[n++] = c[i];
+
+	qsort (c, n, sizeof (*c), extract_compare);
+	features->count = n < TF_MINUTIAE_MAX ? n : TF_MINUTIAE_MAX;
+	memcpy (features->minutiae, c, features->count * sizeof (*c));
+}
+
+int extract_features (struct extract *extract, const libthinkfinger_image *image, libthinkfinger_features *features)
+{
+	if (image->pixels == NULL || image->width != TF_IMAGE_WIDTH || image->height > TF_IMAGE_HEIGHT)
+		return -1;
+
+	features->count = 0;
+	features->width = image->width;
+	features->height = image->height;
+	extract->tiles_y = (image->height + EXTRACT_BLOCK - 1) / EXTRACT_BLOCK;
+	if (extract->tiles_y == 0)
+		return 0;
+
+	extract_normalize (extract, image);
+	extract_orientation (extract);
+	extract_enhance (extract);
+	extract_binarize (extract, image->height);
+	extract_thin (extract, image->height);
+	extract_detect (extract, image->height);
+	extract_select (extract, features);
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef THINKFINGER_EXTRACT_H
+#define THINKFINGER_EXTRACT_H
+
+struct extract;
+
+struct extract *extract_new (void);
+void extract_free (struct extract *extract);
+int extract_features (struct extract *extract, const libthinkfinger_image *image, libthinkfinger_features *features);
+
+#endif /* THINKFINGER_EXTRACT_H */
@@ -0,0 +1,634 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   libthinkfinger-identify - Finds the templates of an index a finger matches
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   Comparing a probe with every template of a large index takes too long,
+ *   so the templates are indexed by pairs of their minutiae.  The length of
+ *   a pair and the angles of both minutiae to the line between them do not
+ *   change as the finger moves or turns; they are quantized into the key of
+ *   a bucket, which lists the pairs of all templates with that key.
+ *
+ *   The pairs of the probe vote for the templates in their buckets and
+ *   those with the most votes are compared in full.  Every pair which voted
+ *   tells how the probe has to be turned and moved to lie on the template;
+ *   the minutiae of the probe are moved so, and those of the template with
+ *   a minutia of the probe close by and in about the same direction are
+ *   counted.  The count is computed with AVX2 or SSE2 where the CPU has it.
+ *
+ *   Angles are compared modulo 180 degrees, the direction of a bifurcation
+ *   is the one of its ridges and has no sign.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "libthinkfinger.h"
+#include "libthinkfinger-identify.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IDENTIFY_X86
+#endif
+
+/* the best minutiae of a template which are paired */
+#define IDENTIFY_PAIRED      32
+#define IDENTIFY_PAIRS       (IDENTIFY_PAIRED * (IDENTIFY_PAIRED - 1) / 2)
+#define IDENTIFY_SLOT_BITS   22
+/* lengths of a pair in pixels */
+#define IDENTIFY_DIST_MIN    16
+#define IDENTIFY_DIST_BIN    8
+#define IDENTIFY_DIST_BINS   12
+#define IDENTIFY_ANGLE_BINS  18
+#define IDENTIFY_BUCKETS     (IDENTIFY_DIST_BINS * IDENTIFY_ANGLE_BINS * IDENTIFY_ANGLE_BINS)
+/* alignments tried per template */
+#define IDENTIFY_HITS        12
+/* templates compared in full, at least */
+#define IDENTIFY_SHORTLIST   32
+/* votes a template needs to be compared */
+#define IDENTIFY_VOTES_MIN   3
+/* minutiae closer than this match */
+#define IDENTIFY_DIST_MATCH  12.0f
+/* cosine of twice the angle by which the directions of matching minutiae
+ * may differ, 20 degrees */
+#define IDENTIFY_ANGLE_MATCH 0.766f
+/* minutiae are counted in blocks of this many, padded with far away ones */
+#define IDENTIFY_LANES       8
+#define IDENTIFY_FAR         1.0e6f
+
+#define IDENTIFY_PI          3.14159265358979f
+
+/* the minutiae of a template in columns */
+struct identify_points {
+	unsigned int count;
+	unsigned int padded;				/* count rounded up to IDENTIFY_LANES */
+	float *x;
+	float *y;
+	float *c;					/* cosine and sine of twice the angle */
+	float *s;
+	float *angle;					/* 0 to 180 degrees */
+};
+
+struct identify_template {
+	unsigned int id;
+	struct identify_points points;
+};
+
+/* the buckets are streamed through for every probe, so an entry is kept
+ * in 32 bits */
+struct identify_entry {
+	unsigned int slot : IDENTIFY_SLOT_BITS;		/* of the template */
+	unsigned int i : 5;				/* its minutiae */
+	unsigned int j : 5;
+};
+
+struct identify_bucket {
+	struct identify_entry *entry;
+	unsigned int count;
+	unsigned int size;
+};
+
+struct identify {
+	unsigned int (*count) (const struct identify_points *gallery, const float *x, const float *y,
+			       const float *c, const float *s, unsigned int n);
+	struct identify_template *template;
+	unsigned int templates;
+	unsigned int size;
+	struct identify_bucket bucket[IDENTIFY_BUCKETS];
+};
+
+/* a pair of the probe and the one of a template in the same bucket */
+struct identify_hit {
+	u8 probe[2];
+	u8 gallery[2];
+};
+
+struct identify_match {
+	unsigned int slot;
+	unsigned int votes;
+	unsigned int score;
+};
+
+struct identify_query {
+	struct identify_points probe;
+	unsigned int *votes;				/* per template */
+	unsigned int *hits;
+	struct identify_hit *hit;			/* IDENTIFY_HITS per template */
+	struct identify_match *match;			/* templates which got votes */
+	unsigned int matches;
+	unsigned int shortlist;				/* of them compared in full */
+};
+
+static unsigned int identify_count_scalar (const struct identify_points *gallery, const float *x, const float *y,
+					   const float *c, const float *s, unsigned int n)
+{
+	unsigned int matched = 0;
+	unsigned int g, k;
+	float dx, dy;
+
+	for (g = 0; g < gallery->count; g++) {
+		for (k = 0; k < n; k++) {
+			dx = gallery->x[g] - x[k];
+			dy = gallery->y[g] - y[k];
+			if (dx * dx + dy * dy < IDENTIFY_DIST_MATCH * IDENTIFY_DIST_MATCH &&
+			    gallery->c[g] * c[k] + gallery->s[g] * s[k] > IDENTIFY_ANGLE_MATCH) {
+				matched++;
+				break;
+			}
+		}
+	}
+
+	return matched;
+}
+
+#ifdef IDENTIFY_X86
+__attribute__ ((target ("sse2")))
+static unsigned int identify_count_sse2 (const struct identify_points *gallery, const float *x, const float *y,
+					 const float *c, const float *s, unsigned int n)
+{
+	const __m128 dist = _mm_set1_ps (IDENTIFY_DIST_MATCH * IDENTIFY_DIST_MATCH);
+	const __m128 angle = _mm_set1_ps (IDENTIFY_ANGLE_MATCH);
+	__m128 gx, gy, gc, gs, dx, dy, d, dot, hit;
+	unsigned int matched = 0;
+	unsigned int g, k;
+
+	for (g = 0; g < gallery->padded; g += 4) {
+		gx = _mm_load_ps (gallery->x + g);
+		gy = _mm_load_ps (gallery->y + g);
+		gc = _mm_load_ps (gallery->c + g);
+		gs = _mm_load_ps (gallery->s + g);
+		hit = _mm_setzero_ps ();
+		for (k = 0; k < n; k++) {
+			dx = _mm_sub_ps (gx, _mm_set1_ps (x[k]));
+			dy = _mm_sub_ps (gy, _mm_set1_ps (y[k]));
+			d = _mm_add_ps (_mm_mul_ps (dx, dx), _mm_mul_ps (dy, dy));
+			dot = _mm_add_ps (_mm_mul_ps (gc, _mm_set1_ps (c[k])), _mm_mul_ps (gs, _mm_set1_ps (s[k])));
+			hit = _mm_or_ps (hit, _mm_and_ps (_mm_cmplt_ps (d, dist), _mm_cmpgt_ps (dot, angle)));
+		}
+		matched += __builtin_popcount (_mm_movemask_ps (hit));
+	}
+
+	return matched;
+}
+
+__attribute__ ((target ("avx2")))
+static unsigned int identify_count_avx2 (const struct identify_points *gallery, const float *x, const float *y,
+					 const float *c, const float *s, unsigned int n)
+{
+	const __m256 dist = _mm256_set1_ps (IDENTIFY_DIST_MATCH * IDENTIFY_DIST_MATCH);
+	const __m256 angle = _mm256_set1_ps (IDENTIFY_ANGLE_MATCH);
+	__m256 gx, gy, gc, gs, dx, dy, d, dot, hit;
+	unsigned int matched = 0;
+	unsigned int g, k;
+
+	for (g = 0; g < gallery->padded; g += 8) {
+		gx = _mm256_load_ps (gallery->x + g);
+		gy = _mm256_load_ps (gallery->y + g);
+		gc = _mm256_load_ps (gallery->c + g);
+		gs = _mm256_load_ps (gallery->s + g);
+		hit = _mm256_setzero_ps ();
+		for (k = 0; k < n; k++) {
+			dx = _mm256_sub_ps (gx, _mm256_set1_ps (x[k]));
+			dy = _mm256_sub_ps (gy, _mm256_set1_ps (y[k]));
+			d = _mm256_add_ps (_mm256_mul_ps (dx, dx), _mm256_mul_ps (dy, dy));
+			dot = _mm256_add_ps (_mm256_mul_ps (gc, _mm256_set1_ps (c[k])),
+					     _mm256_mul_ps (gs, _mm256_set1_ps (s[k])));
+			hit = _mm256_or_ps (hit, _mm256_and_ps (_mm256_cmp_ps (d, dist, _CMP_LT_OQ),
+								 _mm256_cmp_ps (dot, angle, _CMP_GT_OQ)));
+		}
+		matched += __builtin_popcount (_mm256_movemask_ps (hit));
+	}
+
+	return matched;
+}
+#endif
+
+/* the blocks of minutiae are multiples of the vector widths */
+typedef char identify_lanes_check[IDENTIFY_LANES % 8 == 0 ? 1 : -1];
+/* the minutiae of a pair fit into an entry */
+typedef char identify_entry_check[IDENTIFY_PAIRED <= 32 && sizeof (struct identify_entry) == 4 ? 1 : -1];
+
+static int identify_points_init (struct identify_points *points, const libthinkfinger_features *features)
+{
+	const libthinkfinger_minutia *m;
+	unsigned int i;
+	float theta;
+
+	points->count = features->count < TF_MINUTIAE_MAX ? features->count : TF_MINUTIAE_MAX;
+	points->padded = (points->count + IDENTIFY_LANES - 1) / IDENTIFY_LANES * IDENTIFY_LANES;
+	if (points->padded == 0)
+		points->padded = IDENTIFY_LANES;
+	if (posix_memalign ((void **) &points->x, 32, 5 * points->padded * sizeof (float)) != 0) {
+		points->x = NULL;
+		return -1;
+	}
+	points->y = points->x + points->padded;
+	points->c = points->y + points->padded;
+	points->s = points->c + points->padded;
+	points->angle = points->s + points->padded;
+
+	for (i = 0; i < points->padded; i++) {
+		if (i >= points->count) {
+			points->x[i] = points->y[i] = IDENTIFY_FAR;
+			points->c[i] = points->s[i] = points->angle[i] = 0.0f;
+			continue;
+		}
+		m = &features->minutiae[i];
+		points->x[i] = m->x;
+		points->y[i] = m->y;
+		points->angle[i] = ((m->angle % 180) + 180) % 180;
+		theta = points->angle[i] * IDENTIFY_PI / 90.0f;
+		points->c[i] = cosf (theta);
+		points->s[i] = sinf (theta);
+	}
+
+	return 0;
+}
+
+/* direction from minutia i to minutia j, counterclockwise in radians */
+static float identify_segment (const struct identify_points *points, unsigned int i, unsigned int j)
+{
+	return atan2f (points->y[i] - points->y[j], points->x[j] - points->x[i]);
+}
+
+/* the key of the pair i, j in fractions of bins: its length and the angles
+ * of both minutiae to the line between them.  The minutia with the smaller
+ * angle comes first, i and j are swapped to it.  Returns -1 if the pair is
+ * too close or too far apart. */
+static int identify_key (const struct identify_points *points, unsigned int *i, unsigned int *j, float key[3])
+{
+	float dx = points->x[*j] - points->x[*i];
+	float dy = points->y[*j] - points->y[*i];
+	float d, segment, a, b;
+	unsigned int swap;
+
+	d = (sqrtf (dx * dx + dy * dy) - IDENTIFY_DIST_MIN) / IDENTIFY_DIST_BIN;
+	if (d < 0.0f || d >= IDENTIFY_DIST_BINS)
+		return -1;
+
+	segment = identify_segment (points, *i, *j) * 180.0f / IDENTIFY_PI;
+	a = fmodf (points->angle[*i] - segment + 360.0f, 180.0f);
+	b = fmodf (points->angle[*j] - segment + 360.0f, 180.0f);
+	if (a > b) {
+		swap = *i;
+		*i = *j;
+		*j = swap;
+		key[1] = b;
+		key[2] = a;
+	} else {
+		key[1] = a;
+		key[2] = b;
+	}
+	key[0] = d;
+	key[1] *= IDENTIFY_ANGLE_BINS / 180.0f;
+	key[2] *= IDENTIFY_ANGLE_BINS / 180.0f;
+
+	return 0;
+}
+
+static unsigned int identify_bucket (int d, int a, int b)
+{
+	a = (a + IDENTIFY_ANGLE_BINS) % IDENTIFY_ANGLE_BINS;
+	b = (b + IDENTIFY_ANGLE_BINS) % IDENTIFY_ANGLE_BINS;
+
+	return (d * IDENTIFY_ANGLE_BINS + a) * IDENTIFY_ANGLE_BINS + b;
+}
+
+struct identify *identify_new (void)
+{
+	struct identify *identify;
+
+	identify = calloc (1, sizeof (*identify));
+	if (identify == NULL)
+		goto out;
+
+	identify->count = identify_count_scalar;
+#ifdef IDENTIFY_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		identify->count = identify_count_avx2;
+	else if (__builtin_cpu_supports ("sse2"))
+		identify->count = identify_count_sse2;
+#endif
+out:
+	return identify;
+}
+
+void identify_free (struct identify *identify)
+{
+	unsigned int i;
+
+	if (identify == NULL)
+		return;
+
+	for (i = 0; i < identify->templates; i++)
+		free (identify->template[i].points.x);
+	free (identify->template);
+	for (i = 0; i < IDENTIFY_BUCKETS; i++)
+		free (identify->bucket[i].entry);
+	free (identify);
+}
+
+/* makes room for one more entry in the bucket */
+static int identify_reserve (struct identify_bucket *bucket)
+{
+	struct identify_entry *entry;
+	unsigned int size;
+
+	if (bucket->count < bucket->size)
+		return 0;
+
+	size = bucket->size ? bucket->size * 2 : 16;
+	entry = realloc (bucket->entry, size * sizeof (*entry));
+	if (entry == NULL)
+		return -1;
+	bucket->entry = entry;
+	bucket->size = size;
+
+	return 0;
+}
+
+int identify_add (struct identify *identify, unsigned int id, const libthinkfinger_features *features)
+{
+	struct identify_template *template;
+	struct identify_points points;
+	struct identify_bucket *bucket;
+	struct identify_entry entry[IDENTIFY_PAIRS];
+	unsigned int key[IDENTIFY_PAIRS];
+	unsigned int paired, pairs = 0;
+	unsigned int n, m, i, j, size;
+	float k[3];
+	int retval = -1;
+
+	points.x = NULL;
+	if (identify->templates == 1U << IDENTIFY_SLOT_BITS)
+		goto out;
+	if (identify_points_init (&points, features) < 0)
+		goto out;
+
+	if (identify->templates == identify->size) {
+		size = identify->size ? identify->size * 2 : 64;
+		template = realloc (identify->template, size * sizeof (*template));
+		if (template == NULL)
+			goto out;
+		identify->template = template;
+		identify->size = size;
+	}
+
+	paired = points.count < IDENTIFY_PAIRED ? points.count : IDENTIFY_PAIRED;
+	for (n = 0; n < paired; n++) {
+		for (m = n + 1; m < paired; m++) {
+			i = n;
+			j = m;
+			if (identify_key (&points, &i, &j, k) < 0)
+				continue;
+			entry[pairs].slot = identify->templates;
+			entry[pairs].i = i;
+			entry[pairs].j = j;
+			key[pairs++] = identify_bucket (k[0], k[1], k[2]);
+		}
+	}
+
+	for (n = 0; n < pairs; n++) {
+		bucket = &identify->bucket[key[n]];
+		if (identify_reserve (bucket) < 0) {
+			/* takes back what was added, it is at the end of the buckets */
+			while (n > 0)
+				identify->bucket[key[--n]].count--;
+			goto out;
+		}
+		bucket->entry[bucket->count++] = entry[n];
+	}
+
+	template = &identify->template[identify->templates++];
+	template->id = id;
+	template->points = points;
+	points.x = NULL;
+	retval = 0;
+out:
+	free (points.x);
+	return retval;
+}
+
+static int identify_votes (const void *a, const void *b)
+{
+	const struct identify_match *m = a, *n = b;
+
+	if (m->votes != n->votes)
+		return m->votes < n->votes ? 1 : -1;
+	return m->slot < n->slot ? -1 : m->slot > n->slot;
+}
+
+/* every pair of the probe votes for the templates in its bucket and in the
+ * neighbouring ones it is closest to, so that a key close to the edge of a
+ * bin is not missed */
+static void identify_vote (const struct identify *identify, struct identify_query *query)
+{
+	const struct identify_points *probe = &query->probe;
+	const struct identify_bucket *bucket;
+	const struct identify_entry *entry;
+	struct identify_hit *hit;
+	unsigned int paired, n, m, i, j, e, corner;
+	int bin[3][2];
+	float key[3];
+
+	paired = probe->count < IDENTIFY_PAIRED ? probe->count : IDENTIFY_PAIRED;
+	for (n = 0; n < paired; n++) {
+		for (m = n + 1; m < paired; m++) {
+			i = n;
+			j = m;
+			if (identify_key (probe, &i, &j, key) < 0)
+				continue;
+			for (e = 0; e < 3; e++) {
+				bin[e][0] = key[e];
+				bin[e][1] = key[e] - bin[e][0] < 0.5f ? bin[e][0] - 1 : bin[e][0] + 1;
+			}
+			for (corner = 0; corner < 8; corner++) {
+				if (bin[0][corner & 1] < 0 || bin[0][corner & 1] >= IDENTIFY_DIST_BINS)
+					continue;
+				bucket = &identify->bucket[identify_bucket (bin[0][corner & 1],
+									   bin[1][(corner >> 1) & 1],
+									   bin[2][corner >> 2])];
+				for (e = 0; e < bucket->count; e++) {
+					entry = &bucket->entry[e];
+					if (query->votes[entry->slot]++ == 0) {
+						query->match[query->matches++].slot = entry->slot;
+						query->hits[entry->slot] = 0;
+					}
+					if (query->hits[entry->slot] == IDENTIFY_HITS)
+						continue;
+					hit = &query->hit[entry->slot * IDENTIFY_HITS + query->hits[entry->slot]++];
+					hit->probe[0] = i;
+					hit->probe[1] = j;
+					hit->gallery[0] = entry->i;
+					hit->gallery[1] = entry->j;
+				}
+			}
+		}
+	}
+}
+
+void identify_query_free (struct identify_query *query)
+{
+	if (query == NULL)
+		return;
+
+	free (query->probe.x);
+	free (query->votes);
+	free (query->hits);
+	free (query->hit);
+	free (query->match);
+	free (query);
+}
+
+/* votes for the templates and lists those to be compared in full, at
+ * least k of them */
+struct identify_query *identify_query_new (struct identify *identify, const libthinkfinger_features *probe, unsigned int k)
+{
+	struct identify_query *query;
+	unsigned int n, shortlist;
+
+	query = calloc (1, sizeof (*query));
+	if (query == NULL)
+		goto out;
+
+	if (identify_points_init (&query->probe, probe) < 0 ||
+	    (query->votes = calloc (identify->templates + 1, sizeof (*query->votes))) == NULL ||
+	    (query->hits = malloc ((identify->templates + 1) * sizeof (*query->hits))) == NULL ||
+	    (query->hit = malloc ((identify->templates + 1) * IDENTIFY_HITS * sizeof (*query->hit))) == NULL ||
+	    (query->match = malloc ((identify->templates + 1) * sizeof (*query->match))) == NULL) {
+		identify_query_free (query);
+		query = NULL;
+		goto out;
+	}
+
+	identify_vote (identify, query);
+
+	for (n = 0; n < query->matches; n++) {
+		query->match[n].votes = query->votes[query->match[n].slot];
+		query->match[n].score = 0;
+	}
+	qsort (query->match, query->matches, sizeof (*query->match), identify_votes);
+
+	shortlist = k > IDENTIFY_SHORTLIST ? k : IDENTIFY_SHORTLIST;
+	for (n = 0; n < query->matches && n < shortlist; n++)
+		if (query->match[n].votes < IDENTIFY_VOTES_MIN)
+			break;
+	query->shortlist = n;
+out:
+	return query;
+}
+
+unsigned int identify_shortlist (const struct identify_query *query)
+{
+	return query->shortlist;
+}
+
+/* the minutiae of the probe turned and moved so that the pair of the hit
+ * lies on the one of the template */
+static void identify_align (const struct identify_points *probe, const struct identify_points *gallery,
+			    const struct identify_hit *hit, float *x, float *y, float *c, float *s, unsigned int n)
+{
+	float turn, cos_turn, sin_turn, cos_twice, sin_twice;
+	float px, py, gx, gy, tx, ty;
+	unsigned int k;
+
+	turn = identify_segment (gallery, hit->gallery[0], hit->gallery[1]) -
+	       identify_segment (probe, hit->probe[0], hit->probe[1]);
+	cos_turn = cosf (turn);
+	sin_turn = sinf (turn);
+	cos_twice = cos_turn * cos_turn - sin_turn * sin_turn;
+	sin_twice = 2.0f * sin_turn * cos_turn;
+
+	/* the middle of the pair of the probe goes onto the one of the template;
+	 * rows count down, so counterclockwise turns y the other way round */
+	px = (probe->x[hit->probe[0]] + probe->x[hit->probe[1]]) * 0.5f;
+	py = (probe->y[hit->probe[0]] + probe->y[hit->probe[1]]) * 0.5f;
+	gx = (gallery->x[hit->gallery[0]] + gallery->x[hit->gallery[1]]) * 0.5f;
+	gy = (gallery->y[hit->gallery[0]] + gallery->y[hit->gallery[1]]) * 0.5f;
+	tx = gx - (px * cos_turn + py * sin_turn);
+	ty = gy - (py * cos_turn - px * sin_turn);
+
+	for (k = 0; k < n; k++) {
+		x[k] = probe->x[k] * cos_turn + probe->y[k] * sin_turn + tx;
+		y[k] = probe->y[k] * cos_turn - probe->x[k] * sin_turn + ty;
+		c[k] = probe->c[k] * cos_twice - probe->s[k] * sin_twice;
+		s[k] = probe->s[k] * cos_twice + probe->c[k] * sin_twice;
+	}
+}
+
+/* tries the alignment of every hit with the best minutiae of the probe and
+ * scores the best one with all of them: 100 if every minutia of both has a
+ * match, the square of the matched part otherwise */
+void identify_score (const struct identify *identify, struct identify_query *query, unsigned int n)
+{
+	const struct identify_points *probe = &query->probe;
+	struct identify_match *match = &query->match[n];
+	const struct identify_points *gallery = &identify->template[match->slot].points;
+	const struct identify_hit *hit = &query->hit[match->slot * IDENTIFY_HITS];
+	float x[TF_MINUTIAE_MAX], y[TF_MINUTIAE_MAX], c[TF_MINUTIAE_MAX], s[TF_MINUTIAE_MAX];
+	unsigned int hits = query->hits[match->slot];
+	unsigned int paired, matched, best = 0, h, i;
+
+	if (probe->count == 0 || gallery->count == 0) {
+		match->score = 0;
+		return;
+	}
+
+	paired = probe->count < IDENTIFY_PAIRED ? probe->count : IDENTIFY_PAIRED;
+	for (h = 0, i = 0; h < hits; h++) {
+		identify_align (probe, gallery, &hit[h], x, y, c, s, paired);
+		matched = identify->count (gallery, x, y, c, s, paired);
+		if (matched > best) {
+			best = matched;
+			i = h;
+		}
+	}
+
+	identify_align (probe, gallery, &hit[i], x, y, c, s, probe->count);
+	matched = identify->count (gallery, x, y, c, s, probe->count);
+	if (matched > probe->count)
+		matched = probe->count;
+	match->score = matched * matched * 100 / (probe->count * gallery->count);
+}
+
+static int identify_scores (const void *a, const void *b)
+{
+	const struct identify_match *m = a, *n = b;
+
+	if (m->score != n->score)
+		return m->score < n->score ? 1 : -1;
+	return identify_votes (a, b);
+}
+
+/* the k best templates of the shortlist, the best first */
+unsigned int identify_results (const struct identify *identify, struct identify_query *query,
+			       libthinkfinger_candidate *candidates, unsigned int k)
+{
+	unsigned int n;
+
+	qsort (query->match, query->shortlist, sizeof (*query->match), identify_scores);
+	for (n = 0; n < query->shortlist && n < k; n++) {
+		candidates[n].id = identify->template[query->match[n].slot].id;
+		candidates[n].score = query->match[n].score;
+	}
+
+	return n;
+}
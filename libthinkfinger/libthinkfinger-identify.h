@@ -0,0 +1,17 @@
+#ifndef THINKFINGER_IDENTIFY_H
+#define THINKFINGER_IDENTIFY_H
+
+struct identify;
+struct identify_query;
+
+struct identify *identify_new (void);
+void identify_free (struct identify *identify);
+int identify_add (struct identify *identify, unsigned int id, const libthinkfinger_features *features);
+struct identify_query *identify_query_new (struct identify *identify, const libthinkfinger_features *probe, unsigned int k);
+void identify_query_free (struct identify_query *query);
+unsigned int identify_shortlist (const struct identify_query *query);
+void identify_score (const struct identify *identify, struct identify_query *query, unsigned int n);
+unsigned int identify_results (const struct identify *identify, struct identify_query *query,
+			       libthinkfinger_candidate *candidates, unsigned int k);
+
+#endif /* THINKFINGER_IDENTIFY_H */
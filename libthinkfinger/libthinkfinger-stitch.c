@@ -0,0 +1,275 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   libthinkfinger-stitch - Reconstructs the image of a swipe from its strips
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   The finger moves over the sensor by less than a strip between two
+ *   strips, so every strip overlaps the one before.  The displacement is
+ *   the shift which minimizes the sum of absolute differences (SAD) of the
+ *   overlapping rows: 0 to 3 rows down the finger, up to STITCH_DX_MAX
+ *   columns sideways.  The rows the strip adds are appended to the image,
+ *   moved back by the sideways drift so far.
+ *
+ *   A span of STITCH_SPAN pixels in the middle of a row is compared; the
+ *   margins leave room for the sideways shift.  The SAD is computed with
+ *   AVX2 or SSE2 where the CPU has it.
+ */
+
+#include <string.h>
+
+#include "libthinkfinger.h"
+#include "libthinkfinger-stitch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STITCH_X86
+#endif
+
+#define STITCH_DX_MAX     8
+#define STITCH_MARGIN     12
+#define STITCH_SPAN       (TF_STRIP_WIDTH - 2 * STITCH_MARGIN)
+/* mean difference per pixel up to which two rows are taken to match */
+#define STITCH_MATCH      24
+/* strips in a row which did not overlap, before the swipe is too fast */
+#define STITCH_LOST_MAX   2
+/* columns the finger may drift sideways */
+#define STITCH_SKEW_MAX   48
+/* rows an image needs at least */
+#define STITCH_HEIGHT_MIN 64
+/* blocks of 16 pixels in a row and the contrast which shows a ridge */
+#define STITCH_BLOCK      16
+#define STITCH_CONTRAST   32
+/* percent of the blocks which need to show ridges */
+#define STITCH_COVERAGE   50
+/* pixels outside the sensor */
+#define STITCH_BACKGROUND 0xff
+
+static unsigned int stitch_sad_scalar (const u8 *a, const u8 *b)
+{
+	unsigned int sad = 0;
+	int i;
+
+	for (i = 0; i < STITCH_SPAN; i++)
+		sad += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+	return sad;
+}
+
+#ifdef STITCH_X86
+__attribute__ ((target ("sse2")))
+static unsigned int stitch_sad_sse2 (const u8 *a, const u8 *b)
+{
+	__m128i sum = _mm_setzero_si128 ();
+	int i;
+
+	for (i = 0; i + 16 <= STITCH_SPAN; i += 16)
+		sum = _mm_add_epi64 (sum, _mm_sad_epu8 (_mm_loadu_si128 ((const __m128i *) (a + i)),
+							_mm_loadu_si128 ((const __m128i *) (b + i))));
+	sum = _mm_add_epi64 (sum, _mm_unpackhi_epi64 (sum, sum));
+
+	return _mm_cvtsi128_si32 (sum);
+}
+
+__attribute__ ((target ("avx2")))
+static unsigned int stitch_sad_avx2 (const u8 *a, const u8 *b)
+{
+	__m256i sum = _mm256_setzero_si256 ();
+	__m128i half;
+	int i;
+
+	for (i = 0; i + 32 <= STITCH_SPAN; i += 32)
+		sum = _mm256_add_epi64 (sum, _mm256_sad_epu8 (_mm256_loadu_si256 ((const __m256i *) (a + i)),
+							      _mm256_loadu_si256 ((const __m256i *) (b + i))));
+	half = _mm_add_epi64 (_mm256_castsi256_si128 (sum), _mm256_extracti128_si256 (sum, 1));
+	half = _mm_add_epi64 (half, _mm_unpackhi_epi64 (half, half));
+
+	return _mm_cvtsi128_si32 (half);
+}
+#endif
+
+/* the spans are multiples of the vector widths */
+typedef char stitch_span_check[STITCH_SPAN % 32 == 0 ? 1 : -1];
+
+/* counts the blocks of a new image row and those which show ridges */
+static void stitch_coverage (struct stitch *stitch, const u8 *row)
+{
+	int x, i;
+	u8 min, max;
+
+	for (x = (TF_IMAGE_WIDTH % STITCH_BLOCK) / 2; x + STITCH_BLOCK <= TF_IMAGE_WIDTH; x += STITCH_BLOCK) {
+		min = max = row[x];
+		for (i = 1; i < STITCH_BLOCK; i++) {
+			if (row[x+i] < min)
+				min = row[x+i];
+			if (row[x+i] > max)
+				max = row[x+i];
+		}
+		stitch->blocks++;
+		if (max - min >= STITCH_CONTRAST)
+			stitch->covered++;
+	}
+}
+
+/* appends row y of the strip, moved back by the drift */
+static void stitch_append (struct stitch *stitch, const u8 *pixels, int y)
+{
+	libthinkfinger_swipe *swipe = &stitch->swipe;
+	const u8 *src = pixels + y * TF_STRIP_WIDTH;
+	u8 *row;
+	int skew = swipe->skew;
+
+	if (swipe->height == TF_IMAGE_HEIGHT)
+		return;
+	row = stitch->image + swipe->height * TF_IMAGE_WIDTH;
+	if (skew >= TF_IMAGE_WIDTH || -skew >= TF_IMAGE_WIDTH) {
+		memset (row, STITCH_BACKGROUND, TF_IMAGE_WIDTH);
+	} else if (skew >= 0) {
+		memcpy (row, src + skew, TF_IMAGE_WIDTH - skew);
+		memset (row + TF_IMAGE_WIDTH - skew, STITCH_BACKGROUND, skew);
+	} else {
+		memset (row, STITCH_BACKGROUND, -skew);
+		memcpy (row - skew, src, TF_IMAGE_WIDTH + skew);
+	}
+	stitch_coverage (stitch, row);
+	swipe->height++;
+}
+
+/* finds the displacement of the strip against the one before, returns the
+ * mean difference per pixel of the overlap */
+static unsigned int stitch_match (struct stitch *stitch, const u8 *pixels, int *dy, int *dx)
+{
+	unsigned int best = ~0U;
+	unsigned int sad;
+	int y, x, row;
+
+	for (y = 0; y < TF_STRIP_HEIGHT; y++) {
+		for (x = -STITCH_DX_MAX; x <= STITCH_DX_MAX; x++) {
+			sad = 0;
+			for (row = 0; row + y < TF_STRIP_HEIGHT; row++)
+				sad += stitch->sad (stitch->last + (row + y) * TF_STRIP_WIDTH + STITCH_MARGIN,
+						    pixels + row * TF_STRIP_WIDTH + STITCH_MARGIN + x);
+			/* compares the mean, fewer rows overlap the further the finger moved */
+			sad /= TF_STRIP_HEIGHT - y;
+			if (sad < best) {
+				best = sad;
+				*dy = y;
+				*dx = x;
+			}
+		}
+	}
+
+	return best / STITCH_SPAN;
+}
+
+static void stitch_judge (struct stitch *stitch)
+{
+	libthinkfinger_swipe *swipe = &stitch->swipe;
+	unsigned long long elapsed = stitch->time_last - stitch->time_first;
+
+	if (elapsed > 0)
+		swipe->speed = (unsigned long long) swipe->height * 1000000 / elapsed;
+	if (stitch->blocks > 0)
+		swipe->coverage = stitch->covered * 100 / stitch->blocks;
+
+	if (swipe->verdict != TF_SWIPE_OK)
+		return;
+	if (stitch->lost_run > STITCH_LOST_MAX)
+		swipe->verdict = TF_SWIPE_TOO_FAST;
+	else if (swipe->skew > STITCH_SKEW_MAX || -swipe->skew > STITCH_SKEW_MAX)
+		swipe->verdict = TF_SWIPE_SKEWED;
+}
+
+void stitch_init (struct stitch *stitch, u8 *image)
+{
+	stitch->sad = stitch_sad_scalar;
+#ifdef STITCH_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		stitch->sad = stitch_sad_avx2;
+	else if (__builtin_cpu_supports ("sse2"))
+		stitch->sad = stitch_sad_sse2;
+#endif
+	stitch->image = image;
+	stitch_reset (stitch);
+}
+
+void stitch_reset (struct stitch *stitch)
+{
+	stitch->time_first = 0;
+	stitch->time_last = 0;
+	stitch->blocks = 0;
+	stitch->covered = 0;
+	stitch->lost_run = 0;
+	memset (&stitch->swipe, 0, sizeof (stitch->swipe));
+	stitch->swipe.verdict = TF_SWIPE_OK;
+}
+
+/* adds a strip to the image, returns 1 once the swipe is to be rejected */
+int stitch_strip (struct stitch *stitch, const u8 *pixels, unsigned long long time_us)
+{
+	libthinkfinger_swipe *swipe = &stitch->swipe;
+	int dy = TF_STRIP_HEIGHT;
+	int dx = 0;
+	int y;
+
+	if (swipe->verdict != TF_SWIPE_OK)
+		return 1;
+
+	if (swipe->strips == 0) {
+		stitch->time_first = time_us;
+	} else if (stitch_match (stitch, pixels, &dy, &dx) > STITCH_MATCH) {
+		/* nothing overlaps, the finger moved by a strip or more */
+		dy = TF_STRIP_HEIGHT;
+		dx = 0;
+		swipe->lost++;
+		stitch->lost_run++;
+	} else {
+		stitch->lost_run = 0;
+	}
+	swipe->strips++;
+	stitch->time_last = time_us;
+
+	if (dy == 0) {
+		swipe->still++;
+	} else {
+		swipe->skew += dx;
+		for (y = TF_STRIP_HEIGHT - dy; y < TF_STRIP_HEIGHT; y++)
+			stitch_append (stitch, pixels, y);
+		memcpy (stitch->last, pixels, TF_STRIP_SIZE);
+	}
+
+	stitch_judge (stitch);
+	return swipe->verdict != TF_SWIPE_OK;
+}
+
+/* judges the whole swipe, returns 1 if it is to be rejected */
+int stitch_finish (struct stitch *stitch)
+{
+	libthinkfinger_swipe *swipe = &stitch->swipe;
+
+	stitch_judge (stitch);
+	if (swipe->verdict == TF_SWIPE_OK) {
+		if (swipe->height < STITCH_HEIGHT_MIN)
+			swipe->verdict = TF_SWIPE_TOO_SHORT;
+		else if (swipe->coverage < STITCH_COVERAGE)
+			swipe->verdict = TF_SWIPE_PARTIAL;
+	}
+
+	return swipe->verdict != TF_SWIPE_OK;
+}
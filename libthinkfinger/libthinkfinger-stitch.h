@@ -0,0 +1,23 @@
+#ifndef THINKFINGER_STITCH_H
+#define THINKFINGER_STITCH_H
+
+#include "libthinkfinger.h"
+
+struct stitch {
+	unsigned int (*sad) (const u8 *a, const u8 *b);	/* SAD of two spans of a row */
+	u8 *image;					/* TF_IMAGE_WIDTH * TF_IMAGE_HEIGHT pixels */
+	u8 last[TF_STRIP_SIZE];				/* the strip before, it may be released */
+	unsigned long long time_first;
+	unsigned long long time_last;
+	unsigned int blocks;				/* blocks of the image rows */
+	unsigned int covered;				/* and those which show ridges */
+	unsigned int lost_run;				/* strips in a row which did not overlap */
+	libthinkfinger_swipe swipe;
+};
+
+void stitch_init (struct stitch *stitch, u8 *image);
+void stitch_reset (struct stitch *stitch);
+int stitch_strip (struct stitch *stitch, const u8 *pixels, unsigned long long time_us);
+int stitch_finish (struct stitch *stitch);
+
+#endif /* THINKFINGER_STITCH_H */
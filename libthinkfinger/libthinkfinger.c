@@ -30,8 +30,25 @@
  *   Note that you need to be root to use this.
  */
 
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <sched.h>
+
 #include "libthinkfinger.h"
+#include "libthinkfinger-bir.h"
 #include "libthinkfinger-crc.h"
+#include "libthinkfinger-experimental.h"
+#include "libthinkfinger-extract.h"
+#include "libthinkfinger-identify.h"
+#include "libthinkfinger-frames.h"
+#include "libthinkfinger-stitch.h"
 
 #define USB_VENDOR_ID     0x0483
 #define USB_PRODUCT_ID    0x2016
@@ -41,101 +58,163 @@
 #define DEFAULT_BULK_SIZE 0x40
 #define INITIAL_SEQUENCE  0x60
 
-static char init_a[17] = {
-	0x43, 0x69, 0x61, 0x6f, 0x04, 0x00, 0x08, 0x01,
-	0x00, 0xe8, 0x03, 0x00, 0x00, 0xff, 0x07, 0xdb,
-	0x24
-};
+/* largest bulk packet the upload is assembled in */
+#define UPLOAD_PACKET_MAX 512
+/* largest template the 12 bit frame length leaves room for */
+#define UPLOAD_TEMPLATE_MAX (0xfff - (int) sizeof (upload_header) - 2 + 9)
+
+/* completed transfers needed before the learned timeout is used */
+#define TIMEOUT_SAMPLES   8
+
+/* reads done while draining the endpoint, and their timeout in ms */
+#define DRAIN_MAX         16
+#define DRAIN_TIMEOUT     20
+/* interval in ms of looking for the reader after a port reset */
+#define RESET_POLL        50
+
+/* sysfs directory of the USB devices, see _libthinkfinger_sysfs_find */
+#define SYSFS_USB         "/sys/bus/usb/devices"
+
+/* state changes queued for libthinkfinger_dispatch, a power of two */
+#define EVENT_QUEUE_LEN   64
+
+/* "TFLS", marks an initialized lease table */
+#define LEASE_MAGIC       0x544c4653
+/* processes which can queue for the reader, a power of two */
+#define LEASE_QUEUE_LEN   32
+/* time in ms a task waits for the reader by default */
+#define LEASE_TIMEOUT     30000
+/* interval in ms of looking for a holder which died */
+#define LEASE_POLL        250
+/* attempts of locking the lease table, 1 ms apart */
+#define LEASE_LOCK_TRIES  100
+/* time in ms a warm reader is kept for the next task by default */
+#define PREWARM_HOLD      10000
+/* a strip frame: "Ciao", flags 0x0a, length, the pixels and the CRC */
+#define STRIP_FRAME       (7 + TF_STRIP_SIZE + 2)
+/* slots are page aligned in groups of four */
+#define STRIP_SLOT        1024
+/* number of slots of the capture ring, a power of two */
+#define CAPTURE_RING_LEN  256
+/* ms the capture waits for a slot before it checks for a SIGINT again */
+#define CAPTURE_POLL      100
 
-static char init_b[16] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0x00, 0x07, 0x28,
-	0x04, 0x00, 0x00, 0x00, 0x06, 0x04, 0xc0, 0xd6
+struct init_table {
+	char *data;
+	size_t len;
 };
 
-static char init_c[16] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0x10, 0x07, 0x28,
-	0x04, 0x00, 0x00, 0x00, 0x07, 0x04, 0x0f, 0xb6
+static struct init_table init[] = {
+	{ init_a, sizeof (init_a) },
+	{ init_b, sizeof (init_b) },
+	{ init_c, sizeof (init_c) },
+	{ init_d, sizeof (init_d) },
+	{ init_e, sizeof (init_e) },
+	{ 0x0,    0x0 }
 };
 
-/* TODO: dynamic */
-static char init_d[40] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0x20, 0x1f, 0x28,
-	0x1c, 0x00, 0x00, 0x00, 0x08, 0x04, 0x83, 0x00,
-	0x2c, 0x22, 0x23, 0x97, 0xc9, 0xa7, 0x15, 0xa0,
-	0x8a, 0xab, 0x3c, 0xd0, 0xbf, 0xdb, 0xf3, 0x92,
-	0x6f, 0xae, 0x3b, 0x1e, 0x44, 0xc4, 0x9a, 0x45
-};
+static unsigned char termination_request = 0x01;
 
-static char init_e[20] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0x30, 0x0b, 0x28,
-	0x08, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x03, 0x00,
-	0x00, 0x00, 0x6d, 0x7e
+struct timeout_table {
+	libthinkfinger_timeout_policy policy;
+	unsigned int srtt;	/* smoothed latency in us, scaled by 8 */
+	unsigned int rttvar;	/* latency variation in us, scaled by 4 */
+	unsigned int samples;
 };
 
-/* TODO: dynamic */
-static char init_end[120] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0x40, 0x6f, 0x28,
-	0x6c, 0x00, 0x00, 0x00, 0x0b, 0x04, 0x03, 0x00,
-	0x00, 0x00, 0x60, 0x00, 0x00, 0x00, 0x03, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
-	0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
-	0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf4, 0x01,
-	0x00, 0x00, 0x64, 0x01, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x00,
-	0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00,
-	0x0a, 0x00, 0x64, 0x00, 0xf4, 0x01, 0x32, 0x00,
-	0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0xd6, 0x66
+static const libthinkfinger_timeout_policy default_policy[TF_PHASE_COUNT] = {
+	/* timeout     timeout_min  retries  backoff  adaptive */
+	{ USB_TIMEOUT, 500,         0,       0,       false },	/* TF_PHASE_HELLO */
+	{ USB_TIMEOUT, 250,         2,       10,      true  },	/* TF_PHASE_INIT */
+	{ USB_TIMEOUT, 500,         1,       10,      true  },	/* TF_PHASE_UPLOAD */
+	{ USB_TIMEOUT, USB_TIMEOUT, 0,       0,       false },	/* TF_PHASE_POLL */
+	{ 1000,        100,         0,       0,       true  }	/* TF_PHASE_DEINIT */
 };
 
-static char deinit[10] = {
-	0x43, 0x69, 0x61, 0x6f, 0x07, 0x00, 0x01, 0x00,
-	0x1c, 0x62
+/* time budget in ms of each recovery tier */
+static const unsigned int recovery_budget[TF_RECOVERY_COUNT] = {
+	500,	/* TF_RECOVERY_RESYNC */
+	2000,	/* TF_RECOVERY_RESET */
+	2000	/* TF_RECOVERY_REINIT */
 };
 
-static char device_busy[9] = {
-	0x43, 0x69, 0x61, 0x6f, 0x09, 0x00, 0x00, 0x91,
-	0x9e
+/* runtime PM settings of the reader, kept to restore them after the wait */
+struct runtime_pm {
+	char path[PATH_MAX];
+	char control[16];
+	char delay[16];
 };
 
-struct init_table {
-	char *data;
-	size_t len;
+/* single producer (the task) single consumer (libthinkfinger_dispatch) ring,
+ * head and tail only grow and are published with release stores */
+struct event_queue {
+	libthinkfinger_state state[EVENT_QUEUE_LEN];
+	unsigned int head;		/* next state to dispatch, consumer owned */
+	unsigned int tail;		/* next free slot, producer owned */
+	libthinkfinger_state last;	/* last queued state, producer owned */
+	int fd;				/* eventfd, counts queued states */
 };
 
-static struct init_table init[] = {
-	{ init_a, sizeof (init_a) },
-	{ init_b, sizeof (init_b) },
-	{ init_c, sizeof (init_c) },
-	{ init_d, sizeof (init_d) },
-	{ init_e, sizeof (init_e) },
-	{ 0x0,    0x0 }
+/* shared by the processes of a user through its lease, which is locked
+ * with flock(2) while it is changed.  Tickets are served in order; serving
+ * is the futex word the queue waits on.  Any process of the user may have
+ * written anything into it, see _libthinkfinger_lease_lock. */
+struct lease_table {
+	unsigned int magic;
+	unsigned int next;			/* next ticket to hand out */
+	unsigned int serving;			/* ticket whose turn it is */
+	pid_t holder;				/* process using the reader, 0 if none */
+	char name[16];				/* and its name */
+	pid_t queue[LEASE_QUEUE_LEN];		/* process of ticket t at t % LEASE_QUEUE_LEN */
+	unsigned int knock;			/* bumped by a process which queues, wakes a prewarmed holder */
 };
 
-static char ctrlbuf[1024] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0x51, 0x0b, 0x28,
-	0xb8, 0x00, 0x00, 0x00, 0x03, 0x02, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-	0x00, 0x00, 0xc0, 0xd4, 0x01, 0x00, 0x20, 0x00,
-	0x00, 0x00, 0x03
+struct lease {
+	int fd;
+	struct lease_table *table;
+	pthread_mutex_t mutex;				/* flock does not exclude the threads of a process */
+	unsigned int ticket;
+	unsigned int timeout;
+	_Bool held;
 };
 
-static char enroll_init[23] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0x50, 0x0e, 0x28,
-	0x0b, 0x00, 0x00, 0x00, 0x02, 0x02, 0xc0, 0xd4,
-	0x01, 0x00, 0x04, 0x00, 0x08, 0x0f, 0x86
+/* a reader kept initialized for the next task.  The watcher hands it back
+ * once the hold ran out or another process knocked; word is the futex word
+ * it waits on, the knock of the lease table. */
+struct prewarm {
+	pthread_t thread;
+	unsigned int *word;
+	unsigned long long expiry;			/* CLOCK_MONOTONIC in us */
+	_Bool watching;					/* the thread was not joined yet */
+	_Bool taken;					/* a task takes the reader, the watcher leaves */
+	_Bool released;					/* the watcher handed the reader back */
 };
 
-static unsigned char scan_sequence[17] = {
-	0x43, 0x69, 0x61, 0x6f, 0x00, 0xff, 0x08, 0x28,
-	0x05, 0x00, 0x00, 0x00, 0x00, 0x30, 0x01, 0xff,
-	0xff
+/* single producer (the capture) single consumer ring of strips.  The
+ * indices only grow; a slot is written once freed has passed it, which the
+ * consumer advances over the released slots.  freed and events are the
+ * futex words the producer and the consumer wait on. */
+struct capture_ring {
+	unsigned char *slots;				/* CAPTURE_RING_LEN * STRIP_SLOT bytes */
+	unsigned long long time_us[CAPTURE_RING_LEN];
+	unsigned long sequence[CAPTURE_RING_LEN];
+	unsigned char released[CAPTURE_RING_LEN];
+	unsigned int tail;				/* next slot to fill, producer owned */
+	unsigned int head;				/* next slot to take, consumer owned */
+	unsigned int freed;				/* first slot not released, consumer owned */
+	unsigned int events;				/* bumped for every strip and the end */
+	unsigned int stalled;				/* producer waits on freed */
+	unsigned int waiters;				/* consumers waiting on events */
+	_Bool ended;					/* no strip follows */
 };
 
-static unsigned char termination_request = 0x01;
+/* the state as observers see it, guarded by a sequence lock: sequence is
+ * odd while the snapshot is written and doubles as the futex word */
+struct state_publication {
+	unsigned int sequence;
+	unsigned int waiters;
+	libthinkfinger_snapshot snapshot;
+};
 
 struct libthinkfinger_s {
 	struct sigaction sigint_action;
@@ -147,12 +226,50 @@ struct libthinkfinger_s {
 	pthread_mutex_t usb_deinit_mutex;
 	libthinkfinger_task task;
 	_Bool task_running;
+	unsigned int busy;		/* threads within a task, libthinkfinger_free waits for them */
+	_Bool cancelled;		/* every task ends at once, see libthinkfinger_cancel */
 	_Bool result_pending;
+	_Bool initialized;
+	_Bool init_skipped;
+	_Bool continuous;		/* a failed verdict re-arms the reader */
+	_Bool resident;			/* the reader holds the template of the last verification */
+	_Bool rearm;			/* the verdict is to be answered with verify_rearm */
+	int flags;
 	unsigned char next_sequence;
 
+	libthinkfinger_phase phase;
+	struct timeout_table timeouts[TF_PHASE_COUNT];
+	unsigned long long deadline;
+	libthinkfinger_stats stats;
+
 	libthinkfinger_state state;
 	libthinkfinger_state_cb cb;
 	void *cb_data;
+	struct event_queue events;
+	struct state_publication published;
+	struct lease lease;
+	struct prewarm prewarm;
+	struct capture_ring capture;
+	struct stitch stitch;
+	struct extract *extract;
+
+	libthinkfinger_power_policy power;
+	unsigned int scan_wakeup;	/* futex word the wait between two polls sleeps on */
+	int usb_busnum;
+	int usb_devnum;
+
+	int max_packet;
+	unsigned int finger;
+	const u8 *bir;			/* the mapped record verify uses */
+	size_t bir_size;
+	const char *template;
+	int template_size;
+	char *resident_template;	/* a copy of the last template uploaded */
+	int resident_size;
+	u16 resident_crc;
+
+	char scan[sizeof (scan_sequence)];
+	char upload[sizeof (upload_header)];
 };
 
 static void sigint_handler (int unused, siginfo_t *sinfo, void *data) {
@@ -179,6 +296,63 @@ static int _libthinkfinger_restore_sigint (libthinkfinger *tf)
 	return retval;
 }
 
+/* monotonic time in us */
+static unsigned long long _libthinkfinger_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* publishes the state to observers if it changed since the last time */
+static void _libthinkfinger_publish (libthinkfinger *tf)
+{
+	struct state_publication *pub = &tf->published;
+	libthinkfinger_snapshot *snapshot = &pub->snapshot;
+	_Bool task_running = __atomic_load_n (&tf->task_running, __ATOMIC_RELAXED);
+	unsigned int sequence = pub->sequence;
+
+	if (snapshot->state == tf->state && snapshot->task == tf->task &&
+	    snapshot->task_running == task_running)
+		goto out;
+
+	__atomic_store_n (&pub->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	__atomic_store_n (&snapshot->sequence, snapshot->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_store_n (&snapshot->time_us, _libthinkfinger_now (), __ATOMIC_RELAXED);
+	__atomic_store_n (&snapshot->state, tf->state, __ATOMIC_RELAXED);
+	__atomic_store_n (&snapshot->task, tf->task, __ATOMIC_RELAXED);
+	__atomic_store_n (&snapshot->task_running, task_running, __ATOMIC_RELAXED);
+	__atomic_store_n (&pub->sequence, sequence + 2, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n (&pub->waiters, __ATOMIC_SEQ_CST) > 0)
+		syscall (SYS_futex, &pub->sequence, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+out:
+	return;
+}
+
+/* copies the published state, returns the sequence it was read at */
+static unsigned int _libthinkfinger_snapshot_read (libthinkfinger *tf, libthinkfinger_snapshot *copy)
+{
+	struct state_publication *pub = &tf->published;
+	libthinkfinger_snapshot *snapshot = &pub->snapshot;
+	unsigned int sequence;
+
+	do {
+		while ((sequence = __atomic_load_n (&pub->sequence, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield ();
+		copy->sequence = __atomic_load_n (&snapshot->sequence, __ATOMIC_RELAXED);
+		copy->time_us = __atomic_load_n (&snapshot->time_us, __ATOMIC_RELAXED);
+		copy->state = __atomic_load_n (&snapshot->state, __ATOMIC_RELAXED);
+		copy->task = __atomic_load_n (&snapshot->task, __ATOMIC_RELAXED);
+		copy->task_running = __atomic_load_n (&snapshot->task_running, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n (&pub->sequence, __ATOMIC_RELAXED) != sequence);
+
+	return sequence;
+}
+
 static _Bool _libthinkfinger_result_pending (libthinkfinger *tf)
 {
 	return tf->result_pending;
@@ -193,18 +367,55 @@ static void _libthinkfinger_task_start (libthinkfinger *tf, libthinkfinger_task
 {
 	tf->task = task;
 	tf->state = TF_STATE_INITIAL;
-	tf->task_running = true;
+	__atomic_store_n (&tf->task_running, true, __ATOMIC_RELEASE);
+	/* only state changes within a task are coalesced */
+	tf->events.last = TF_STATE_UNDEFINED;
+	_libthinkfinger_publish (tf);
 }
 
 static void _libthinkfinger_task_stop (libthinkfinger *tf)
 {
-	tf->task_running = false;
+	__atomic_store_n (&tf->task_running, false, __ATOMIC_RELEASE);
 	tf->task = TF_TASK_IDLE;
+	_libthinkfinger_publish (tf);
 }
 
 static _Bool _libthinkfinger_task_running (libthinkfinger *tf)
 {
-	return tf->task_running;
+	return __atomic_load_n (&tf->task_running, __ATOMIC_ACQUIRE);
+}
+
+/* counts the threads within a task, from before the wait for the reader
+ * until the result is known */
+static void _libthinkfinger_enter (libthinkfinger *tf)
+{
+	__atomic_add_fetch (&tf->busy, 1, __ATOMIC_SEQ_CST);
+}
+
+/* the last access of a task to tf, which may be freed right after */
+static void _libthinkfinger_leave (libthinkfinger *tf)
+{
+	unsigned int *busy = &tf->busy;
+
+	if (__atomic_sub_fetch (busy, 1, __ATOMIC_SEQ_CST) == 0)
+		syscall (SYS_futex, busy, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static _Bool _libthinkfinger_cancelled (libthinkfinger *tf)
+{
+	return __atomic_load_n (&tf->cancelled, __ATOMIC_SEQ_CST);
+}
+
+/* wakes a task of tf from whatever it sleeps on, so that it notices the
+ * cancellation: the queue for the reader, the wait between two polls or a
+ * stalled capture */
+static void _libthinkfinger_wake (libthinkfinger *tf)
+{
+	__atomic_fetch_add (&tf->scan_wakeup, 1, __ATOMIC_SEQ_CST);
+	syscall (SYS_futex, &tf->scan_wakeup, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	if (tf->lease.table != NULL)
+		syscall (SYS_futex, &tf->lease.table->serving, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	syscall (SYS_futex, &tf->capture.freed, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 }
 
 static libthinkfinger_result _libthinkfinger_get_result (libthinkfinger_state state)
@@ -223,6 +434,9 @@ static libthinkfinger_result _libthinkfinger_get_result (libthinkfinger_state st
 		case TF_STATE_VERIFY_FAILED:
 			retval = TF_RESULT_VERIFY_FAILED;
 			break;
+		case TF_STATE_TIMEOUT:
+			retval = TF_RESULT_TIMEOUT;
+			break;
 		case TF_STATE_OPEN_FAILED:
 			retval = TF_RESULT_OPEN_FAILED;
 			break;
@@ -235,6 +449,18 @@ static libthinkfinger_result _libthinkfinger_get_result (libthinkfinger_state st
 		case TF_STATE_COMM_FAILED:
 			retval = TF_RESULT_COMM_FAILED;
 			break;
+		case TF_STATE_DEVICE_BUSY:
+			retval = TF_RESULT_DEVICE_BUSY;
+			break;
+		case TF_STATE_BIR_CORRUPT:
+			retval = TF_RESULT_BIR_CORRUPT;
+			break;
+		case TF_STATE_CAPTURE_SUCCESS:
+			retval = TF_RESULT_CAPTURE_SUCCESS;
+			break;
+		case TF_STATE_CAPTURE_FAILED:
+			retval = TF_RESULT_CAPTURE_FAILED;
+			break;
 		default:
 			retval = TF_RESULT_UNDEFINED;
 			break;
@@ -260,11 +486,94 @@ static void usb_dump (const char *func, unsigned char *bytes, int req_size, int
 }
 #endif
 
-static int _libthinkfinger_usb_hello (struct usb_dev_handle *handle)
+static void _libthinkfinger_set_phase (libthinkfinger *tf, libthinkfinger_phase phase)
 {
+	tf->phase = phase;
+}
+
+static _Bool _libthinkfinger_deadline_expired (libthinkfinger *tf)
+{
+	return tf->deadline != 0 && _libthinkfinger_now () >= tf->deadline;
+}
+
+/* feeds the latency of a transfer into the estimator (RFC 2988 style) */
+static void _libthinkfinger_timeout_sample (struct timeout_table *timeout, unsigned long long latency)
+{
+	int delta;
+
+	if (latency > USB_TIMEOUT * 1000)
+		latency = USB_TIMEOUT * 1000;
+
+	if (timeout->samples++ == 0) {
+		timeout->srtt = latency << 3;
+		timeout->rttvar = latency << 1;
+		return;
+	}
+
+	delta = (int) latency - (int) (timeout->srtt >> 3);
+	timeout->srtt += delta;
+	if (delta < 0)
+		delta = -delta;
+	delta -= timeout->rttvar >> 2;
+	timeout->rttvar += delta;
+}
+
+/* returns the timeout in ms for the next transfer of the current phase, 0 if
+ * the deadline has expired */
+static unsigned int _libthinkfinger_timeout (libthinkfinger *tf, unsigned int attempt)
+{
+	struct timeout_table *timeout = &tf->timeouts[tf->phase];
+	unsigned long long now;
+	unsigned int retval = timeout->policy.timeout;
+	unsigned int learned;
+
+	if (timeout->policy.adaptive && timeout->samples >= TIMEOUT_SAMPLES) {
+		learned = ((timeout->srtt >> 3) + timeout->rttvar + 999) / 1000;
+		/* a transfer which timed out gets twice the time on every retry */
+		learned <<= attempt;
+		if (learned < timeout->policy.timeout_min)
+			learned = timeout->policy.timeout_min;
+		if (learned < retval)
+			retval = learned;
+	}
+
+	if (tf->deadline != 0) {
+		now = _libthinkfinger_now ();
+		if (now >= tf->deadline)
+			return 0;
+		if ((tf->deadline - now + 999) / 1000 < retval)
+			retval = (tf->deadline - now + 999) / 1000;
+	}
+
+	return retval;
+}
+
+/* waits before retry number attempt, returns -1 if the deadline expires meanwhile */
+static int _libthinkfinger_backoff (libthinkfinger *tf, unsigned int attempt)
+{
+	unsigned long long delay;
+
+	delay = (unsigned long long) tf->timeouts[tf->phase].policy.backoff * 1000 << (attempt - 1);
+	if (tf->deadline != 0 && _libthinkfinger_now () + delay >= tf->deadline)
+		return -1;
+	if (delay > 0)
+		usleep (delay);
+
+	return 0;
+}
+
+static int _libthinkfinger_usb_hello (libthinkfinger *tf)
+{
+	struct usb_dev_handle *handle = tf->usb_dev_handle;
+	unsigned int timeout;
 	int retval = -1;
 	char dummy[] = "\x10";
 
+	/* libusb treats 0 as no timeout at all */
+	timeout = _libthinkfinger_timeout (tf, 0);
+	if (timeout == 0)
+		goto out;
+
 	/* SET_CONFIGURATION 1 -- should not be relevant */
 	retval = usb_control_msg (handle,	 // usb_dev_handle *dev
 				   0x00000000,	 // int requesttype
@@ -273,7 +582,7 @@ static int _libthinkfinger_usb_hello (struct usb_dev_handle *handle)
 				   0x000,	 // int index
 				   dummy,	 // char *bytes
 				   0x00000000,	 // int size
-				   USB_TIMEOUT); // int timeout
+				   timeout);     // int timeout
 	if (retval < 0)
 		goto out;
 	retval = usb_control_msg (handle,	 // usb_dev_handle *dev
@@ -283,12 +592,49 @@ static int _libthinkfinger_usb_hello (struct usb_dev_handle *handle)
 				   0x400,	 // int index
 				   dummy,	 // char *bytes
 				   0x00000001,	 // int size
-				   USB_TIMEOUT); // int timeout
+				   timeout);     // int timeout
 
 out:
 	return retval;
 }
 
+/* runs a bulk transfer under the timeout policy of the current phase, a
+ * transfer which timed out is repeated up to retries times */
+static int _libthinkfinger_usb_bulk (libthinkfinger *tf, int ep, char *bytes, int size, unsigned int retries)
+{
+	struct timeout_table *timeout = &tf->timeouts[tf->phase];
+	unsigned long long start;
+	unsigned int attempt;
+	unsigned int ms;
+	int usb_retval = -ETIMEDOUT;
+
+	for (attempt = 0; attempt <= retries; attempt++) {
+		if (attempt > 0 && _libthinkfinger_backoff (tf, attempt) < 0)
+			break;
+		ms = _libthinkfinger_timeout (tf, attempt);
+		/* libusb treats 0 as no timeout at all */
+		if (ms == 0)
+			break;
+
+		start = _libthinkfinger_now ();
+		if (ep == USB_WR_EP)
+			usb_retval = usb_bulk_write (tf->usb_dev_handle, ep, bytes, size, ms);
+		else
+			usb_retval = usb_bulk_read (tf->usb_dev_handle, ep, bytes, size, ms);
+
+		if (usb_retval != -ETIMEDOUT) {
+			if (usb_retval >= 0)
+				_libthinkfinger_timeout_sample (timeout, _libthinkfinger_now () - start);
+			break;
+		}
+		/* a timeout tells that the latency has been underestimated */
+		if (timeout->policy.adaptive && retries > 0)
+			_libthinkfinger_timeout_sample (timeout, (unsigned long long) ms * 1000);
+	}
+
+	return usb_retval;
+}
+
 static int _libthinkfinger_usb_write (libthinkfinger *tf, char *bytes, int size) {
 	int usb_retval = -1;
 
@@ -299,7 +645,9 @@ static int _libthinkfinger_usb_write (libthinkfinger *tf, char *bytes, int size)
 		goto out;
 	}
 
-	usb_retval = usb_bulk_write (tf->usb_dev_handle, USB_WR_EP, bytes, size, USB_TIMEOUT);
+	/* a write which timed out may have been sent in part, sending it again
+	 * would corrupt the stream; the task resyncs with the reader instead */
+	usb_retval = _libthinkfinger_usb_bulk (tf, USB_WR_EP, bytes, size, 0);
 	if (usb_retval >= 0 && usb_retval != size)
 		fprintf (stderr, "Warning: usb_bulk_write expected to write 0x%x (wrote 0x%x bytes).\n",
 			 size, usb_retval);
@@ -311,7 +659,7 @@ out:
 	return usb_retval;
 }
 
-static int _libthinkfinger_usb_read (libthinkfinger *tf, char *bytes, int size) {
+static int _libthinkfinger_usb_read_retry (libthinkfinger *tf, char *bytes, int size, unsigned int retries) {
 	int usb_retval = -1;
 
 	if (tf->usb_dev_handle == NULL) {
@@ -321,7 +669,7 @@ static int _libthinkfinger_usb_read (libthinkfinger *tf, char *bytes, int size)
 		goto out;
 	}
 
-	usb_retval = usb_bulk_read (tf->usb_dev_handle, USB_RD_EP, bytes, size, USB_TIMEOUT);
+	usb_retval = _libthinkfinger_usb_bulk (tf, USB_RD_EP, bytes, size, retries);
 	if (usb_retval >= 0 && usb_retval != size)
 		fprintf (stderr, "Warning: usb_bulk_read expected to read 0x%x (read 0x%x bytes).\n",
 			 size, usb_retval);
@@ -332,6 +680,20 @@ out:
 	return usb_retval;
 }
 
+/* reads a reply which may or may not come: the protocol expects such reads
+ * to time out, they are not repeated */
+static int _libthinkfinger_usb_read (libthinkfinger *tf, char *bytes, int size)
+{
+	return _libthinkfinger_usb_read_retry (tf, bytes, size, 0);
+}
+
+/* reads the rest of a reply whose start has arrived; the device is sending
+ * it, so a read which timed out is repeated under the policy of the phase */
+static int _libthinkfinger_usb_read_rest (libthinkfinger *tf, char *bytes, int size)
+{
+	return _libthinkfinger_usb_read_retry (tf, bytes, size, tf->timeouts[tf->phase].policy.retries);
+}
+
 static void _libthinkfinger_usb_flush (libthinkfinger *tf)
 {
 	char buf[64];
@@ -363,6 +725,319 @@ out:
 	return dev;
 }
 
+/* returns the max packet size of the bulk OUT endpoint */
+static int _libthinkfinger_usb_max_packet (struct usb_device *dev)
+{
+	struct usb_interface_descriptor *altsetting;
+	int size = DEFAULT_BULK_SIZE;
+	int i;
+
+	if (dev->config == NULL || dev->config->interface == NULL)
+		goto out;
+
+	altsetting = dev->config->interface->altsetting;
+	for (i = 0; altsetting != NULL && i < altsetting->bNumEndpoints; i++) {
+		if (altsetting->endpoint[i].bEndpointAddress == USB_WR_EP) {
+			size = altsetting->endpoint[i].wMaxPacketSize & 0x7ff;
+			break;
+		}
+	}
+	if (size <= 0 || size > UPLOAD_PACKET_MAX)
+		size = DEFAULT_BULK_SIZE;
+out:
+	return size;
+}
+
+/* the queue reports a busy reader before the state handling is defined */
+static void _libthinkfinger_notify (libthinkfinger *tf, libthinkfinger_state state);
+
+/* skips the tickets of processes which left the queue or died, the table is
+ * locked; returns true if the turn moved on */
+static _Bool _libthinkfinger_lease_skip (struct lease_table *table)
+{
+	pid_t *pid;
+	_Bool moved = false;
+
+	while (table->serving != table->next) {
+		pid = &table->queue[table->serving % LEASE_QUEUE_LEN];
+		/* a process which may not be signalled has no business in the
+		 * lease of this user and is taken as gone */
+		if (*pid > 0 && kill (*pid, 0) == 0)
+			break;
+		*pid = 0;
+		table->holder = 0;
+		table->name[0] = '\0';
+		__atomic_store_n (&table->serving, table->serving + 1, __ATOMIC_SEQ_CST);
+		moved = true;
+	}
+
+	return moved;
+}
+
+/* the prewarm watcher releases the lease while the caller may queue or
+ * read it, the mutex keeps the two threads out of the table at once.  A
+ * process keeping the table locked is given up on, and a table whose queue
+ * is longer than it can be is started afresh, so that neither stalls the
+ * caller; returns -1 if the table could not be locked */
+static int _libthinkfinger_lease_lock (libthinkfinger *tf)
+{
+	struct lease_table *table = tf->lease.table;
+	int tries = LEASE_LOCK_TRIES;
+
+	pthread_mutex_lock (&tf->lease.mutex);
+	while (flock (tf->lease.fd, LOCK_EX | LOCK_NB) < 0) {
+		if ((errno != EWOULDBLOCK && errno != EINTR) || --tries == 0) {
+			pthread_mutex_unlock (&tf->lease.mutex);
+			return -1;
+		}
+		usleep (1000);
+	}
+	if (table->magic != LEASE_MAGIC || table->next - table->serving > LEASE_QUEUE_LEN) {
+		memset (table, 0, sizeof (*table));
+		table->magic = LEASE_MAGIC;
+	}
+
+	return 0;
+}
+
+/* unlocks the table and wakes the queue if the turn moved on */
+static void _libthinkfinger_lease_unlock (libthinkfinger *tf, _Bool moved)
+{
+	flock (tf->lease.fd, LOCK_UN);
+	pthread_mutex_unlock (&tf->lease.mutex);
+	if (moved)
+		syscall (SYS_futex, &tf->lease.table->serving, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* names the lease of the calling user: root's lies in TF_RUNDIR, that of
+ * any other user in its runtime directory.  A process which can write the
+ * table can hold up every other one using it, so only the processes of one
+ * user share it; the directory has to be the user's own */
+static int _libthinkfinger_lease_path (char *path, size_t size)
+{
+	const char *dir;
+	const char *name;
+	struct stat st;
+	int len;
+	int retval = -1;
+
+	if (geteuid () == 0) {
+		if (mkdir (TF_RUNDIR, 0755) < 0 && errno != EEXIST) {
+			fprintf (stderr, "Error while creating \"%s\", the reader is not arbitrated: %s.\n",
+				 TF_RUNDIR, strerror (errno));
+			goto out;
+		}
+		dir = TF_RUNDIR;
+		name = "lease";
+	} else {
+		/* the environment of a set-user-ID program is its caller's */
+		dir = getuid () == geteuid () ? getenv ("XDG_RUNTIME_DIR") : NULL;
+		if (dir == NULL || dir[0] != '/')
+			goto out;
+		name = "thinkfinger-lease";
+	}
+
+	if (lstat (dir, &st) < 0 || !S_ISDIR (st.st_mode) ||
+	    st.st_uid != geteuid () || (st.st_mode & 022) != 0) {
+		fprintf (stderr, "Error: \"%s\" is not a directory of the user alone, the reader is not arbitrated.\n", dir);
+		goto out;
+	}
+	len = snprintf (path, size, "%s/%s", dir, name);
+	if (len < 0 || (size_t) len >= size)
+		goto out;
+
+	retval = 0;
+out:
+	return retval;
+}
+
+/* maps the table shared by the processes of the user, without it the
+ * device is not arbitrated */
+static void _libthinkfinger_lease_open (libthinkfinger *tf)
+{
+	struct lease_table *table;
+	struct stat st;
+	char path[PATH_MAX];
+	_Bool reset = false;
+
+	if (_libthinkfinger_lease_path (path, sizeof (path)) < 0)
+		goto out;
+	tf->lease.fd = open (path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (tf->lease.fd < 0) {
+		fprintf (stderr, "Error while opening \"%s\", the reader is not arbitrated: %s.\n",
+			 path, strerror (errno));
+		goto out;
+	}
+
+	if (fstat (tf->lease.fd, &st) < 0) {
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+		goto out_close;
+	}
+	if (S_ISREG (st.st_mode) == 0 || st.st_uid != geteuid ()) {
+		fprintf (stderr, "Error: \"%s\" is not a file of the user, the reader is not arbitrated.\n", path);
+		goto out_close;
+	}
+	/* an older release left the lease writable by everyone, what is in
+	 * it may have been written by anyone */
+	if ((st.st_mode & 077) != 0) {
+		if (fchmod (tf->lease.fd, 0600) < 0) {
+			fprintf (stderr, "Error while changing the mode of \"%s\": %s.\n", path, strerror (errno));
+			goto out_close;
+		}
+		reset = true;
+	}
+	if (st.st_size < (off_t) sizeof (*table) && ftruncate (tf->lease.fd, sizeof (*table)) < 0) {
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+		goto out_close;
+	}
+	table = mmap (NULL, sizeof (*table), PROT_READ | PROT_WRITE, MAP_SHARED, tf->lease.fd, 0);
+	if (table == MAP_FAILED) {
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+		goto out_close;
+	}
+
+	tf->lease.table = table;
+	if (_libthinkfinger_lease_lock (tf) < 0) {
+		fprintf (stderr, "Error: \"%s\" is kept locked, the reader is not arbitrated.\n", path);
+		goto out_unmap;
+	}
+	if (reset == true) {
+		memset (table, 0, sizeof (*table));
+		table->magic = LEASE_MAGIC;
+	}
+	_libthinkfinger_lease_unlock (tf, false);
+	goto out;
+
+out_unmap:
+	munmap (table, sizeof (*table));
+	tf->lease.table = NULL;
+out_close:
+	close (tf->lease.fd);
+	tf->lease.fd = -1;
+out:
+	return;
+}
+
+/* takes a ticket and waits for its turn, at most until the lease timeout or
+ * the deadline of the task passed */
+static int _libthinkfinger_lease_acquire (libthinkfinger *tf)
+{
+	struct lease_table *table = tf->lease.table;
+	struct timespec timeout;
+	unsigned long long end;
+	unsigned long long now;
+	unsigned long long wait;
+	unsigned int serving;
+	_Bool interrupted = false;
+	_Bool moved;
+	_Bool knock;
+	int retval = -1;
+
+	if (table == NULL || tf->lease.held == true) {
+		retval = 0;
+		goto out;
+	}
+
+	now = _libthinkfinger_now ();
+	end = now + tf->lease.timeout * 1000ULL;
+	if (tf->deadline != 0 && tf->deadline < end)
+		end = tf->deadline;
+
+	if (_libthinkfinger_lease_lock (tf) < 0)
+		goto out;
+	moved = _libthinkfinger_lease_skip (table);
+	if (table->next - table->serving >= LEASE_QUEUE_LEN) {
+		_libthinkfinger_lease_unlock (tf, moved);
+		goto out;
+	}
+	tf->lease.ticket = table->next++;
+	table->queue[tf->lease.ticket % LEASE_QUEUE_LEN] = getpid ();
+	knock = tf->lease.timeout > 0 && table->holder != 0;
+	if (knock)
+		__atomic_fetch_add (&table->knock, 1, __ATOMIC_SEQ_CST);
+	_libthinkfinger_lease_unlock (tf, moved);
+	/* a holder which only keeps the reader warm lets go of it */
+	if (knock)
+		syscall (SYS_futex, &table->knock, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	while ((serving = __atomic_load_n (&table->serving, __ATOMIC_SEQ_CST)) != tf->lease.ticket) {
+		if (termination_request == 0x00 || _libthinkfinger_cancelled (tf)) {
+			interrupted = true;
+			break;
+		}
+		now = _libthinkfinger_now ();
+		if (now >= end)
+			break;
+		if (tf->state != TF_STATE_DEVICE_BUSY) {
+			tf->state = TF_STATE_DEVICE_BUSY;
+			_libthinkfinger_publish (tf);
+			if (tf->cb != NULL)
+				_libthinkfinger_notify (tf, tf->state);
+		}
+
+		/* a holder which died does not wake the queue, look after it now and then */
+		wait = end - now < LEASE_POLL * 1000ULL ? end - now : LEASE_POLL * 1000ULL;
+		timeout.tv_sec = wait / 1000000;
+		timeout.tv_nsec = wait % 1000000 * 1000;
+		syscall (SYS_futex, &table->serving, FUTEX_WAIT, serving, &timeout, NULL, 0);
+
+		if (_libthinkfinger_lease_lock (tf) == 0)
+			_libthinkfinger_lease_unlock (tf, _libthinkfinger_lease_skip (table));
+	}
+
+	if (_libthinkfinger_lease_lock (tf) < 0) {
+		/* leave the queue all the same, the ticket is skipped once it is up */
+		__atomic_store_n (&table->queue[tf->lease.ticket % LEASE_QUEUE_LEN], 0, __ATOMIC_SEQ_CST);
+		goto out;
+	}
+	if (table->serving == tf->lease.ticket) {
+		table->holder = getpid ();
+		if (prctl (PR_GET_NAME, table->name) < 0)
+			table->name[0] = '\0';
+		tf->lease.held = true;
+		retval = 0;
+	} else {
+		/* leave the queue, the ticket is skipped once it is up */
+		table->queue[tf->lease.ticket % LEASE_QUEUE_LEN] = 0;
+	}
+	_libthinkfinger_lease_unlock (tf, false);
+out:
+	if (retval < 0) {
+		tf->state = interrupted ? TF_STATE_SIGINT : TF_STATE_DEVICE_BUSY;
+		/* the request has been served, do not cancel the next task */
+		if (termination_request == 0x00)
+			termination_request = 0x01;
+	}
+	return retval;
+}
+
+static void _libthinkfinger_lease_release (libthinkfinger *tf)
+{
+	struct lease_table *table = tf->lease.table;
+
+	if (tf->lease.held == false)
+		goto out;
+
+	if (_libthinkfinger_lease_lock (tf) < 0) {
+		/* the next process skips the ticket once it gets hold of the table */
+		__atomic_store_n (&table->queue[tf->lease.ticket % LEASE_QUEUE_LEN], 0, __ATOMIC_SEQ_CST);
+		syscall (SYS_futex, &table->serving, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		goto out_released;
+	}
+	if (table->serving == tf->lease.ticket) {
+		table->queue[tf->lease.ticket % LEASE_QUEUE_LEN] = 0;
+		table->holder = 0;
+		table->name[0] = '\0';
+		__atomic_store_n (&table->serving, table->serving + 1, __ATOMIC_SEQ_CST);
+		_libthinkfinger_lease_skip (table);
+	}
+	_libthinkfinger_lease_unlock (tf, true);
+out_released:
+	tf->lease.held = false;
+out:
+	return;
+}
+
 static void _libthinkfinger_usb_deinit_lock (libthinkfinger *tf)
 {
 	if (pthread_mutex_lock (&tf->usb_deinit_mutex) < 0)
@@ -400,6 +1075,8 @@ fprintf (stderr, "USB deinitialization...\n");
 #endif
 
 		termination_request = 0x00;
+		__atomic_fetch_add (&tf->scan_wakeup, 1, __ATOMIC_SEQ_CST);
+		syscall (SYS_futex, &tf->scan_wakeup, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 		usleep (50000);
 	}
 
@@ -407,6 +1084,7 @@ fprintf (stderr, "USB deinitialization...\n");
 	fprintf (stderr, "sending deinitialization sequence.\n");
 #endif
 
+	_libthinkfinger_set_phase (tf, TF_PHASE_DEINIT);
 	usb_retval = _libthinkfinger_usb_write (tf, deinit, sizeof(deinit));
 	if (usb_retval < 0 && usb_retval != -ETIMEDOUT)
 		goto usb_close;
@@ -416,6 +1094,7 @@ usb_close:
 	usb_release_interface (tf->usb_dev_handle, 0);
 	usb_close (tf->usb_dev_handle);
 	tf->usb_dev_handle = NULL;
+	tf->initialized = false;
 out:
 	_libthinkfinger_usb_deinit_unlock (tf);
 
@@ -425,15 +1104,107 @@ fprintf (stderr, "USB deinitialization finished.\n");
 	return;
 }
 
-static libthinkfinger_init_status _libthinkfinger_usb_init (libthinkfinger *tf)
+/* keeps a prewarmed reader until a task takes it; hands it back once the
+ * hold ran out or another process knocked on the lease */
+static void *_libthinkfinger_prewarm_watch (void *data)
+{
+	libthinkfinger *tf = data;
+	struct prewarm *prewarm = &tf->prewarm;
+	struct timespec timeout;
+	unsigned long long now;
+	unsigned int knock;
+
+	knock = __atomic_load_n (prewarm->word, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n (&prewarm->taken, __ATOMIC_SEQ_CST) == false) {
+		now = _libthinkfinger_now ();
+		if (now >= prewarm->expiry)
+			goto out_release;
+		timeout.tv_sec = (prewarm->expiry - now) / 1000000;
+		timeout.tv_nsec = (prewarm->expiry - now) % 1000000 * 1000;
+		syscall (SYS_futex, prewarm->word, FUTEX_WAIT, knock, &timeout, NULL, 0);
+
+		if (__atomic_load_n (&prewarm->taken, __ATOMIC_SEQ_CST) == true)
+			break;
+		if (__atomic_load_n (prewarm->word, __ATOMIC_SEQ_CST) != knock)
+			goto out_release;
+	}
+	goto out;
+
+out_release:
+	_libthinkfinger_usb_deinit (tf);
+	_libthinkfinger_lease_release (tf);
+	prewarm->released = true;
+out:
+	return NULL;
+}
+
+/* stops the watcher of a prewarmed reader, the handle is the caller's
+ * again; it is still open unless the watcher handed it back */
+static void _libthinkfinger_prewarm_take (libthinkfinger *tf)
+{
+	struct prewarm *prewarm = &tf->prewarm;
+
+	if (prewarm->watching == false)
+		goto out;
+
+	__atomic_store_n (&prewarm->taken, true, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add (prewarm->word, 1, __ATOMIC_SEQ_CST);
+	syscall (SYS_futex, prewarm->word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	pthread_join (prewarm->thread, NULL);
+	prewarm->watching = false;
+
+	if (prewarm->released == true)
+		tf->stats.prewarms_released++;
+	else
+		tf->stats.prewarms_used++;
+out:
+	return;
+}
+
+/* starts the watcher keeping the initialized reader for hold ms */
+static int _libthinkfinger_prewarm_hold (libthinkfinger *tf, unsigned int hold)
+{
+	struct prewarm *prewarm = &tf->prewarm;
+
+	prewarm->word = &tf->lease.table->knock;
+	prewarm->expiry = _libthinkfinger_now () + hold * 1000ULL;
+	prewarm->taken = false;
+	prewarm->released = false;
+	if (pthread_create (&prewarm->thread, NULL, _libthinkfinger_prewarm_watch, tf) != 0)
+		return -1;
+	prewarm->watching = true;
+	tf->stats.prewarms++;
+
+	return 0;
+}
+
+/* hands the device to the next process once a task is done.  An
+ * initialized reader is kept for the next task of tf until another process
+ * knocks on the lease, so that a waiter does not wait for it, or until the
+ * hold ran out, as a claimed reader does not suspend */
+static void _libthinkfinger_lease_yield (libthinkfinger *tf)
+{
+	if (tf->lease.held == false)
+		goto out;
+
+	if (tf->usb_dev_handle != NULL && tf->initialized == true &&
+	    _libthinkfinger_cancelled (tf) == false &&
+	    _libthinkfinger_prewarm_hold (tf, PREWARM_HOLD) == 0)
+		goto out;
+
+	if (tf->usb_dev_handle != NULL)
+		_libthinkfinger_usb_deinit (tf);
+	_libthinkfinger_lease_release (tf);
+out:
+	return;
+}
+
+/* finds, opens and claims the USB device */
+static libthinkfinger_init_status _libthinkfinger_usb_open (libthinkfinger *tf)
 {
 	libthinkfinger_init_status retval = TF_INIT_UNDEFINED;
 	struct usb_device *usb_dev;
 
-#ifdef USB_DEBUG
-	fprintf (stderr, "USB initialization...\n");
-#endif
-
 	usb_dev = _libthinkfinger_usb_device_find ();
 	if (usb_dev == NULL) {
 #ifdef USB_DEBUG
@@ -443,6 +1214,14 @@ static libthinkfinger_init_status _libthinkfinger_usb_init (libthinkfinger *tf)
 		goto out;
 	}
 
+	if (_libthinkfinger_lease_acquire (tf) < 0) {
+#ifdef USB_DEBUG
+		fprintf (stderr, "USB error (device held by another process).\n");
+#endif
+		retval = TF_INIT_DEVICE_BUSY;
+		goto out;
+	}
+
 	tf->usb_dev_handle = usb_open (usb_dev);
 	if (tf->usb_dev_handle == NULL) {
 #ifdef USB_DEBUG
@@ -457,14 +1236,41 @@ static libthinkfinger_init_status _libthinkfinger_usb_init (libthinkfinger *tf)
 		fprintf (stderr, "USB error (%s).\n", usb_strerror ());
 #endif
 		retval = TF_INIT_USB_CLAIM_FAILED;
+		usb_close (tf->usb_dev_handle);
+		tf->usb_dev_handle = NULL;
 		goto out;
 	}
 
-	if (_libthinkfinger_usb_hello (tf->usb_dev_handle) < 0) {
-#ifdef USB_DEBUG
-		fprintf (stderr, "USB error (sending hello failed).\n");
-#endif
+	tf->max_packet = _libthinkfinger_usb_max_packet (usb_dev);
+	tf->usb_busnum = atoi (usb_dev->bus->dirname);
+	tf->usb_devnum = atoi (usb_dev->filename);
+	tf->initialized = false;
+	retval = TF_INIT_USB_INIT_SUCCESS;
+out:
+	return retval;
+}
+
+static libthinkfinger_init_status _libthinkfinger_usb_init (libthinkfinger *tf)
+{
+	libthinkfinger_init_status retval = TF_INIT_UNDEFINED;
+
+#ifdef USB_DEBUG
+	fprintf (stderr, "USB initialization...\n");
+#endif
+
+	retval = _libthinkfinger_usb_open (tf);
+	if (retval != TF_INIT_USB_INIT_SUCCESS)
+		goto out;
+
+	_libthinkfinger_set_phase (tf, TF_PHASE_HELLO);
+	if (_libthinkfinger_usb_hello (tf) < 0) {
+#ifdef USB_DEBUG
+		fprintf (stderr, "USB error (sending hello failed).\n");
+#endif
 		retval = TF_INIT_USB_HELLO_FAILED;
+		usb_release_interface (tf->usb_dev_handle, 0);
+		usb_close (tf->usb_dev_handle);
+		tf->usb_dev_handle = NULL;
 		goto out;
 	}
 
@@ -524,9 +1330,51 @@ out:
 	return;
 }
 
+/* writes the record of tf->file with the template of tf->finger replaced
+ * by the new one to tf->fd; the new template goes first, followed by those
+ * of the other fingers.  A damaged record is not carried over */
+static int _libthinkfinger_write_bir (libthinkfinger *tf, const u8 *template, unsigned int size)
+{
+	struct bir_template templates[TF_BIR_FINGERS + 1];
+	struct stat st;
+	void *old = MAP_FAILED;
+	int count = 0;
+	int fd;
+	int i;
+	int n = 1;
+	int retval;
+
+	fd = open (tf->file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd >= 0) {
+		if (fstat (fd, &st) == 0 && st.st_size > 0 && st.st_size <= BIR_SIZE_MAX)
+			old = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close (fd);
+	}
+	if (old != MAP_FAILED) {
+		count = bir_read (old, st.st_size, templates + 1);
+		if (count < 0)
+			fprintf (stderr, "Warning: \"%s\" is corrupt, its templates are dropped.\n", tf->file);
+	}
+
+	templates[0].finger = tf->finger;
+	templates[0].data = template;
+	templates[0].size = size;
+	for (i = 1; i <= count && n < TF_BIR_FINGERS; i++) {
+		if (templates[i].finger != tf->finger)
+			templates[n++] = templates[i];
+	}
+	retval = bir_write (tf->fd, templates, n);
+
+	if (old != MAP_FAILED)
+		munmap (old, st.st_size);
+	return retval;
+}
+
+/* writes the record with the template in the enrollment reply to tf->fd
+ * in one go and syncs it, data holds the first packet of the reply */
 static int _libthinkfinger_store_fingerprint (libthinkfinger *tf, unsigned char *data)
 {
-	char inbuf[1024];
+	u8 template[0x40 - 18 + 4096];
 	int retval = -1;
 	int usb_retval;
 	int len;
@@ -536,16 +1384,17 @@ static int _libthinkfinger_store_fingerprint (libthinkfinger *tf, unsigned char
 		goto out;
 	}
 
-	if (write (tf->fd, data+18, 0x40-18) < 0) {
-		fprintf (stderr, "Error: %s.\n", strerror (errno));
-		goto out;
-	}
-
 	len = ((data[5] & 0x0f) << 8) + data[6] - 0x37;
-	usb_retval = _libthinkfinger_usb_read (tf, inbuf, len);
+	memcpy (template, data+18, 0x40-18);
+	usb_retval = _libthinkfinger_usb_read_rest (tf, (char *) template + 0x40-18, len);
 	if (usb_retval != len)
 		fprintf (stderr, "Warning: Expected 0x%x bytes but read 0x%x).\n", len, usb_retval);
-	if (write (tf->fd, inbuf, usb_retval) < 0)
+
+	if (usb_retval < 0)
+		fprintf (stderr, "Error: %s.\n", strerror (-usb_retval));
+	else if (_libthinkfinger_write_bir (tf, template, 0x40-18 + usb_retval) < 0)
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+	else if (fsync (tf->fd) < 0)
 		fprintf (stderr, "Error: %s.\n", strerror (errno));
 	else
 		retval = 0;
@@ -556,6 +1405,56 @@ out:
 	return retval;
 }
 
+/* ends the verification, unless it is continuous and the reader is to be
+ * re-armed for the next swipe */
+static void _libthinkfinger_verify_failed (libthinkfinger *tf)
+{
+	tf->state = TF_STATE_VERIFY_FAILED;
+	if (tf->continuous == true && termination_request != 0x00) {
+		tf->rearm = true;
+		tf->stats.verify_rearms++;
+	} else {
+		/* the miss crossed the interruption of a continuous
+		 * verification, it is not what ended it */
+		if (tf->continuous == true)
+			tf->state = TF_STATE_SIGINT;
+		_libthinkfinger_task_stop (tf);
+	}
+}
+
+/* queues a state change for the consumer, never blocks */
+static void _libthinkfinger_event_push (libthinkfinger *tf, libthinkfinger_state state)
+{
+	struct event_queue *queue = &tf->events;
+	unsigned int tail = queue->tail;
+
+	if (state == queue->last) {
+		tf->stats.events_coalesced++;
+		goto out;
+	}
+	if (tail - __atomic_load_n (&queue->head, __ATOMIC_ACQUIRE) == EVENT_QUEUE_LEN) {
+		tf->stats.events_dropped++;
+		goto out;
+	}
+
+	queue->state[tail % EVENT_QUEUE_LEN] = state;
+	__atomic_store_n (&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	queue->last = state;
+
+	if (queue->fd >= 0 && eventfd_write (queue->fd, 1) < 0 && errno != EAGAIN)
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+out:
+	return;
+}
+
+static void _libthinkfinger_notify (libthinkfinger *tf, libthinkfinger_state state)
+{
+	if (tf->flags & TF_FLAG_CALLBACK_QUEUE)
+		_libthinkfinger_event_push (tf, state);
+	else
+		tf->cb (state, tf->cb_data);
+}
+
 /* returns 1 if it understood the packet */
 static int _libthinkfinger_parse (libthinkfinger *tf, unsigned char *inbuf)
 {
@@ -592,19 +1491,21 @@ static int _libthinkfinger_parse (libthinkfinger *tf, unsigned char *inbuf)
 					_libthinkfinger_task_stop (tf);
 					break;
 				case 0x0b:
-					tf->state = TF_STATE_VERIFY_FAILED;
-					_libthinkfinger_task_stop (tf);
+					_libthinkfinger_verify_failed (tf);
 					break;
 				case 0x13:
 					switch (inbuf[14]) {
 						case 0x00:
-							tf->state = TF_STATE_VERIFY_FAILED;
+							_libthinkfinger_verify_failed (tf);
 							break;
 						case 0x01:
 							tf->state = TF_STATE_VERIFY_SUCCESS;
+							_libthinkfinger_task_stop (tf);
+							break;
+						default:
+							_libthinkfinger_task_stop (tf);
 							break;
 					}
-					_libthinkfinger_task_stop (tf);
 					break;
 				case 0x14:
 					_libthinkfinger_parse_scan_reply (tf, inbuf);
@@ -623,14 +1524,107 @@ static int _libthinkfinger_parse (libthinkfinger *tf, unsigned char *inbuf)
 			retval = 0;
 	}
 
-	if (tf->state != state && tf->cb != NULL)
-		tf->cb (tf->state, tf->cb_data);
+	if (tf->state != state) {
+		_libthinkfinger_publish (tf);
+		if (tf->cb != NULL)
+			_libthinkfinger_notify (tf, tf->state);
+	}
 out:
 	return retval;
 }
 
 #define SILENT 1
 #define PARSE 2
+#define UPLOAD 4
+
+/* sets the sequence and termination byte of a scan request, its CRC is
+ * looked up instead of computed */
+static void _libthinkfinger_scan_frame (char *frame, unsigned char sequence, unsigned char termination)
+{
+	u16 crc = scan_sequence_crc[termination & 0x01][sequence];
+
+	frame[5] = sequence;
+	frame[14] = termination;
+	frame[15] = crc & 0xff;
+	frame[16] = crc >> 8;
+}
+
+/* writes the upload frame: ctrldata holds its header, the template mapped at
+ * tf->template and the CRC follow.  Runs of whole packets are written
+ * straight from the mapping, only the packets around the header and the CRC
+ * are assembled.  Returns the frame size or the error of the failed write. */
+static int _libthinkfinger_upload (libthinkfinger *tf, char *ctrldata, int header_size)
+{
+	struct {
+		const char *data;
+		int size;
+	} part[3];
+	char packet[UPLOAD_PACKET_MAX];
+	char crc_bytes[2];
+	int fill = 0;
+	int usb_retval = 0;
+	int retval;
+	int size;
+	int i;
+	u16 crc;
+
+	part[0].data = ctrldata;
+	part[0].size = header_size;
+	part[1].data = tf->template;
+	part[1].size = tf->template_size;
+	part[2].data = crc_bytes;
+	part[2].size = sizeof (crc_bytes);
+
+	crc = udf_crc ((u8 *) ctrldata+4, header_size-4, 0);
+	for (i = 0; i < 3; i++) {
+		const char *data = part[i].data;
+		int left = part[i].size;
+
+		/* the CRC is carried over the template and sent behind it */
+		if (i == 1) {
+			crc = udf_crc ((u8 *) data, left, crc);
+		} else if (i == 2) {
+			crc_bytes[0] = crc & 0xff;
+			crc_bytes[1] = crc >> 8;
+		}
+
+		while (left > 0) {
+			if (fill == 0 && left >= tf->max_packet) {
+				size = left - left % tf->max_packet;
+				usb_retval = _libthinkfinger_usb_write (tf, (char *) data, size);
+				if (usb_retval != size)
+					goto out_error;
+			} else {
+				size = tf->max_packet - fill < left ? tf->max_packet - fill : left;
+				memcpy (packet+fill, data, size);
+				fill += size;
+				if (fill == tf->max_packet) {
+					usb_retval = _libthinkfinger_usb_write (tf, packet, fill);
+					if (usb_retval != fill)
+						goto out_error;
+					fill = 0;
+				}
+			}
+			data += size;
+			left -= size;
+		}
+	}
+
+	/* the short packet which ends the transfer */
+	if (fill > 0) {
+		usb_retval = _libthinkfinger_usb_write (tf, packet, fill);
+		if (usb_retval != fill)
+			goto out_error;
+	}
+
+	retval = header_size + tf->template_size + sizeof (crc_bytes);
+	goto out;
+
+out_error:
+	retval = usb_retval < 0 ? usb_retval : -EIO;
+out:
+	return retval;
+}
 
 static void _libthinkfinger_ask_scanner_raw (libthinkfinger *tf, int flags, char *ctrldata, int read_size, int write_size)
 {
@@ -650,6 +1644,8 @@ static void _libthinkfinger_ask_scanner_raw (libthinkfinger *tf, int flags, char
 		usb_retval = _libthinkfinger_usb_read (tf, (char *)&inbuf, read_size);
 		if (usb_retval < 0 && usb_retval != -ETIMEDOUT)
 			goto out_usb_error;
+		if (usb_retval == -ETIMEDOUT && _libthinkfinger_deadline_expired (tf))
+			goto out_timeout;
 
 		if (flags & PARSE) {
 			if (_libthinkfinger_parse (tf, inbuf))
@@ -666,29 +1662,48 @@ static void _libthinkfinger_ask_scanner_raw (libthinkfinger *tf, int flags, char
 		}
 	}
 
-	if (termination_request == 0x00) {
-		ctrldata[14] = termination_request;
+	if ((flags & PARSE) && termination_request == 0x00) {
+		_libthinkfinger_scan_frame (ctrldata, ctrldata[5], termination_request);
 		tf->state = TF_STATE_SIGINT;
 	}
 
-	*((short *) (ctrldata+write_size-2)) = udf_crc ((u8*)&(ctrldata[4]), write_size-6, 0);
-	usb_retval = _libthinkfinger_usb_write (tf, (char *)ctrldata, write_size);
-	if (usb_retval < 0 && usb_retval != -ETIMEDOUT)
+	if (flags & UPLOAD) {
+		usb_retval = _libthinkfinger_upload (tf, ctrldata, write_size);
+	} else if (tf->rearm == true && termination_request != 0x00) {
+		/* the failed verdict is answered with the request for the next swipe */
+		tf->rearm = false;
+		usb_retval = _libthinkfinger_usb_write (tf, verify_rearm, sizeof (verify_rearm));
+	} else
+		usb_retval = _libthinkfinger_usb_write (tf, (char *)ctrldata, write_size);
+	/* the frame may have reached the device in part, which only a resync
+	 * with it mends */
+	if (usb_retval == -ETIMEDOUT && _libthinkfinger_deadline_expired (tf))
+		goto out_timeout;
+	else if (usb_retval < 0)
 		goto out_usb_error;
 	else {
 		goto out_result;
 	}
 
+out_timeout:
+	tf->state = TF_STATE_TIMEOUT;
+	goto out_result;
+
 out_usb_error:
 	tf->state = TF_STATE_USB_ERROR;
 
 out_result:
 	switch (tf->state) {
+		case TF_STATE_VERIFY_FAILED:
+			/* a continuous verification waits for the next swipe */
+			if (tf->continuous == true && termination_request != 0x00)
+				break;
+			/* fall through */
 		case TF_STATE_ACQUIRE_SUCCESS:
 		case TF_STATE_ACQUIRE_FAILED:
 		case TF_STATE_VERIFY_SUCCESS:
-		case TF_STATE_VERIFY_FAILED:
 		case TF_STATE_SIGINT:
+		case TF_STATE_TIMEOUT:
 		case TF_STATE_USB_ERROR:
 		case TF_STATE_COMM_FAILED: {
 			_libthinkfinger_task_stop (tf);
@@ -703,14 +1718,59 @@ out:
 	return;
 }
 
-static libthinkfinger_init_status _libthinkfinger_init (libthinkfinger *tf)
+/* reads whatever the device still has to send, returns -1 if it does not stop */
+static int _libthinkfinger_drain (libthinkfinger *tf)
 {
-	libthinkfinger_init_status retval = TF_INIT_UNDEFINED;
-	int i = 0;
+	char buf[DEFAULT_BULK_SIZE];
+	int usb_retval;
+	int i;
 
-	retval = _libthinkfinger_usb_init (tf);
-	if (retval != TF_INIT_USB_INIT_SUCCESS)
-		goto out;
+	for (i = 0; i < DRAIN_MAX; i++) {
+		usb_retval = usb_bulk_read (tf->usb_dev_handle, USB_RD_EP, buf, sizeof (buf), DRAIN_TIMEOUT);
+		if (usb_retval == -ETIMEDOUT)
+			return 0;
+		if (usb_retval < 0)
+			break;
+	}
+
+	return -1;
+}
+
+/* reads one reply frame into buf, returns its size or -1 if it is not a
+ * well-formed reply */
+static int _libthinkfinger_read_frame (libthinkfinger *tf, unsigned char *buf, int size)
+{
+	int usb_retval;
+	int len;
+	int got;
+
+	got = _libthinkfinger_usb_read (tf, (char *) buf, DEFAULT_BULK_SIZE);
+	if (got < 9 || memcmp (buf, "Ciao", 4))
+		return -1;
+
+	len = (((buf[5] & 0x0f) << 8) | buf[6]) + 9;
+	if (len > size)
+		return -1;
+	while (got < len) {
+		usb_retval = _libthinkfinger_usb_read_rest (tf, (char *) buf+got, DEFAULT_BULK_SIZE < len-got ? DEFAULT_BULK_SIZE : len-got);
+		if (usb_retval <= 0)
+			return -1;
+		got += usb_retval;
+	}
+
+	if (udf_crc (buf+4, len-6, 0) != (buf[len-2] | (buf[len-1] << 8)))
+		return -1;
+	/* an acknowledgement, not a complaint */
+	if (buf[7] != 0x28 || buf[6] == 0x07)
+		return -1;
+
+	return len;
+}
+
+/* sends the initialization sequence one frame per round trip */
+static int _libthinkfinger_handshake_lockstep (libthinkfinger *tf)
+{
+	int i = 0;
 
 	_libthinkfinger_task_start (tf, TF_TASK_INIT);
 	do {
@@ -720,152 +1780,1773 @@ static libthinkfinger_init_status _libthinkfinger_init (libthinkfinger *tf)
 	_libthinkfinger_ask_scanner_raw (tf, SILENT, (char *)&init_end, 0x34, sizeof(init_end));
 	_libthinkfinger_task_stop (tf);
 
-	retval = TF_INIT_SUCCESS;
-out:
-	return retval;
+	return (tf->state == TF_STATE_USB_ERROR || tf->state == TF_STATE_TIMEOUT) ? -1 : 0;
 }
 
-static void _libthinkfinger_scan (libthinkfinger *tf) {
-	tf->next_sequence = INITIAL_SEQUENCE;
-	_libthinkfinger_set_sigint (tf);
-	while (_libthinkfinger_task_running (tf)) {
-		scan_sequence[5] = tf->next_sequence;
-		_libthinkfinger_ask_scanner_raw (tf, PARSE, (char *)scan_sequence, DEFAULT_BULK_SIZE, sizeof (scan_sequence));
-	}
+/* sends all init frames back to back and checks the replies afterwards,
+ * returns -1 on anything the lock-step sequence would not have seen */
+static int _libthinkfinger_handshake_pipelined (libthinkfinger *tf)
+{
+	unsigned char inbuf[256];
+	int usb_retval;
+	int i;
 
-	if (termination_request == 0x00) {
-		_libthinkfinger_usb_flush (tf);
-		goto out;
+	/* the reply to HELLO */
+	usb_retval = _libthinkfinger_usb_read (tf, (char *) inbuf, DEFAULT_BULK_SIZE);
+	if (usb_retval < 0 && usb_retval != -ETIMEDOUT)
+		return -1;
+
+	for (i = 0; init[i].data; i++)
+		if (_libthinkfinger_usb_write (tf, init[i].data, init[i].len) != (int) init[i].len)
+			return -1;
+	for (i = 0; init[i].data; i++)
+		if (_libthinkfinger_read_frame (tf, inbuf, sizeof (inbuf)) < 0)
+			return -1;
+
+	if (_libthinkfinger_usb_write (tf, init_end, sizeof (init_end)) != sizeof (init_end))
+		return -1;
+
+	return 0;
+}
+
+/* sends the initialization sequence, returns -1 if the device did not take it */
+static int _libthinkfinger_handshake (libthinkfinger *tf)
+{
+	unsigned long long start;
+	unsigned long long elapsed;
+	int retval = -1;
+
+	/* whatever the reader held is gone */
+	tf->resident = false;
+	_libthinkfinger_set_phase (tf, TF_PHASE_INIT);
+	start = _libthinkfinger_now ();
+
+	/* the first handshake runs in lock-step to measure what pipelining saves */
+	if ((tf->flags & TF_FLAG_PIPELINE) && tf->stats.init_lockstep_us != 0) {
+		if (_libthinkfinger_handshake_pipelined (tf) == 0) {
+			elapsed = _libthinkfinger_now () - start;
+			tf->stats.init_pipelined++;
+			if (elapsed < tf->stats.init_lockstep_us)
+				tf->stats.init_pipeline_saved_us += tf->stats.init_lockstep_us - elapsed;
+			retval = 0;
+			goto out;
+		}
+
+		/* the device did not like it, stay in lock-step from now on */
+		tf->stats.init_pipeline_fallback++;
+		tf->flags &= ~TF_FLAG_PIPELINE;
+		if (_libthinkfinger_drain (tf) < 0)
+			goto out;
+		_libthinkfinger_set_phase (tf, TF_PHASE_HELLO);
+		if (_libthinkfinger_usb_hello (tf) < 0)
+			goto out;
+		_libthinkfinger_set_phase (tf, TF_PHASE_INIT);
+		start = _libthinkfinger_now ();
 	}
 
+	retval = _libthinkfinger_handshake_lockstep (tf);
+	if (retval == 0) {
+		elapsed = _libthinkfinger_now () - start;
+		if (tf->stats.init_lockstep_us == 0)
+			tf->stats.init_lockstep_us = elapsed;
+		else
+			tf->stats.init_lockstep_us = (tf->stats.init_lockstep_us * 7 + elapsed) / 8;
+	}
 out:
-	_libthinkfinger_restore_sigint (tf);
-	return;
+	if (retval == 0)
+		tf->initialized = true;
+	return retval;
 }
 
-static void _libthinkfinger_verify_run (libthinkfinger *tf)
+/* clears both endpoints, drains whatever the device still has to send and
+ * restarts the frame sequence */
+static int _libthinkfinger_resync (libthinkfinger *tf)
 {
-	int header = 13*3-1;
-	int filesize;
+	if (tf->usb_dev_handle == NULL && _libthinkfinger_usb_open (tf) != TF_INIT_USB_INIT_SUCCESS)
+		return -1;
 
-	tf->fd = open (tf->file, O_RDONLY | O_NOFOLLOW);
-	if (tf->fd < 0) {
-		fprintf (stderr, "Error while opening \"%s\": %s.\n", tf->file, strerror (errno));
-		_libthinkfinger_usb_flush (tf);
-		tf->state = TF_STATE_OPEN_FAILED;
-		goto out;
+	if (usb_clear_halt (tf->usb_dev_handle, USB_RD_EP) < 0 ||
+	    usb_clear_halt (tf->usb_dev_handle, USB_WR_EP) < 0)
+		return -1;
+
+	if (_libthinkfinger_drain (tf) < 0)
+		return -1;
+	tf->next_sequence = INITIAL_SEQUENCE;
+
+	_libthinkfinger_set_phase (tf, TF_PHASE_HELLO);
+	return _libthinkfinger_usb_hello (tf);
+}
+
+/* resets the USB port and waits for the device to come back */
+static int _libthinkfinger_reset (libthinkfinger *tf)
+{
+	if (tf->usb_dev_handle == NULL && _libthinkfinger_usb_open (tf) != TF_INIT_USB_INIT_SUCCESS)
+		return -1;
+
+	if (usb_reset (tf->usb_dev_handle) < 0)
+		return -1;
+
+	/* the handle does not survive the reset */
+	usb_close (tf->usb_dev_handle);
+	tf->usb_dev_handle = NULL;
+
+	while (_libthinkfinger_usb_init (tf) != TF_INIT_USB_INIT_SUCCESS) {
+		if (_libthinkfinger_deadline_expired (tf))
+			return -1;
+		usleep (RESET_POLL * 1000);
 	}
 
-	filesize = read (tf->fd, ctrlbuf+header, sizeof(ctrlbuf)-header);
-	*((short *) (ctrlbuf+8)) = filesize + 28;
-	ctrlbuf[5] = (filesize+20511) >> 8;
-	ctrlbuf[6] = (filesize+20511) & 0xff;
-	ctrlbuf[header+filesize] = 0x4f;
-	ctrlbuf[header+filesize+1] = 0x47;
+	return 0;
+}
 
-	_libthinkfinger_task_start (tf, TF_TASK_VERIFY);
-	_libthinkfinger_ask_scanner_raw (tf, SILENT, ctrlbuf, DEFAULT_BULK_SIZE, header+filesize+2);
-	_libthinkfinger_scan (tf);
+static int _libthinkfinger_reinit (libthinkfinger *tf)
+{
+	if (tf->usb_dev_handle != NULL)
+		_libthinkfinger_usb_deinit (tf);
 
-	if (close (tf->fd) == 0)
-		tf->fd = 0;
-out:
-	return;
+	return _libthinkfinger_usb_init (tf) == TF_INIT_USB_INIT_SUCCESS ? 0 : -1;
 }
 
-libthinkfinger_result libthinkfinger_verify (libthinkfinger *tf)
+/* brings the device back into the initialized state using the given tier */
+static int _libthinkfinger_recover (libthinkfinger *tf, libthinkfinger_recovery tier)
 {
-	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+	libthinkfinger_recovery_stats *stats = &tf->stats.recovery[tier];
+	unsigned long long deadline = tf->deadline;
+	unsigned long long start;
+	unsigned long long elapsed;
+	int retval = -1;
 
-	if (tf == NULL) {
-		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
-		goto out;
+#ifdef USB_DEBUG
+	fprintf (stderr, "USB recovery (tier %d)...\n", tier);
+#endif
+
+	start = _libthinkfinger_now ();
+	stats->attempts++;
+
+	/* each tier gets a bounded share of the time left */
+	tf->deadline = start + recovery_budget[tier] * 1000ULL;
+	if (deadline != 0 && deadline < tf->deadline)
+		tf->deadline = deadline;
+
+	switch (tier) {
+		case TF_RECOVERY_RESYNC:
+			retval = _libthinkfinger_resync (tf);
+			break;
+		case TF_RECOVERY_RESET:
+			retval = _libthinkfinger_reset (tf);
+			break;
+		case TF_RECOVERY_REINIT:
+			retval = _libthinkfinger_reinit (tf);
+			break;
+		default:
+			break;
 	}
-	
-	_libthinkfinger_init (tf);
-	_libthinkfinger_verify_run (tf);
-	retval = _libthinkfinger_get_result (tf->state);
-out:
+	if (retval == 0)
+		retval = _libthinkfinger_handshake (tf);
+	if (retval < 0)
+		tf->state = TF_STATE_USB_ERROR;
+
+	tf->deadline = deadline;
+	elapsed = _libthinkfinger_now () - start;
+	stats->time_us += elapsed;
+	if (elapsed > stats->max_us)
+		stats->max_us = elapsed;
+
 	return retval;
 }
 
-static void _libthinkfinger_acquire_run (libthinkfinger *tf)
+static _Bool _libthinkfinger_recoverable (libthinkfinger *tf)
 {
-	tf->fd = open (tf->file, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
-	if (tf->fd < 0) {
-		fprintf (stderr, "Error while opening \"%s\": %s.\n", tf->file, strerror (errno));
-		_libthinkfinger_usb_flush (tf);
-		tf->state = TF_STATE_OPEN_FAILED;
+	return (tf->state == TF_STATE_USB_ERROR || tf->state == TF_STATE_COMM_FAILED) &&
+	       _libthinkfinger_deadline_expired (tf) == false;
+}
+
+static libthinkfinger_init_status _libthinkfinger_init (libthinkfinger *tf)
+{
+	libthinkfinger_init_status retval = TF_INIT_UNDEFINED;
+	int tier;
+
+	_libthinkfinger_prewarm_take (tf);
+
+	/* the device keeps its state for as long as the handle stays open */
+	if (tf->usb_dev_handle != NULL && tf->initialized == true) {
+		tf->init_skipped = true;
+		tf->stats.init_skipped++;
+		retval = TF_INIT_SUCCESS;
 		goto out;
 	}
+	tf->init_skipped = false;
+	tf->stats.init_full++;
 
-	_libthinkfinger_task_start (tf, TF_TASK_ACQUIRE);
-	_libthinkfinger_ask_scanner_raw (tf, SILENT, enroll_init, DEFAULT_BULK_SIZE, sizeof(enroll_init));
-	_libthinkfinger_scan (tf);
+	/* do not leak the handle of a previous session */
+	if (tf->usb_dev_handle != NULL)
+		_libthinkfinger_usb_deinit (tf);
 
-	if (tf->state != TF_STATE_ACQUIRE_SUCCESS) {
-		if (unlink (tf->file) < 0) {
-			fprintf (stderr, "Error while unlinking \"%s\" after failed acquisition: %s.\n", tf->file, strerror (errno));
+	retval = _libthinkfinger_usb_init (tf);
+	if (retval == TF_INIT_USB_INIT_SUCCESS) {
+		if (_libthinkfinger_handshake (tf) == 0) {
+			retval = TF_INIT_SUCCESS;
+			goto out;
 		}
+		retval = TF_INIT_USB_HANDSHAKE_FAILED;
+	} else if (retval != TF_INIT_USB_HELLO_FAILED) {
+		/* there is nothing to recover if the device is not there */
+		goto out;
 	}
 
-	if (close (tf->fd) == 0)
-		tf->fd = 0;
+	for (tier = 0; tier < TF_RECOVERY_COUNT && _libthinkfinger_deadline_expired (tf) == false; tier++) {
+		if (_libthinkfinger_recover (tf, tier) == 0) {
+			tf->stats.recovery[tier].successes++;
+			retval = TF_INIT_SUCCESS;
+			break;
+		}
+	}
 out:
-	return;
+	return retval;
 }
 
-libthinkfinger_result libthinkfinger_acquire (libthinkfinger *tf)
+/* only a task which got to a result leaves the device initialized, and only
+ * a verdict the template on it */
+static void _libthinkfinger_run_end (libthinkfinger *tf)
 {
-	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+	switch (tf->state) {
+		case TF_STATE_VERIFY_SUCCESS:
+		case TF_STATE_VERIFY_FAILED:
+			tf->resident = true;
+			break;
+		case TF_STATE_ACQUIRE_SUCCESS:
+		case TF_STATE_CAPTURE_SUCCESS:
+			tf->resident = false;
+			break;
+		default:
+			tf->initialized = false;
+			tf->resident = false;
+			break;
+	}
+}
 
-	if (tf == NULL) {
-		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
-		goto out;
+/* runs a task, escalating through the recovery tiers for as long as it fails */
+static void _libthinkfinger_run (libthinkfinger *tf, void (*run) (libthinkfinger *tf))
+{
+	int tier;
+
+	run (tf);
+
+	if (tf->init_skipped == true && _libthinkfinger_recoverable (tf)) {
+		/* the device lost its state after all, initialize it the long way */
+		tf->stats.init_fallback++;
+		tf->initialized = false;
+		if (_libthinkfinger_init (tf) == TF_INIT_SUCCESS)
+			run (tf);
 	}
 
-	_libthinkfinger_init (tf);
-	_libthinkfinger_acquire_run (tf);
-	retval = _libthinkfinger_get_result (tf->state);
-out:
-	return retval;
+	for (tier = 0; tier < TF_RECOVERY_COUNT && _libthinkfinger_recoverable (tf); tier++) {
+		if (_libthinkfinger_recover (tf, tier) < 0)
+			continue;
+		run (tf);
+		if (_libthinkfinger_recoverable (tf) == false)
+			tf->stats.recovery[tier].successes++;
+	}
+
+	_libthinkfinger_run_end (tf);
 }
 
-int libthinkfinger_set_file (libthinkfinger *tf, const char *file)
+static int _libthinkfinger_sysfs_read (const char *dir, const char *attr, char *buf, size_t size)
 {
-	int retval = -1;
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
 
-	if (tf == NULL) {
-		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
-		goto out;
-	}
+	len = snprintf (path, sizeof (path), "%s/%s", dir, attr);
+	if (len < 0 || (size_t) len >= sizeof (path))
+		return -1;
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read (fd, buf, size - 1);
+	close (fd);
+	if (len < 0)
+		return -1;
+	while (len > 0 && buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return 0;
+}
 
-	free (tf->file);
-	tf->file = strdup (file);
-	retval = 0;
-out:
-	return retval;
+static int _libthinkfinger_sysfs_write (const char *dir, const char *attr, const char *value)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	len = snprintf (path, sizeof (path), "%s/%s", dir, attr);
+	if (len < 0 || (size_t) len >= sizeof (path))
+		return -1;
+	fd = open (path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = write (fd, value, strlen (value));
+	close (fd);
+
+	return len < 0 ? -1 : 0;
 }
 
-int libthinkfinger_set_callback (libthinkfinger *tf, libthinkfinger_state_cb cb, void *cb_data)
+/* finds the sysfs directory of the reader by its bus and device number */
+static int _libthinkfinger_sysfs_find (libthinkfinger *tf, char *path, size_t size)
 {
+	struct dirent *entry;
+	char value[16];
+	DIR *dir;
+	int len;
 	int retval = -1;
 
-	if (tf == NULL) {
-		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+	dir = opendir (SYSFS_USB);
+	if (dir == NULL)
 		goto out;
+	while (retval < 0 && (entry = readdir (dir)) != NULL) {
+		if (entry->d_name[0] == '.' || strchr (entry->d_name, ':') != NULL)
+			continue;
+		/* a truncated path could name another device */
+		len = snprintf (path, size, "%s/%s", SYSFS_USB, entry->d_name);
+		if (len < 0 || (size_t) len >= size)
+			continue;
+		if (_libthinkfinger_sysfs_read (path, "busnum", value, sizeof (value)) < 0 ||
+		    atoi (value) != tf->usb_busnum)
+			continue;
+		if (_libthinkfinger_sysfs_read (path, "devnum", value, sizeof (value)) < 0 ||
+		    atoi (value) != tf->usb_devnum)
+			continue;
+		retval = 0;
 	}
-
-	tf->cb = cb;
-	tf->cb_data = cb_data;
-	retval = 0;
+	closedir (dir);
 out:
 	return retval;
 }
 
-libthinkfinger *libthinkfinger_new (libthinkfinger_init_status *init_status)
+/* lets the kernel suspend the reader while no poll is in flight, returns 0
+ * if the settings have to be restored */
+static int _libthinkfinger_autosuspend_enable (libthinkfinger *tf, struct runtime_pm *pm)
+{
+	char delay[16];
+
+	if (_libthinkfinger_sysfs_find (tf, pm->path, sizeof (pm->path)) < 0 ||
+	    _libthinkfinger_sysfs_read (pm->path, "power/control", pm->control, sizeof (pm->control)) < 0 ||
+	    _libthinkfinger_sysfs_read (pm->path, "power/autosuspend_delay_ms", pm->delay, sizeof (pm->delay)) < 0)
+		return -1;
+
+	snprintf (delay, sizeof (delay), "%u", tf->power.autosuspend_delay);
+	if (_libthinkfinger_sysfs_write (pm->path, "power/autosuspend_delay_ms", delay) < 0)
+		return -1;
+	if (_libthinkfinger_sysfs_write (pm->path, "power/control", "auto") < 0) {
+		_libthinkfinger_sysfs_write (pm->path, "power/autosuspend_delay_ms", pm->delay);
+		return -1;
+	}
+	tf->stats.autosuspend_waits++;
+
+	return 0;
+}
+
+static void _libthinkfinger_autosuspend_restore (struct runtime_pm *pm)
+{
+	_libthinkfinger_sysfs_write (pm->path, "power/control", pm->control);
+	_libthinkfinger_sysfs_write (pm->path, "power/autosuspend_delay_ms", pm->delay);
+}
+
+/* waits for the next poll, until the wake latency passed or the task is cancelled */
+static void _libthinkfinger_scan_sleep (libthinkfinger *tf)
+{
+	unsigned int wakeup = __atomic_load_n (&tf->scan_wakeup, __ATOMIC_SEQ_CST);
+	unsigned long long wait = tf->power.wake_latency * 1000ULL;
+	unsigned long long now;
+	struct timespec timeout;
+
+	if (termination_request == 0x00 || _libthinkfinger_cancelled (tf))
+		return;
+	if (tf->deadline != 0) {
+		now = _libthinkfinger_now ();
+		if (now >= tf->deadline)
+			return;
+		if (tf->deadline - now < wait)
+			wait = tf->deadline - now;
+	}
+
+	timeout.tv_sec = wait / 1000000;
+	timeout.tv_nsec = wait % 1000000 * 1000;
+	syscall (SYS_futex, &tf->scan_wakeup, FUTEX_WAIT_PRIVATE, wakeup, &timeout, NULL, 0);
+}
+
+static void _libthinkfinger_scan (libthinkfinger *tf) {
+	libthinkfinger_state state;
+	struct runtime_pm pm;
+	unsigned long long start;
+	_Bool autosuspend = false;
+
+	tf->next_sequence = INITIAL_SEQUENCE;
+	_libthinkfinger_set_phase (tf, TF_PHASE_POLL);
+	_libthinkfinger_set_sigint (tf);
+	if (tf->power.wake_latency > 0 && tf->power.autosuspend_delay > 0)
+		autosuspend = _libthinkfinger_autosuspend_enable (tf, &pm) == 0;
+
+	start = _libthinkfinger_now ();
+	while (_libthinkfinger_task_running (tf)) {
+		/* a cancelled task ends like one interrupted by SIGINT */
+		if (_libthinkfinger_cancelled (tf))
+			termination_request = 0x00;
+		state = tf->state;
+		_libthinkfinger_scan_frame (tf->scan, tf->next_sequence, termination_request);
+		_libthinkfinger_ask_scanner_raw (tf, PARSE, tf->scan, DEFAULT_BULK_SIZE, sizeof (tf->scan));
+		tf->stats.poll_wakeups++;
+		/* nothing happened, give the reader and the host a rest */
+		if (tf->power.wake_latency > 0 && tf->state == state && _libthinkfinger_task_running (tf))
+			_libthinkfinger_scan_sleep (tf);
+	}
+	tf->stats.poll_time_us += _libthinkfinger_now () - start;
+
+	if (autosuspend == true)
+		_libthinkfinger_autosuspend_restore (&pm);
+
+	if (termination_request == 0x00) {
+		_libthinkfinger_usb_flush (tf);
+		/* the request has been served, do not cancel the next task */
+		termination_request = 0x01;
+		goto out;
+	}
+
+out:
+	_libthinkfinger_restore_sigint (tf);
+	return;
+}
+
+static void _libthinkfinger_unload_template (libthinkfinger *tf)
+{
+	if (tf->bir != NULL)
+		munmap ((void *) tf->bir, tf->bir_size);
+	tf->bir = NULL;
+	tf->bir_size = 0;
+	tf->template = NULL;
+	tf->template_size = 0;
+}
+
+/* maps tf->file, picks the template of tf->finger and fills in the lengths
+ * of the upload header.  It runs before the reader is touched, so a record
+ * which is missing or damaged fails the task without a word to the reader */
+static int _libthinkfinger_load_template (libthinkfinger *tf)
+{
+	struct bir_template templates[TF_BIR_FINGERS];
+	struct stat st;
+	void *bir;
+	int count;
+	int fd;
+	int i;
+	int size;
+	int retval = -1;
+
+	fd = open (tf->file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf (stderr, "Error while opening \"%s\": %s.\n", tf->file, strerror (errno));
+		tf->state = TF_STATE_OPEN_FAILED;
+		goto out;
+	}
+	if (fstat (fd, &st) < 0) {
+		fprintf (stderr, "Error while reading \"%s\": %s.\n", tf->file, strerror (errno));
+		tf->state = TF_STATE_OPEN_FAILED;
+		goto out_close;
+	}
+	if (st.st_size <= 0 || st.st_size > BIR_SIZE_MAX) {
+		fprintf (stderr, "Error: \"%s\" is not a record (%lld bytes).\n",
+			 tf->file, (long long) st.st_size);
+		tf->state = TF_STATE_BIR_CORRUPT;
+		goto out_close;
+	}
+
+	bir = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (bir == MAP_FAILED) {
+		fprintf (stderr, "Error while mapping \"%s\": %s.\n", tf->file, strerror (errno));
+		tf->state = TF_STATE_OPEN_FAILED;
+		goto out_close;
+	}
+	tf->bir = bir;
+	tf->bir_size = st.st_size;
+
+	count = bir_read (tf->bir, tf->bir_size, templates);
+	if (count < 0) {
+		fprintf (stderr, "Error: \"%s\" is corrupt.\n", tf->file);
+		tf->state = TF_STATE_BIR_CORRUPT;
+		goto out_unload;
+	}
+	for (i = 0; i < count; i++) {
+		if (tf->finger == 0 || templates[i].finger == tf->finger)
+			break;
+	}
+	if (i == count) {
+		fprintf (stderr, "Error: \"%s\" holds no template of finger %u.\n", tf->file, tf->finger);
+		tf->state = TF_STATE_OPEN_FAILED;
+		goto out_unload;
+	}
+	if (templates[i].size > UPLOAD_TEMPLATE_MAX) {
+		fprintf (stderr, "Error: \"%s\" is not a template (%u bytes).\n", tf->file, templates[i].size);
+		tf->state = TF_STATE_BIR_CORRUPT;
+		goto out_unload;
+	}
+	tf->template = (const char *) templates[i].data;
+	tf->template_size = templates[i].size;
+
+	size = sizeof (upload_header) + tf->template_size + 2;
+	tf->upload[5] = (upload_header[5] & 0xf0) | (((size - 9) >> 8) & 0x0f);
+	tf->upload[6] = (size - 9) & 0xff;
+	tf->upload[8] = (size - 12) & 0xff;
+	tf->upload[9] = (size - 12) >> 8;
+
+	retval = 0;
+	goto out_close;
+out_unload:
+	_libthinkfinger_unload_template (tf);
+out_close:
+	close (fd);
+out:
+	return retval;
+}
+
+/* the reader may be asked to verify against the template the last
+ * verification left on it, see TF_FLAG_REARM */
+static _Bool _libthinkfinger_rearm_possible (libthinkfinger *tf)
+{
+	return (tf->flags & TF_FLAG_REARM) && tf->resident == true;
+}
+
+/* keeps a copy of the template about to be uploaded; without memory for it
+ * the next verification simply uploads again */
+static void _libthinkfinger_remember_template (libthinkfinger *tf)
+{
+	char *copy;
+
+	copy = realloc (tf->resident_template, tf->template_size);
+	if (copy == NULL) {
+		tf->resident_size = 0;
+		goto out;
+	}
+	memcpy (copy, tf->template, tf->template_size);
+	tf->resident_template = copy;
+	tf->resident_size = tf->template_size;
+	tf->resident_crc = udf_crc ((u8 *) tf->template, tf->template_size, 0);
+out:
+	return;
+}
+
+/* tells whether the reader still holds the template just loaded: the last
+ * verification on this handle left one on it and nothing has initialized
+ * the reader since.  The CRC is only the quick test, the bytes are compared
+ * as well so that a template is never taken for another one */
+static _Bool _libthinkfinger_template_resident (libthinkfinger *tf)
+{
+	_Bool retval = false;
+
+	if (_libthinkfinger_rearm_possible (tf) == false || tf->resident_size != tf->template_size)
+		goto out;
+	if (udf_crc ((u8 *) tf->template, tf->template_size, 0) != tf->resident_crc)
+		goto out;
+	retval = memcmp (tf->resident_template, tf->template, tf->template_size) == 0;
+out:
+	return retval;
+}
+
+/* uploads the template _libthinkfinger_verify_task loaded and scans; a
+ * retry which finds the template lost only loads it now */
+static void _libthinkfinger_verify_run (libthinkfinger *tf)
+{
+	if (tf->template == NULL && _libthinkfinger_load_template (tf) < 0) {
+		_libthinkfinger_usb_flush (tf);
+		goto out;
+	}
+
+	_libthinkfinger_set_phase (tf, TF_PHASE_UPLOAD);
+	_libthinkfinger_task_start (tf, TF_TASK_VERIFY);
+	if (_libthinkfinger_template_resident (tf) == true) {
+		/* a reader which lost it refuses the re-arm, the recovery
+		 * initializes it and the next run uploads */
+		tf->stats.uploads_skipped++;
+		_libthinkfinger_ask_scanner_raw (tf, SILENT, verify_rearm, DEFAULT_BULK_SIZE, sizeof (verify_rearm));
+	} else {
+		if (tf->flags & TF_FLAG_REARM)
+			_libthinkfinger_remember_template (tf);
+		_libthinkfinger_ask_scanner_raw (tf, SILENT | UPLOAD, tf->upload, DEFAULT_BULK_SIZE, sizeof (tf->upload));
+	}
+	_libthinkfinger_scan (tf);
+out:
+	return;
+}
+
+/* verifies the next swipe against the template the reader still holds,
+ * only the scan is started again; if it lost the template in the meantime,
+ * e.g. because it had to be initialized again, or the caller did not opt
+ * in to the re-arm, it is uploaded again */
+static void _libthinkfinger_retry_run (libthinkfinger *tf)
+{
+	if (_libthinkfinger_rearm_possible (tf) == false) {
+		_libthinkfinger_verify_run (tf);
+		goto out;
+	}
+
+	tf->stats.verify_retries++;
+	_libthinkfinger_set_phase (tf, TF_PHASE_UPLOAD);
+	_libthinkfinger_task_start (tf, TF_TASK_VERIFY);
+	_libthinkfinger_ask_scanner_raw (tf, SILENT, verify_rearm, DEFAULT_BULK_SIZE, sizeof (verify_rearm));
+	_libthinkfinger_scan (tf);
+out:
+	return;
+}
+
+static libthinkfinger_result _libthinkfinger_verify_task (libthinkfinger *tf, void (*run) (libthinkfinger *tf))
+{
+	libthinkfinger_init_status init_status;
+	libthinkfinger_result retval;
+
+	_libthinkfinger_enter (tf);
+	if (_libthinkfinger_cancelled (tf)) {
+		tf->state = TF_STATE_SIGINT;
+		goto out;
+	}
+
+	/* a retry does not need the record as long as the reader holds the
+	 * template */
+	if ((run != _libthinkfinger_retry_run || _libthinkfinger_rearm_possible (tf) == false) &&
+	    _libthinkfinger_load_template (tf) < 0)
+		goto out;
+
+	init_status = _libthinkfinger_init (tf);
+	/* a failed wait for the reader left the state, busy or interrupted */
+	if (init_status == TF_INIT_DEVICE_BUSY)
+		;
+	else if (init_status != TF_INIT_SUCCESS)
+		tf->state = TF_STATE_USB_ERROR;
+	else
+		_libthinkfinger_run (tf, run);
+	if ((tf->state == TF_STATE_USB_ERROR || tf->state == TF_STATE_DEVICE_BUSY) &&
+	    _libthinkfinger_deadline_expired (tf))
+		tf->state = TF_STATE_TIMEOUT;
+	_libthinkfinger_unload_template (tf);
+	_libthinkfinger_lease_yield (tf);
+out:
+	_libthinkfinger_publish (tf);
+	retval = _libthinkfinger_get_result (tf->state);
+	_libthinkfinger_leave (tf);
+
+	return retval;
+}
+
+libthinkfinger_result libthinkfinger_verify (libthinkfinger *tf)
+{
+	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	retval = _libthinkfinger_verify_task (tf, _libthinkfinger_verify_run);
+out:
+	return retval;
+}
+
+libthinkfinger_result libthinkfinger_verify_retry (libthinkfinger *tf)
+{
+	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	retval = _libthinkfinger_verify_task (tf, _libthinkfinger_retry_run);
+out:
+	return retval;
+}
+
+libthinkfinger_result libthinkfinger_verify_deadline (libthinkfinger *tf, unsigned int deadline)
+{
+	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	_libthinkfinger_enter (tf);
+	if (deadline > 0)
+		tf->deadline = _libthinkfinger_now () + (unsigned long long) deadline * 1000;
+	retval = libthinkfinger_verify (tf);
+	tf->deadline = 0;
+	_libthinkfinger_leave (tf);
+out:
+	return retval;
+}
+
+libthinkfinger_result libthinkfinger_verify_continuous (libthinkfinger *tf)
+{
+	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	_libthinkfinger_enter (tf);
+	if ((tf->flags & TF_FLAG_REARM) == 0) {
+		/* every swipe is a verification of its own, the template is
+		 * uploaded again */
+		do
+			retval = libthinkfinger_verify (tf);
+		while (retval == TF_RESULT_VERIFY_FAILED);
+		goto out_leave;
+	}
+
+	tf->continuous = true;
+	retval = libthinkfinger_verify (tf);
+	tf->continuous = false;
+	tf->rearm = false;
+out_leave:
+	_libthinkfinger_leave (tf);
+out:
+	return retval;
+}
+
+/* the template is written to a new file next to tf->file, which replaces
+ * it only once the enrollment succeeded */
+static void _libthinkfinger_acquire_run (libthinkfinger *tf)
+{
+	char *tmp;
+
+	tmp = malloc (strlen (tf->file) + sizeof (".XXXXXX"));
+	if (tmp == NULL) {
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+		_libthinkfinger_usb_flush (tf);
+		tf->state = TF_STATE_OPEN_FAILED;
+		goto out;
+	}
+	sprintf (tmp, "%s.XXXXXX", tf->file);
+
+	tf->fd = mkstemp (tmp);
+	if (tf->fd < 0) {
+		fprintf (stderr, "Error while creating \"%s\": %s.\n", tmp, strerror (errno));
+		_libthinkfinger_usb_flush (tf);
+		tf->state = TF_STATE_OPEN_FAILED;
+		goto out_free;
+	}
+
+	_libthinkfinger_set_phase (tf, TF_PHASE_UPLOAD);
+	_libthinkfinger_task_start (tf, TF_TASK_ACQUIRE);
+	_libthinkfinger_ask_scanner_raw (tf, SILENT, enroll_init, DEFAULT_BULK_SIZE, sizeof(enroll_init));
+	_libthinkfinger_scan (tf);
+
+	if (tf->state == TF_STATE_ACQUIRE_SUCCESS && rename (tmp, tf->file) < 0) {
+		fprintf (stderr, "Error while renaming \"%s\" to \"%s\": %s.\n", tmp, tf->file, strerror (errno));
+		tf->state = TF_STATE_ACQUIRE_FAILED;
+	}
+	if (tf->state != TF_STATE_ACQUIRE_SUCCESS) {
+		if (unlink (tmp) < 0) {
+			fprintf (stderr, "Error while unlinking \"%s\" after failed acquisition: %s.\n", tmp, strerror (errno));
+		}
+	}
+
+	close (tf->fd);
+	tf->fd = -1;
+out_free:
+	free (tmp);
+out:
+	return;
+}
+
+libthinkfinger_result libthinkfinger_acquire (libthinkfinger *tf)
+{
+	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+	libthinkfinger_init_status init_status;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	_libthinkfinger_enter (tf);
+	if (_libthinkfinger_cancelled (tf)) {
+		tf->state = TF_STATE_SIGINT;
+		goto out_leave;
+	}
+	init_status = _libthinkfinger_init (tf);
+	/* a failed wait for the reader left the state, busy or interrupted */
+	if (init_status == TF_INIT_DEVICE_BUSY)
+		;
+	else if (init_status != TF_INIT_SUCCESS)
+		tf->state = TF_STATE_USB_ERROR;
+	else
+		_libthinkfinger_run (tf, _libthinkfinger_acquire_run);
+	_libthinkfinger_lease_yield (tf);
+out_leave:
+	_libthinkfinger_publish (tf);
+	retval = _libthinkfinger_get_result (tf->state);
+	_libthinkfinger_leave (tf);
+out:
+	return retval;
+}
+
+/* reads one frame of the capture into buf, returns its size, -ETIMEDOUT
+ * if none came or -1 if it is broken */
+static int _libthinkfinger_capture_read (libthinkfinger *tf, unsigned char *buf)
+{
+	int usb_retval;
+	int len;
+
+	usb_retval = _libthinkfinger_usb_read (tf, (char *) buf, DEFAULT_BULK_SIZE);
+	if (usb_retval == -ETIMEDOUT)
+		return usb_retval;
+	if (usb_retval < 9 || memcmp (buf, "Ciao", 4))
+		return -1;
+
+	len = (((buf[5] & 0x0f) << 8) | buf[6]) + 9;
+	if (len > STRIP_FRAME)
+		return -1;
+	if (len > DEFAULT_BULK_SIZE) {
+		/* the rest of a strip comes in one transfer, straight into the slot */
+		usb_retval = _libthinkfinger_usb_read_rest (tf, (char *) buf+DEFAULT_BULK_SIZE, len-DEFAULT_BULK_SIZE);
+		if (usb_retval != len-DEFAULT_BULK_SIZE)
+			return -1;
+	}
+	if (udf_crc (buf+4, len-6, 0) != (buf[len-2] | (buf[len-1] << 8)))
+		return -1;
+
+	return len;
+}
+
+/* waits until the slot at tail is released, returns -1 if the capture is
+ * to be given up meanwhile */
+static int _libthinkfinger_capture_slot (libthinkfinger *tf)
+{
+	struct capture_ring *ring = &tf->capture;
+	struct timespec timeout = { 0, CAPTURE_POLL * 1000000L };
+	unsigned int freed;
+
+	freed = __atomic_load_n (&ring->freed, __ATOMIC_ACQUIRE);
+	if (ring->tail - freed < CAPTURE_RING_LEN)
+		return 0;
+
+	tf->stats.capture_stalls++;
+	__atomic_store_n (&ring->stalled, 1, __ATOMIC_SEQ_CST);
+	while (ring->tail - (freed = __atomic_load_n (&ring->freed, __ATOMIC_SEQ_CST)) >= CAPTURE_RING_LEN) {
+		if (termination_request == 0x00 || _libthinkfinger_cancelled (tf) ||
+		    _libthinkfinger_deadline_expired (tf))
+			break;
+		syscall (SYS_futex, &ring->freed, FUTEX_WAIT_PRIVATE, freed, &timeout, NULL, 0);
+	}
+	__atomic_store_n (&ring->stalled, 0, __ATOMIC_SEQ_CST);
+
+	return ring->tail - freed < CAPTURE_RING_LEN ? 0 : -1;
+}
+
+static void _libthinkfinger_capture_event (libthinkfinger *tf)
+{
+	struct capture_ring *ring = &tf->capture;
+
+	__atomic_add_fetch (&ring->events, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&ring->waiters, __ATOMIC_SEQ_CST) > 0)
+		syscall (SYS_futex, &ring->events, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* the reader answers the request with an acknowledgement and then sends
+ * the strips of the swipe, each in a frame of its own, and an empty frame
+ * once the finger is gone */
+static void _libthinkfinger_capture_run (libthinkfinger *tf)
+{
+	struct capture_ring *ring = &tf->capture;
+	unsigned long sequence = 0;
+	unsigned char *slot;
+	int len;
+
+	_libthinkfinger_set_phase (tf, TF_PHASE_UPLOAD);
+	_libthinkfinger_task_start (tf, TF_TASK_CAPTURE);
+	_libthinkfinger_ask_scanner_raw (tf, SILENT, capture_init, DEFAULT_BULK_SIZE, sizeof (capture_init));
+	if (_libthinkfinger_task_running (tf) == false)
+		goto out;
+
+	_libthinkfinger_set_phase (tf, TF_PHASE_POLL);
+	_libthinkfinger_set_sigint (tf);
+	while (_libthinkfinger_task_running (tf)) {
+		if (termination_request == 0x00 || _libthinkfinger_cancelled (tf)) {
+			tf->state = TF_STATE_SIGINT;
+			break;
+		}
+		if (_libthinkfinger_capture_slot (tf) < 0) {
+			tf->state = termination_request == 0x00 || _libthinkfinger_cancelled (tf) ?
+				    TF_STATE_SIGINT : TF_STATE_TIMEOUT;
+			break;
+		}
+
+		slot = ring->slots + (ring->tail % CAPTURE_RING_LEN) * STRIP_SLOT;
+		len = _libthinkfinger_capture_read (tf, slot);
+		if (len == -ETIMEDOUT) {
+			if (_libthinkfinger_deadline_expired (tf)) {
+				tf->state = TF_STATE_TIMEOUT;
+				break;
+			}
+			continue;
+		}
+		if (len < 0) {
+			tf->state = TF_STATE_USB_ERROR;
+			break;
+		}
+
+		if (slot[4] != 0x0a) {
+			/* an acknowledgement or a complaint */
+			_libthinkfinger_parse (tf, slot);
+			continue;
+		}
+		if (len == 9) {
+			tf->state = TF_STATE_CAPTURE_SUCCESS;
+			break;
+		}
+		if (len != STRIP_FRAME) {
+			tf->state = TF_STATE_CAPTURE_FAILED;
+			break;
+		}
+
+		ring->time_us[ring->tail % CAPTURE_RING_LEN] = _libthinkfinger_now ();
+		ring->sequence[ring->tail % CAPTURE_RING_LEN] = sequence++;
+		__atomic_store_n (&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+		tf->stats.strips_captured++;
+		_libthinkfinger_capture_event (tf);
+	}
+	_libthinkfinger_restore_sigint (tf);
+
+	if (termination_request == 0x00) {
+		_libthinkfinger_usb_flush (tf);
+		termination_request = 0x01;
+	}
+	/* the states the reader replied with have been reported by the parser */
+	if (_libthinkfinger_task_running (tf)) {
+		_libthinkfinger_task_stop (tf);
+		if (tf->cb != NULL)
+			_libthinkfinger_notify (tf, tf->state);
+	}
+out:
+	return;
+}
+
+libthinkfinger_result libthinkfinger_capture (libthinkfinger *tf)
+{
+	libthinkfinger_result retval = TF_RESULT_UNDEFINED;
+	libthinkfinger_init_status init_status;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+	if (tf->capture.slots == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not created with TF_FLAG_CAPTURE.\n");
+		goto out;
+	}
+
+	_libthinkfinger_enter (tf);
+	__atomic_store_n (&tf->capture.ended, false, __ATOMIC_RELEASE);
+	if (_libthinkfinger_cancelled (tf)) {
+		tf->state = TF_STATE_SIGINT;
+		goto out_leave;
+	}
+	init_status = _libthinkfinger_init (tf);
+	/* a failed wait for the reader left the state, busy or interrupted */
+	if (init_status == TF_INIT_DEVICE_BUSY)
+		;
+	else if (init_status != TF_INIT_SUCCESS)
+		tf->state = TF_STATE_USB_ERROR;
+	else {
+		/* the image mode is not known to work, a reader which refuses it
+		 * would refuse it again after every tier of recovery */
+		_libthinkfinger_capture_run (tf);
+		_libthinkfinger_run_end (tf);
+	}
+	_libthinkfinger_lease_yield (tf);
+out_leave:
+	_libthinkfinger_publish (tf);
+
+	__atomic_store_n (&tf->capture.ended, true, __ATOMIC_RELEASE);
+	_libthinkfinger_capture_event (tf);
+	retval = _libthinkfinger_get_result (tf->state);
+	_libthinkfinger_leave (tf);
+out:
+	return retval;
+}
+
+int libthinkfinger_strip_next (libthinkfinger *tf, libthinkfinger_strip *strip, unsigned int timeout)
+{
+	struct capture_ring *ring;
+	unsigned long long end = 0;
+	unsigned long long now;
+	struct timespec wait;
+	unsigned int events;
+	unsigned int slot;
+	int retval = -1;
+
+	if (tf == NULL || strip == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+	ring = &tf->capture;
+	if (ring->slots == NULL)
+		goto out;
+
+	if (timeout > 0)
+		end = _libthinkfinger_now () + (unsigned long long) timeout * 1000;
+	for (;;) {
+		events = __atomic_load_n (&ring->events, __ATOMIC_SEQ_CST);
+		if (ring->head != __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE)) {
+			slot = ring->head % CAPTURE_RING_LEN;
+			strip->pixels = ring->slots + slot * STRIP_SLOT + 7;
+			strip->time_us = ring->time_us[slot];
+			strip->sequence = ring->sequence[slot];
+			strip->slot = slot;
+			ring->head++;
+			retval = 0;
+			break;
+		}
+		retval = 1;
+		if (__atomic_load_n (&ring->ended, __ATOMIC_ACQUIRE)) {
+			/* the last strip may have come after the look at tail */
+			if (ring->head != __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE))
+				continue;
+			/* the end is reported once, the next call waits for the next capture */
+			__atomic_store_n (&ring->ended, false, __ATOMIC_RELEASE);
+			break;
+		}
+
+		if (end != 0) {
+			now = _libthinkfinger_now ();
+			if (now >= end)
+				break;
+			wait.tv_sec = (end - now) / 1000000;
+			wait.tv_nsec = (end - now) % 1000000 * 1000;
+		}
+		__atomic_add_fetch (&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		syscall (SYS_futex, &ring->events, FUTEX_WAIT_PRIVATE, events, end != 0 ? &wait : NULL, NULL, 0);
+		__atomic_sub_fetch (&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+out:
+	return retval;
+}
+
+int libthinkfinger_strip_release (libthinkfinger *tf, const libthinkfinger_strip *strip)
+{
+	struct capture_ring *ring;
+	unsigned int freed;
+	int retval = -1;
+
+	if (tf == NULL || strip == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+	ring = &tf->capture;
+	if (ring->slots == NULL || strip->slot >= CAPTURE_RING_LEN ||
+	    strip->pixels != ring->slots + strip->slot * STRIP_SLOT + 7)
+		goto out;
+
+	ring->released[strip->slot] = 1;
+	freed = ring->freed;
+	while (freed != ring->head && ring->released[freed % CAPTURE_RING_LEN]) {
+		ring->released[freed % CAPTURE_RING_LEN] = 0;
+		freed++;
+	}
+	if (freed != ring->freed) {
+		__atomic_store_n (&ring->freed, freed, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&ring->stalled, __ATOMIC_SEQ_CST))
+			syscall (SYS_futex, &ring->freed, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_stitch (libthinkfinger *tf, const libthinkfinger_strip *strip, libthinkfinger_swipe *swipe)
+{
+	void *image;
+	int retval = -1;
+
+	if (tf == NULL || strip == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+	if (tf->stitch.image == NULL) {
+		/* the first swipe pays for the image, the handles which never
+		 * stitch do not */
+		image = mmap (NULL, TF_IMAGE_WIDTH * TF_IMAGE_HEIGHT, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (image == MAP_FAILED) {
+			fprintf (stderr, "Error: %s.\n", strerror (errno));
+			goto out;
+		}
+		stitch_init (&tf->stitch, image);
+	}
+
+	if (strip->sequence == 0)
+		stitch_reset (&tf->stitch);
+	retval = stitch_strip (&tf->stitch, strip->pixels, strip->time_us);
+	if (swipe != NULL)
+		*swipe = tf->stitch.swipe;
+out:
+	return retval;
+}
+
+int libthinkfinger_get_image (libthinkfinger *tf, libthinkfinger_image *image, libthinkfinger_swipe *swipe)
+{
+	int retval = -1;
+
+	if (tf == NULL || image == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+	if (tf->stitch.image == NULL)
+		goto out;
+
+	retval = stitch_finish (&tf->stitch);
+	image->pixels = tf->stitch.image;
+	image->width = TF_IMAGE_WIDTH;
+	image->height = tf->stitch.swipe.height;
+	if (swipe != NULL)
+		*swipe = tf->stitch.swipe;
+out:
+	return retval;
+}
+
+int libthinkfinger_extract (libthinkfinger *tf, const libthinkfinger_image *image, libthinkfinger_features *features)
+{
+	int retval = -1;
+
+	if (tf == NULL || image == NULL || features == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	if (tf->extract == NULL) {
+		tf->extract = extract_new ();
+		if (tf->extract == NULL) {
+			fprintf (stderr, "Error: %s.\n", strerror (ENOMEM));
+			goto out;
+		}
+	}
+	retval = extract_features (tf->extract, image, features);
+out:
+	return retval;
+}
+
+struct extract_batch {
+	const libthinkfinger_image *images;
+	libthinkfinger_features *features;
+	unsigned int count;
+	unsigned int next;		/* next image to take */
+	unsigned int extracted;
+};
+
+/* every thread takes the next image until there are none left */
+static void *_libthinkfinger_extract_worker (void *data)
+{
+	struct extract_batch *batch = data;
+	struct extract *extract;
+	unsigned int i;
+
+	extract = extract_new ();
+	if (extract == NULL)
+		return NULL;
+
+	while ((i = __atomic_fetch_add (&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+		if (extract_features (extract, &batch->images[i], &batch->features[i]) == 0)
+			__atomic_add_fetch (&batch->extracted, 1, __ATOMIC_RELAXED);
+		else
+			batch->features[i].count = 0;
+	}
+
+	extract_free (extract);
+	return NULL;
+}
+
+int libthinkfinger_extract_batch (const libthinkfinger_image *images, libthinkfinger_features *features,
+				  unsigned int count, unsigned int threads)
+{
+	struct extract_batch batch = { images, features, count, 0, 0 };
+	pthread_t *thread;
+	unsigned int started;
+	long cpus;
+	int retval = -1;
+
+	if (images == NULL || features == NULL) {
+		fprintf (stderr, "Error: no images to extract.\n");
+		goto out;
+	}
+
+	if (threads == 0) {
+		cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > count)
+		threads = count;
+
+	/* the calling thread is one of them */
+	thread = threads > 1 ? calloc (threads - 1, sizeof (pthread_t)) : NULL;
+	for (started = 0; thread != NULL && started < threads - 1; started++)
+		if (pthread_create (&thread[started], NULL, _libthinkfinger_extract_worker, &batch) != 0)
+			break;
+	_libthinkfinger_extract_worker (&batch);
+	while (started > 0)
+		pthread_join (thread[--started], NULL);
+	free (thread);
+
+	/* no workspace could be allocated */
+	if (batch.extracted == 0 && batch.next < count)
+		goto out;
+	retval = batch.extracted;
+out:
+	return retval;
+}
+
+struct libthinkfinger_index_s {
+	struct identify *identify;
+};
+
+libthinkfinger_index *libthinkfinger_index_new (void)
+{
+	libthinkfinger_index *index;
+
+	index = malloc (sizeof (*index));
+	if (index == NULL)
+		goto out;
+	index->identify = identify_new ();
+	if (index->identify == NULL) {
+		free (index);
+		index = NULL;
+	}
+out:
+	return index;
+}
+
+int libthinkfinger_index_add (libthinkfinger_index *index, unsigned int id, const libthinkfinger_features *features)
+{
+	int retval = -1;
+
+	if (index == NULL || features == NULL) {
+		fprintf (stderr, "Error: no template to index.\n");
+		goto out;
+	}
+
+	retval = identify_add (index->identify, id, features);
+out:
+	return retval;
+}
+
+void libthinkfinger_index_free (libthinkfinger_index *index)
+{
+	if (index == NULL)
+		return;
+
+	identify_free (index->identify);
+	free (index);
+}
+
+struct identify_batch {
+	const struct identify *identify;
+	struct identify_query *query;
+	unsigned int count;
+	unsigned int next;		/* next template to score */
+};
+
+static void *_libthinkfinger_identify_worker (void *data)
+{
+	struct identify_batch *batch = data;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add (&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+		identify_score (batch->identify, batch->query, i);
+
+	return NULL;
+}
+
+int libthinkfinger_identify (libthinkfinger_index *index, const libthinkfinger_features *probe,
+			     libthinkfinger_candidate *candidates, unsigned int k, unsigned int threads)
+{
+	struct identify_batch batch;
+	pthread_t *thread;
+	unsigned int started;
+	long cpus;
+	int retval = -1;
+
+	if (index == NULL || probe == NULL || candidates == NULL) {
+		fprintf (stderr, "Error: nothing to identify.\n");
+		goto out;
+	}
+
+	batch.identify = index->identify;
+	batch.query = identify_query_new (index->identify, probe, k);
+	if (batch.query == NULL)
+		goto out;
+	batch.count = identify_shortlist (batch.query);
+	batch.next = 0;
+
+	if (threads == 0) {
+		cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > batch.count)
+		threads = batch.count;
+
+	/* the calling thread is one of them */
+	thread = threads > 1 ? calloc (threads - 1, sizeof (pthread_t)) : NULL;
+	for (started = 0; thread != NULL && started < threads - 1; started++)
+		if (pthread_create (&thread[started], NULL, _libthinkfinger_identify_worker, &batch) != 0)
+			break;
+	_libthinkfinger_identify_worker (&batch);
+	while (started > 0)
+		pthread_join (thread[--started], NULL);
+	free (thread);
+
+	retval = identify_results (index->identify, batch.query, candidates, k);
+	identify_query_free (batch.query);
+out:
+	return retval;
+}
+
+int libthinkfinger_set_file (libthinkfinger *tf, const char *file)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	/* callers set the same file before every task, keep the copy we have */
+	if (tf->file != NULL && file != NULL && !strcmp (tf->file, file)) {
+		retval = 0;
+		goto out;
+	}
+
+	free (tf->file);
+	tf->file = (file != NULL) ? strdup (file) : NULL;
+	if (file != NULL && tf->file == NULL)
+		goto out;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_set_finger (libthinkfinger *tf, unsigned int finger)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+	if (finger > TF_BIR_FINGERS)
+		goto out;
+
+	tf->finger = finger;
+	retval = 0;
+out:
+	return retval;
+}
+
+/* the container is written next to the record and renamed over it, with
+ * the mode and the owner of the record */
+int libthinkfinger_convert_bir (const char *file, unsigned int finger)
+{
+	struct bir_template templates[TF_BIR_FINGERS];
+	struct stat st;
+	void *bir;
+	char *tmp;
+	int fd;
+	int tmp_fd;
+	int retval = -1;
+
+	if (file == NULL || finger > TF_BIR_FINGERS)
+		goto out;
+
+	fd = open (file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf (stderr, "Error while opening \"%s\": %s.\n", file, strerror (errno));
+		goto out;
+	}
+	if (fstat (fd, &st) < 0) {
+		fprintf (stderr, "Error while reading \"%s\": %s.\n", file, strerror (errno));
+		goto out_close;
+	}
+	if (st.st_size <= 0 || st.st_size > BIR_SIZE_MAX) {
+		fprintf (stderr, "Error: \"%s\" is not a record (%lld bytes).\n",
+			 file, (long long) st.st_size);
+		goto out_close;
+	}
+	bir = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (bir == MAP_FAILED) {
+		fprintf (stderr, "Error while mapping \"%s\": %s.\n", file, strerror (errno));
+		goto out_close;
+	}
+	if (bir_legacy (bir, st.st_size) == false) {
+		if (bir_read (bir, st.st_size, templates) < 0)
+			fprintf (stderr, "Error: \"%s\" is corrupt.\n", file);
+		else
+			retval = 0;
+		goto out_unmap;
+	}
+	if (st.st_size > UPLOAD_TEMPLATE_MAX) {
+		fprintf (stderr, "Error: \"%s\" is not a template (%lld bytes).\n",
+			 file, (long long) st.st_size);
+		goto out_unmap;
+	}
+
+	tmp = malloc (strlen (file) + sizeof (".XXXXXX"));
+	if (tmp == NULL) {
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+		goto out_unmap;
+	}
+	sprintf (tmp, "%s.XXXXXX", file);
+	tmp_fd = mkstemp (tmp);
+	if (tmp_fd < 0) {
+		fprintf (stderr, "Error while creating \"%s\": %s.\n", tmp, strerror (errno));
+		goto out_free;
+	}
+
+	templates[0].finger = finger;
+	templates[0].data = bir;
+	templates[0].size = st.st_size;
+	if ((st.st_uid != geteuid () || st.st_gid != getegid ()) &&
+	    fchown (tmp_fd, st.st_uid, st.st_gid) < 0)
+		fprintf (stderr, "Error while converting \"%s\": %s.\n", file, strerror (errno));
+	else if (fchmod (tmp_fd, st.st_mode & 07777) < 0 ||
+		 bir_write (tmp_fd, templates, 1) < 0 ||
+		 fsync (tmp_fd) < 0 ||
+		 rename (tmp, file) < 0)
+		fprintf (stderr, "Error while converting \"%s\": %s.\n", file, strerror (errno));
+	else
+		retval = 1;
+	if (retval < 0)
+		unlink (tmp);
+	close (tmp_fd);
+out_free:
+	free (tmp);
+out_unmap:
+	munmap (bir, st.st_size);
+out_close:
+	close (fd);
+out:
+	return retval;
+}
+
+int libthinkfinger_set_timeout_policy (libthinkfinger *tf, libthinkfinger_phase phase, const libthinkfinger_timeout_policy *policy)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	if (phase >= TF_PHASE_COUNT || policy == NULL || policy->timeout == 0 ||
+	    policy->timeout_min > policy->timeout)
+		goto out;
+
+	tf->timeouts[phase].policy = *policy;
+	/* what has been learned under the old policy does not apply anymore */
+	tf->timeouts[phase].samples = 0;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_get_timeout_policy (libthinkfinger *tf, libthinkfinger_phase phase, libthinkfinger_timeout_policy *policy)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	if (phase >= TF_PHASE_COUNT || policy == NULL)
+		goto out;
+
+	*policy = tf->timeouts[phase].policy;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_set_power_policy (libthinkfinger *tf, const libthinkfinger_power_policy *policy)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	/* the reader has to be idle for a while before it can suspend */
+	if (policy == NULL || (policy->autosuspend_delay > 0 && policy->autosuspend_delay >= policy->wake_latency))
+		goto out;
+
+	tf->power = *policy;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_get_power_policy (libthinkfinger *tf, libthinkfinger_power_policy *policy)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	if (policy == NULL)
+		goto out;
+
+	*policy = tf->power;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_get_stats (libthinkfinger *tf, libthinkfinger_stats *stats)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	if (stats == NULL)
+		goto out;
+
+	*stats = tf->stats;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_set_callback (libthinkfinger *tf, libthinkfinger_state_cb cb, void *cb_data)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	tf->cb = cb;
+	tf->cb_data = cb_data;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_set_lease_timeout (libthinkfinger *tf, unsigned int timeout)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	tf->lease.timeout = timeout;
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_get_lease (libthinkfinger *tf, libthinkfinger_lease *lease)
+{
+	struct lease_table *table;
+	unsigned int ticket;
+	_Bool moved;
+	pid_t pid;
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	table = tf->lease.table;
+	if (lease == NULL || table == NULL)
+		goto out;
+
+	if (_libthinkfinger_lease_lock (tf) < 0)
+		goto out;
+	moved = _libthinkfinger_lease_skip (table);
+	lease->holder = table->holder > 0 ? table->holder : 0;
+	memcpy (lease->name, table->name, sizeof (lease->name));
+	lease->name[sizeof (lease->name) - 1] = '\0';
+	lease->waiters = 0;
+	for (ticket = table->serving; ticket != table->next; ticket++) {
+		pid = table->queue[ticket % LEASE_QUEUE_LEN];
+		if (pid > 0 && pid != table->holder && kill (pid, 0) == 0)
+			lease->waiters++;
+	}
+	_libthinkfinger_lease_unlock (tf, moved);
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_get_snapshot (libthinkfinger *tf, libthinkfinger_snapshot *snapshot)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	if (snapshot == NULL)
+		goto out;
+
+	_libthinkfinger_snapshot_read (tf, snapshot);
+	retval = 0;
+out:
+	return retval;
+}
+
+int libthinkfinger_wait_state (libthinkfinger *tf, unsigned long sequence, unsigned int deadline, libthinkfinger_snapshot *snapshot)
+{
+	struct state_publication *pub;
+	struct timespec timeout;
+	unsigned long long end = 0;
+	unsigned long long now;
+	unsigned int word;
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	if (snapshot == NULL)
+		goto out;
+
+	pub = &tf->published;
+	if (deadline > 0)
+		end = _libthinkfinger_now () + (unsigned long long) deadline * 1000;
+
+	/* registered before the sequence is read, so a transition after the
+	 * read either changes the futex word or sees the waiter */
+	__atomic_fetch_add (&pub->waiters, 1, __ATOMIC_SEQ_CST);
+	while (true) {
+		word = _libthinkfinger_snapshot_read (tf, snapshot);
+		if (snapshot->sequence != sequence) {
+			retval = 0;
+			break;
+		}
+
+		if (end != 0) {
+			now = _libthinkfinger_now ();
+			if (now >= end) {
+				retval = 1;
+				break;
+			}
+			timeout.tv_sec = (end - now) / 1000000;
+			timeout.tv_nsec = (end - now) % 1000000 * 1000;
+		}
+		if (syscall (SYS_futex, &pub->sequence, FUTEX_WAIT_PRIVATE, word,
+			     end != 0 ? &timeout : NULL, NULL, 0) < 0 &&
+		    errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			fprintf (stderr, "Error: %s.\n", strerror (errno));
+			break;
+		}
+	}
+	__atomic_fetch_sub (&pub->waiters, 1, __ATOMIC_SEQ_CST);
+out:
+	return retval;
+}
+
+int libthinkfinger_get_event_fd (libthinkfinger *tf)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	retval = tf->events.fd;
+out:
+	return retval;
+}
+
+int libthinkfinger_dispatch (libthinkfinger *tf)
+{
+	struct event_queue *queue;
+	libthinkfinger_state state;
+	unsigned int head;
+	eventfd_t count;
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	/* reset the wakeup before draining, so a state queued meanwhile wakes
+	 * the consumer again */
+	queue = &tf->events;
+	if (queue->fd >= 0 && eventfd_read (queue->fd, &count) < 0 && errno != EAGAIN)
+		fprintf (stderr, "Error: %s.\n", strerror (errno));
+
+	retval = 0;
+	head = queue->head;
+	while (head != __atomic_load_n (&queue->tail, __ATOMIC_ACQUIRE)) {
+		state = queue->state[head % EVENT_QUEUE_LEN];
+		__atomic_store_n (&queue->head, ++head, __ATOMIC_RELEASE);
+		if (tf->cb != NULL)
+			tf->cb (state, tf->cb_data);
+		retval++;
+	}
+out:
+	return retval;
+}
+
+/* checks that the device is there and can be claimed, without talking to it */
+static libthinkfinger_init_status _libthinkfinger_probe (libthinkfinger *tf)
+{
+	libthinkfinger_init_status retval = TF_INIT_UNDEFINED;
+
+	unsigned int timeout = tf->lease.timeout;
+
+	/* a device in use by another process is there, the task waits for it */
+	tf->lease.timeout = 0;
+	retval = _libthinkfinger_usb_open (tf);
+	tf->lease.timeout = timeout;
+	if (retval == TF_INIT_DEVICE_BUSY) {
+		retval = TF_INIT_SUCCESS;
+		goto out;
+	}
+	if (retval != TF_INIT_USB_INIT_SUCCESS)
+		goto out;
+
+	usb_release_interface (tf->usb_dev_handle, 0);
+	usb_close (tf->usb_dev_handle);
+	tf->usb_dev_handle = NULL;
+
+	retval = TF_INIT_SUCCESS;
+out:
+	return retval;
+}
+
+libthinkfinger *libthinkfinger_new (libthinkfinger_init_status *init_status)
+{
+	return libthinkfinger_new_flags (init_status, TF_FLAG_DEFAULT);
+}
+
+libthinkfinger *libthinkfinger_new_flags (libthinkfinger_init_status *init_status, int flags)
 {
 	libthinkfinger *tf = NULL;
+	int i;
 
 	tf = calloc(1, sizeof(libthinkfinger));
 	if (tf == NULL) {
@@ -880,37 +3561,123 @@ libthinkfinger *libthinkfinger_new (libthinkfinger_init_status *init_status)
 	tf->fd = -1;
 	tf->task = TF_TASK_UNDEFINED;
 	tf->task_running = false;
+	tf->initialized = false;
 	tf->state = TF_STATE_INITIAL;
 	tf->cb = NULL;
 	tf->cb_data = NULL;
+	tf->deadline = 0;
+	for (i = 0; i < TF_PHASE_COUNT; i++)
+		tf->timeouts[i].policy = default_policy[i];
+	tf->events.last = TF_STATE_UNDEFINED;
+	tf->events.fd = -1;
+	tf->lease.fd = -1;
+	tf->lease.timeout = LEASE_TIMEOUT;
+	tf->published.snapshot.state = TF_STATE_INITIAL;
+	tf->published.snapshot.task = TF_TASK_UNDEFINED;
+	tf->published.snapshot.time_us = _libthinkfinger_now ();
+	memcpy (tf->scan, scan_sequence, sizeof (scan_sequence));
+	memcpy (tf->upload, upload_header, sizeof (upload_header));
 	if (pthread_mutex_init (&tf->usb_deinit_mutex, NULL) < 0)
 		fprintf (stderr, "pthread_mutex_init failed: (%s).\n", strerror (errno));
+	if (pthread_mutex_init (&tf->lease.mutex, NULL) < 0)
+		fprintf (stderr, "pthread_mutex_init failed: (%s).\n", strerror (errno));
+
+	tf->flags = flags;
+	if (flags & TF_FLAG_CALLBACK_QUEUE) {
+		tf->events.fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (tf->events.fd < 0)
+			fprintf (stderr, "Error: %s.\n", strerror (errno));
+	}
+
+	if (flags & TF_FLAG_LEASE)
+		_libthinkfinger_lease_open (tf);
+
+	if (flags & TF_FLAG_CAPTURE) {
+		/* touched now, so that no page fault delays a strip */
+		tf->capture.slots = mmap (NULL, CAPTURE_RING_LEN * STRIP_SLOT, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (tf->capture.slots == MAP_FAILED) {
+			fprintf (stderr, "Error: %s.\n", strerror (errno));
+			tf->capture.slots = NULL;
+		}
+	}
+
+	if (flags & TF_FLAG_PROBE) {
+		*init_status = _libthinkfinger_probe (tf);
+		goto out_yield;
+	}
 
 	if ((*init_status = _libthinkfinger_init (tf)) != TF_INIT_SUCCESS)
-		goto out;
+		goto out_yield;
 
 	_libthinkfinger_usb_flush (tf);
 	_libthinkfinger_usb_deinit (tf);
 
 	*init_status = TF_INIT_SUCCESS;
+out_yield:
+	_libthinkfinger_lease_yield (tf);
 out:
 	return tf;
 }
 
+int libthinkfinger_cancel (libthinkfinger *tf)
+{
+	int retval = -1;
+
+	if (tf == NULL) {
+		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
+		goto out;
+	}
+
+	__atomic_store_n (&tf->cancelled, true, __ATOMIC_SEQ_CST);
+	_libthinkfinger_wake (tf);
+	retval = 0;
+out:
+	return retval;
+}
+
 void libthinkfinger_free (libthinkfinger *tf)
 {
+	struct timespec timeout = { 0, 10000000L };
+	unsigned int busy;
+
 	if (tf == NULL) {
 		fprintf (stderr, "Error: libthinkfinger not properly initialized.\n");
 		goto out;
 	}
 
+	/* a task of another thread, which may still wait for the reader, is
+	 * cancelled and has to return before tf goes away; the wakeup is
+	 * repeated as the task may have checked just before it went to sleep */
+	__atomic_store_n (&tf->cancelled, true, __ATOMIC_SEQ_CST);
+	while ((busy = __atomic_load_n (&tf->busy, __ATOMIC_SEQ_CST)) > 0) {
+		_libthinkfinger_wake (tf);
+		syscall (SYS_futex, &tf->busy, FUTEX_WAIT_PRIVATE, busy, &timeout, NULL, 0);
+	}
+
+	_libthinkfinger_prewarm_take (tf);
 	_libthinkfinger_usb_deinit (tf);
+	_libthinkfinger_lease_release (tf);
+	if (tf->lease.table != NULL)
+		munmap (tf->lease.table, sizeof (*tf->lease.table));
+	if (tf->lease.fd >= 0)
+		close (tf->lease.fd);
 
 	free (tf->file);
+	free (tf->resident_template);
 
-	if (tf->fd)
+	if (tf->fd >= 0)
 		close (tf->fd);
-
+	if (tf->events.fd >= 0)
+		close (tf->events.fd);
+	if (tf->capture.slots != NULL)
+		munmap (tf->capture.slots, CAPTURE_RING_LEN * STRIP_SLOT);
+	if (tf->stitch.image != NULL)
+		munmap (tf->stitch.image, TF_IMAGE_WIDTH * TF_IMAGE_HEIGHT);
+	extract_free (tf->extract);
+
+	pthread_mutex_destroy (&tf->usb_deinit_mutex);
+	pthread_mutex_destroy (&tf->lease.mutex);
 	free(tf);
 out:
 	return;
@@ -37,6 +37,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <config.h>
 
@@ -52,6 +53,14 @@ typedef unsigned int   u32;
 typedef unsigned short u16;
 typedef unsigned char  u8;
 
+#define TF_STRIP_WIDTH  248                               // pixels of a strip row
+#define TF_STRIP_HEIGHT 4                                 // rows of a strip
+#define TF_STRIP_SIZE   (TF_STRIP_WIDTH * TF_STRIP_HEIGHT) // bytes of a strip, 8 bit per pixel
+#define TF_IMAGE_WIDTH  TF_STRIP_WIDTH                    // pixels of an image row
+#define TF_IMAGE_HEIGHT 1024                              // rows an image holds at most
+#define TF_MINUTIAE_MAX 128                               // minutiae kept of an image
+#define TF_BIR_FINGERS  10                                // templates a record holds at most
+
 typedef struct libthinkfinger_s libthinkfinger;
 
 typedef enum {
@@ -62,14 +71,25 @@ typedef enum {
 	TF_INIT_USB_OPEN_FAILED      = 0x04, // USB device could not be opened
 	TF_INIT_USB_CLAIM_FAILED     = 0x05, // USB device could not be claimed
 	TF_INIT_USB_HELLO_FAILED     = 0x06, // could not send HELLO sequence to USB device
+	TF_INIT_USB_HANDSHAKE_FAILED = 0x07, // USB device did not take the initialization sequence
+	TF_INIT_DEVICE_BUSY          = 0x08, // USB device held by another process until the lease timeout
 	TF_INIT_UNDEFINED            = 0xff  // undefined
 } libthinkfinger_init_status;
 
+typedef enum {
+	TF_FLAG_DEFAULT              = 0x00, // initialize the device to prove that it works
+	TF_FLAG_PROBE                = 0x01, // only check that the device is there and can be claimed
+	TF_FLAG_PIPELINE             = 0x02, // send the initialization sequence without waiting for replies
+	TF_FLAG_CALLBACK_QUEUE       = 0x04, // queue state changes for libthinkfinger_dispatch
+	TF_FLAG_LEASE                = 0x08  // queue for the device with the other processes using it
+} libthinkfinger_flag;
+
 typedef enum {
 	TF_TASK_IDLE                 = 0x00, // idle
 	TF_TASK_INIT                 = 0x01, // initialization
 	TF_TASK_ACQUIRE              = 0x02, // acquirement
 	TF_TASK_VERIFY               = 0x03, // verification
+	TF_TASK_CAPTURE              = 0x04, // capture of raw strips
 	TF_TASK_UNDEFINED            = 0xff  // undefined
 } libthinkfinger_task;
 
@@ -86,8 +106,13 @@ typedef enum {
 	TF_STATE_ACQUIRE_FAILED      = 0x09, // acquirement failed
 	TF_STATE_VERIFY_SUCCESS      = 0x0a, // verification successful
 	TF_STATE_VERIFY_FAILED       = 0x0b, // verification failed
+	TF_STATE_CAPTURE_SUCCESS     = 0x0c, // swipe captured
+	TF_STATE_CAPTURE_FAILED      = 0x0d, // capture failed
+	TF_STATE_BIR_CORRUPT         = 0xf8, // record damaged or of an unknown version
+	TF_STATE_DEVICE_BUSY         = 0xf9, // device held by another process
+	TF_STATE_TIMEOUT             = 0xfa, // deadline expired
 	TF_STATE_OPEN_FAILED         = 0xfb, // open(2) failed
-	TF_STATE_SIGINT              = 0xfc, // received sigint
+	TF_STATE_SIGINT              = 0xfc, // received sigint or cancelled
 	TF_STATE_USB_ERROR           = 0xfd, // USB error
 	TF_STATE_COMM_FAILED         = 0xfe, // communication error
 	TF_STATE_UNDEFINED           = 0xff  // undefined
@@ -98,13 +123,151 @@ typedef enum {
 	TF_RESULT_ACQUIRE_FAILED     = TF_STATE_ACQUIRE_FAILED,  // acquirement failed
 	TF_RESULT_VERIFY_SUCCESS     = TF_STATE_VERIFY_SUCCESS,  // verification successful
 	TF_RESULT_VERIFY_FAILED      = TF_STATE_VERIFY_FAILED,   // verification failed
+	TF_RESULT_CAPTURE_SUCCESS    = TF_STATE_CAPTURE_SUCCESS, // swipe captured
+	TF_RESULT_CAPTURE_FAILED     = TF_STATE_CAPTURE_FAILED,  // capture failed
+	TF_RESULT_TIMEOUT            = TF_STATE_TIMEOUT,         // deadline expired
 	TF_RESULT_OPEN_FAILED        = TF_STATE_OPEN_FAILED,     // open(2) failed
-	TF_RESULT_SIGINT             = TF_STATE_SIGINT,          // received sigint
+	TF_RESULT_SIGINT             = TF_STATE_SIGINT,          // received sigint or cancelled
 	TF_RESULT_USB_ERROR          = TF_STATE_USB_ERROR,       // USB error
 	TF_RESULT_COMM_FAILED        = TF_STATE_COMM_FAILED,     // communication error
+	TF_RESULT_DEVICE_BUSY        = TF_STATE_DEVICE_BUSY,     // device held by another process until the lease timeout
+	TF_RESULT_BIR_CORRUPT        = TF_STATE_BIR_CORRUPT,     // record damaged or of an unknown version
 	TF_RESULT_UNDEFINED          = TF_STATE_UNDEFINED        // undefined
 } libthinkfinger_result;
 
+typedef enum {
+	TF_PHASE_HELLO               = 0x00, // HELLO control requests
+	TF_PHASE_INIT                = 0x01, // initialization sequence
+	TF_PHASE_UPLOAD              = 0x02, // template upload or enroll request
+	TF_PHASE_POLL                = 0x03, // waiting for the finger to be swiped
+	TF_PHASE_DEINIT              = 0x04, // deinitialization sequence
+	TF_PHASE_COUNT               = 0x05  // number of phases
+} libthinkfinger_phase;
+
+typedef struct {
+	unsigned int timeout;        // timeout of a transfer in ms, upper bound of the learned timeout
+	unsigned int timeout_min;    // lower bound of the learned timeout in ms
+	unsigned int retries;        // number of times a read of the rest of a reply which timed out is repeated
+	unsigned int backoff;        // delay before the first retry in ms, doubled for every further retry
+	_Bool adaptive;              // learn the timeout from the latency of completed transfers
+} libthinkfinger_timeout_policy;
+
+typedef struct {
+	unsigned int wake_latency;      // pause in ms between two polls while nothing happens, 0 polls back to back
+	unsigned int autosuspend_delay; // idle time in ms after which the reader may suspend in a pause, 0 leaves runtime PM alone
+} libthinkfinger_power_policy;
+
+typedef enum {
+	TF_RECOVERY_RESYNC           = 0x00, // endpoints cleared and drained, frame sequence restarted
+	TF_RECOVERY_RESET            = 0x01, // USB port reset
+	TF_RECOVERY_REINIT           = 0x02, // USB device deinitialized, reopened and initialized
+	TF_RECOVERY_COUNT            = 0x03  // number of recovery tiers
+} libthinkfinger_recovery;
+
+typedef struct {
+	unsigned long attempts;      // recoveries tried at this tier
+	unsigned long successes;     // recoveries after which the task succeeded
+	unsigned long long time_us;  // time spent at this tier in us
+	unsigned long long max_us;   // longest recovery at this tier in us
+} libthinkfinger_recovery_stats;
+
+typedef struct {
+	libthinkfinger_recovery_stats recovery[TF_RECOVERY_COUNT];
+	unsigned long init_full;                // tasks which sent the initialization sequence
+	unsigned long init_skipped;             // tasks which found the device initialized already
+	unsigned long init_fallback;            // skipped initializations which had to be done after all
+	unsigned long init_pipelined;           // pipelined initialization sequences
+	unsigned long init_pipeline_fallback;   // pipelined sequences the device did not take
+	unsigned long long init_lockstep_us;    // mean duration of a lock-step sequence in us
+	unsigned long long init_pipeline_saved_us; // time saved by pipelining in us
+	unsigned long events_coalesced;         // queued state changes which repeated the previous one
+	unsigned long events_dropped;           // state changes lost because the queue was full
+	unsigned long poll_wakeups;             // polls while waiting for a swipe, each wakes the host
+	unsigned long long poll_time_us;        // time spent waiting for a swipe in us
+	unsigned long autosuspend_waits;        // waits during which the reader was allowed to suspend
+	unsigned long strips_captured;          // strips streamed into the capture ring
+	unsigned long capture_stalls;           // times the capture waited for a slot to be released
+	unsigned long verify_rearms;            // failed swipes after which a continuous verification went on
+	unsigned long verify_retries;           // verifications which used the template left on the reader
+	unsigned long uploads_skipped;          // verifications which re-armed the reader instead of uploading again
+	unsigned long prewarms;                 // readers kept for the next task with TF_FLAG_LEASE
+	unsigned long prewarms_used;            // and taken by the next task while still warm
+	unsigned long prewarms_released;        // and handed back unused, after the hold or to another process
+} libthinkfinger_stats;
+
+typedef struct {
+	const unsigned char *pixels; // TF_STRIP_SIZE pixels row by row, valid until the strip is released
+	unsigned long long time_us;  // CLOCK_MONOTONIC time the strip arrived in us
+	unsigned long sequence;      // number of the strip within the capture, from 0
+	unsigned int slot;           // slot of the ring the strip is in
+} libthinkfinger_strip;
+
+typedef enum {
+	TF_SWIPE_OK                  = 0x00, // nothing wrong with the swipe so far
+	TF_SWIPE_TOO_FAST            = 0x01, // strips did not overlap, the finger was too fast
+	TF_SWIPE_SKEWED              = 0x02, // the finger drifted too far sideways
+	TF_SWIPE_TOO_SHORT           = 0x03, // the image has too few rows
+	TF_SWIPE_PARTIAL             = 0x04  // too little of the image shows ridges
+} libthinkfinger_swipe_verdict;
+
+typedef struct {
+	unsigned int strips;                 // strips stitched
+	unsigned int height;                 // rows of the image
+	unsigned int still;                  // strips taken while the finger did not move
+	unsigned int lost;                   // strips which did not overlap the one before
+	int skew;                            // sideways drift of the finger in pixels, positive to the right
+	unsigned int speed;                  // rows per second
+	unsigned int coverage;               // percent of the image which shows ridges
+	libthinkfinger_swipe_verdict verdict;
+} libthinkfinger_swipe;
+
+typedef struct {
+	const unsigned char *pixels;         // TF_IMAGE_WIDTH pixels per row, row by row
+	unsigned int width;                  // pixels of a row
+	unsigned int height;                 // rows
+} libthinkfinger_image;
+
+typedef enum {
+	TF_MINUTIA_ENDING            = 0x01, // a ridge ends
+	TF_MINUTIA_BIFURCATION       = 0x02  // a ridge splits in two
+} libthinkfinger_minutia_type;
+
+typedef struct {
+	int x;                               // column in the image
+	int y;                               // row in the image
+	int angle;                           // direction in degrees counterclockwise, 0 is to the right
+	libthinkfinger_minutia_type type;
+	unsigned int quality;                // 0 to 100, how clear the ridges around it are
+} libthinkfinger_minutia;
+
+typedef struct {
+	unsigned int width;                  // of the image the minutiae were found in
+	unsigned int height;
+	unsigned int count;                  // minutiae found, the best first
+	libthinkfinger_minutia minutiae[TF_MINUTIAE_MAX];
+} libthinkfinger_features;
+
+typedef struct libthinkfinger_index_s libthinkfinger_index;
+
+typedef struct {
+	unsigned int id;                     // given to libthinkfinger_index_add
+	unsigned int score;                  // 0 to 100, how well the minutiae match
+} libthinkfinger_candidate;
+
+typedef struct {
+	pid_t holder;                // process holding the device, 0 if it is free
+	char name[16];               // name of that process
+	unsigned int waiters;        // processes queued for the device
+} libthinkfinger_lease;
+
+typedef struct {
+	unsigned long sequence;      // number of state transitions so far
+	unsigned long long time_us;  // CLOCK_MONOTONIC time of the last transition in us
+	libthinkfinger_state state;  // current state
+	libthinkfinger_task task;    // current task, TF_TASK_IDLE once it ended
+	_Bool task_running;          // whether the task is still running
+} libthinkfinger_snapshot;
+
 /** @brief callback function which the driver invokes to report a new state of
  *         the scanner
  *
@@ -124,6 +287,34 @@ typedef void (*libthinkfinger_state_cb) (libthinkfinger_state state, void *data)
  */
 int libthinkfinger_set_file(libthinkfinger *tf, const char *file);
 
+/** @brief set the finger of the record a task uses
+ *
+ * A record holds the templates of up to TF_BIR_FINGERS fingers.  Acquire
+ * stores the template under the finger and keeps those of the other
+ * fingers; verify uses the template of the finger, finger 0 the first one
+ * of the record, which is the one acquired last.
+ *
+ * @param tf struct libthinkfinger
+ * @param finger 1 (right thumb) to 10 (left little finger) as in
+ *        ISO/IEC 19794-2, or 0 if not told (default)
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_set_finger(libthinkfinger *tf, unsigned int finger);
+
+/** @brief convert a record to the current format
+ *
+ * A record written by an older version, the bare template, is replaced
+ * atomically by a container holding it under the finger.  Its mode and
+ * its owner are kept.
+ *
+ * @param file filename
+ * @param finger finger of the template, see libthinkfinger_set_finger
+ *
+ * @return 1 if converted, 0 if the record is current already, else -1
+ */
+int libthinkfinger_convert_bir(const char *file, unsigned int finger);
+
 /** @brief set the callback function being invoked to report a new state of the
  *         scanner
  *
@@ -135,9 +326,191 @@ int libthinkfinger_set_file(libthinkfinger *tf, const char *file);
  */
 int libthinkfinger_set_callback(libthinkfinger *tf, libthinkfinger_state_cb state, void *data);
 
+/** @brief set the time a task waits for the device
+ *
+ * With TF_FLAG_LEASE a task which finds the device held by another process
+ * reports TF_STATE_DEVICE_BUSY and queues behind it.  It fails with
+ * TF_RESULT_DEVICE_BUSY if its turn did not come within the timeout, or
+ * with TF_RESULT_TIMEOUT if the deadline of the task passed first.
+ *
+ * @param tf struct libthinkfinger
+ * @param timeout time in ms, 0 to fail at once if the device is busy
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_set_lease_timeout(libthinkfinger *tf, unsigned int timeout);
+
+/** @brief get the process holding the device
+ *
+ * @param tf struct libthinkfinger, created with TF_FLAG_LEASE
+ * @param lease filled with the holder and the length of the queue
+ *
+ * @return 0 on success, -1 if the device is not arbitrated
+ */
+int libthinkfinger_get_lease(libthinkfinger *tf, libthinkfinger_lease *lease);
+
+/** @brief get the current state of an instance of libthinkfinger
+ *
+ * The state is published on every transition without taking a lock, so
+ * any thread may read it while a task is running, as often as it likes.
+ *
+ * @param tf struct libthinkfinger
+ * @param snapshot filled with the state and the time it was entered
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_get_snapshot(libthinkfinger *tf, libthinkfinger_snapshot *snapshot);
+
+/** @brief wait for a state transition
+ *
+ * Blocks until the state has moved on from the snapshot with the given
+ * sequence number or the deadline has passed.  Any number of threads may
+ * wait at the same time; the task wakes them but never waits for them.
+ *
+ * @param tf struct libthinkfinger
+ * @param sequence sequence number of the snapshot the caller has seen
+ * @param deadline time in ms to wait, 0 to wait without a deadline
+ * @param snapshot filled with the state when the call returns
+ *
+ * @return 0 if the state changed, 1 if the deadline passed, -1 on error
+ */
+int libthinkfinger_wait_state(libthinkfinger *tf, unsigned long sequence, unsigned int deadline, libthinkfinger_snapshot *snapshot);
+
+/** @brief get the file descriptor which signals queued state changes
+ *
+ * With TF_FLAG_CALLBACK_QUEUE the callback is not invoked by the task
+ * itself.  State changes are queued instead, and the returned eventfd
+ * becomes readable; poll it and call libthinkfinger_dispatch from the
+ * thread or event loop the callback should run in.
+ *
+ * @param tf struct libthinkfinger
+ *
+ * @return file descriptor, -1 without TF_FLAG_CALLBACK_QUEUE
+ */
+int libthinkfinger_get_event_fd(libthinkfinger *tf);
+
+/** @brief invoke the callback for the queued state changes
+ *
+ * Runs the callback for every state change queued since the last call, in
+ * the calling thread.  Only one thread may dispatch at a time; the task
+ * never waits for it.  Consecutive duplicates are queued once, and up to
+ * 64 state changes are kept, see libthinkfinger_stats.
+ *
+ * @param tf struct libthinkfinger
+ *
+ * @return number of dispatched state changes, -1 on error
+ */
+int libthinkfinger_dispatch(libthinkfinger *tf);
+
+/** @brief stitch a strip into the image of the swipe
+ *
+ * Estimates how far the finger moved since the strip before by
+ * correlating the two and appends the rows the strip adds to the image.
+ * The quality of the swipe is judged as it goes on, so a bad swipe can be
+ * given up before it is finished.  A strip with sequence 0 starts a new
+ * image.  The pixels of the strip are not used after this returns.
+ *
+ * @param tf struct libthinkfinger
+ * @param strip a strip of TF_STRIP_SIZE pixels
+ * @param swipe filled with the quality of the swipe so far, may be NULL
+ *
+ * @return 0 if the swipe is fine so far, 1 if it is to be rejected, -1 on error
+ */
+int libthinkfinger_stitch(libthinkfinger *tf, const libthinkfinger_strip *strip, libthinkfinger_swipe *swipe);
+
+/** @brief get the image of the swipe
+ *
+ * Judges the swipe as a whole and returns a view of its image, which stays
+ * valid until the next strip is stitched.
+ *
+ * @param tf struct libthinkfinger
+ * @param image filled with the image
+ * @param swipe filled with the quality of the swipe, may be NULL
+ *
+ * @return 0 if the image is fine, 1 if the swipe is to be rejected, -1 on error
+ */
+int libthinkfinger_get_image(libthinkfinger *tf, libthinkfinger_image *image, libthinkfinger_swipe *swipe);
+
+/** @brief find the minutiae of an image
+ *
+ * Normalizes the image, estimates the orientation of its ridges, enhances
+ * them with a Gabor filter, thins them and reports where they end or
+ * split.  The workspace is allocated with the first call and kept with
+ * the handle.
+ *
+ * @param tf struct libthinkfinger
+ * @param image an image of TF_IMAGE_WIDTH pixels per row, e.g. from libthinkfinger_get_image
+ * @param features filled with the minutiae
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_extract(libthinkfinger *tf, const libthinkfinger_image *image, libthinkfinger_features *features);
+
+/** @brief find the minutiae of many images
+ *
+ * Extracts the images on several threads, each with a workspace of its
+ * own; no handle is needed.  An image which cannot be extracted gets no
+ * minutiae.
+ *
+ * @param images images of TF_IMAGE_WIDTH pixels per row
+ * @param features filled with the minutiae of each image
+ * @param count number of images
+ * @param threads threads to use, 0 for one per online CPU
+ *
+ * @return number of images extracted, -1 on error
+ */
+int libthinkfinger_extract_batch(const libthinkfinger_image *images, libthinkfinger_features *features,
+				 unsigned int count, unsigned int threads);
+
+/** @brief create an index of templates to identify fingers with
+ *
+ * @return the index, NULL on error
+ */
+libthinkfinger_index *libthinkfinger_index_new(void);
+
+/** @brief add a template to an index
+ *
+ * The template is indexed by pairs of its best minutiae.  Templates must
+ * not be added while the index is searched.
+ *
+ * @param index an index created with libthinkfinger_index_new
+ * @param id returned with the template when it is found
+ * @param features the minutiae of the enrolled finger
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_index_add(libthinkfinger_index *index, unsigned int id, const libthinkfinger_features *features);
+
+/** @brief free an index and its templates
+ *
+ * @param index an index created with libthinkfinger_index_new
+ */
+void libthinkfinger_index_free(libthinkfinger_index *index);
+
+/** @brief find the templates a finger matches best
+ *
+ * The pairs of minutiae of the probe vote for the templates which have
+ * pairs alike, those with the most votes are aligned with the probe and
+ * scored on several threads.  An index may be searched from several
+ * threads at once.
+ *
+ * @param index an index created with libthinkfinger_index_new
+ * @param probe the minutiae of the finger
+ * @param candidates filled with the best templates, the best first
+ * @param k number of candidates wanted
+ * @param threads threads to score on, 0 for one per online CPU
+ *
+ * @return number of candidates found, -1 on error
+ */
+int libthinkfinger_identify(libthinkfinger_index *index, const libthinkfinger_features *probe,
+			    libthinkfinger_candidate *candidates, unsigned int k, unsigned int threads);
+
 /** @brief acquire fingerprint
  *
- * acquires a fingerprint and stores it to disk on success
+ * acquires a fingerprint and stores it to disk on success, an existing
+ * file is replaced atomically and left alone if the acquisition fails.
+ * The templates of other fingers in the file are kept, see
+ * libthinkfinger_set_finger
  *
  * @param tf struct libthinkfinger
  *
@@ -147,7 +520,8 @@ libthinkfinger_result libthinkfinger_acquire(libthinkfinger *tf);
 
 /** @brief verify fingerprint
  *
- * verifies a fingerprint
+ * verifies a fingerprint.  The record is checked before the reader is used,
+ * a damaged one fails with TF_RESULT_BIR_CORRUPT.
  *
  * @param tf struct libthinkfinger
  *
@@ -155,6 +529,127 @@ libthinkfinger_result libthinkfinger_acquire(libthinkfinger *tf);
  */
 libthinkfinger_result libthinkfinger_verify(libthinkfinger *tf);
 
+/** @brief verify fingerprint within a deadline
+ *
+ * verifies a fingerprint like libthinkfinger_verify but gives up once the
+ * deadline has expired.  The deadline covers the initialization of the
+ * reader, the template upload and the time waiting for the finger.
+ *
+ * @param tf struct libthinkfinger
+ * @param deadline time in ms the verification may take, 0 for no deadline
+ *
+ * @return libthinkfinger_result, TF_RESULT_TIMEOUT if the deadline expired
+ */
+libthinkfinger_result libthinkfinger_verify_deadline(libthinkfinger *tf, unsigned int deadline);
+
+/** @brief verify fingerprint again
+ *
+ * verifies the next swipe, e.g. after a swipe which did not match.  The
+ * reader is not known to verify a swipe against the template it holds, so
+ * for now this is libthinkfinger_verify: the template is uploaded again.
+ *
+ * @param tf struct libthinkfinger
+ *
+ * @return libthinkfinger_result
+ */
+libthinkfinger_result libthinkfinger_verify_retry(libthinkfinger *tf);
+
+/** @brief verify fingerprints until one matches
+ *
+ * verifies like libthinkfinger_verify, but a swipe which does not match
+ * does not end the task: the callback is told TF_STATE_VERIFY_FAILED and
+ * the next swipe is verified.  Meant for screen lockers, which wait for
+ * any number of attempts.
+ *
+ * Every swipe is verified like libthinkfinger_verify does, the template is
+ * uploaded again.
+ *
+ * @param tf struct libthinkfinger
+ *
+ * @return libthinkfinger_result, TF_RESULT_VERIFY_SUCCESS once a swipe
+ * matched, else the error or TF_RESULT_SIGINT which ended the task
+ */
+libthinkfinger_result libthinkfinger_verify_continuous(libthinkfinger *tf);
+
+/** @brief set the timeout policy of a protocol phase
+ *
+ * Each USB transfer is given the timeout of the phase it belongs to.  A
+ * read of the rest of a reply which timed out is repeated up to
+ * policy->retries times after an exponentially growing delay; the first
+ * read of a reply is not, as the protocol expects some of them to time out.
+ * Writes are not repeated either: one which timed out may have reached the
+ * device in part, so the task resyncs with it and starts over.  With
+ * policy->adaptive set the timeout
+ * is learned from the latency of the completed transfers and kept between
+ * policy->timeout_min and policy->timeout.
+ *
+ * @param tf struct libthinkfinger
+ * @param phase libthinkfinger_phase
+ * @param policy the policy to apply
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_set_timeout_policy(libthinkfinger *tf, libthinkfinger_phase phase, const libthinkfinger_timeout_policy *policy);
+
+/** @brief get the timeout policy of a protocol phase
+ *
+ * @param tf struct libthinkfinger
+ * @param phase libthinkfinger_phase
+ * @param policy filled with the policy of the phase
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_get_timeout_policy(libthinkfinger *tf, libthinkfinger_phase phase, libthinkfinger_timeout_policy *policy);
+
+/** @brief set the power policy of the wait for a swipe
+ *
+ * By default the reader is polled back to back while the task waits for a
+ * swipe, which keeps the host and the reader awake.  With a wake latency
+ * the task pauses after every poll which brought no news, so a swipe is
+ * noticed at most policy->wake_latency ms late.  With an autosuspend delay
+ * as well, the reader's runtime PM is set to "auto" with that delay for the
+ * duration of the wait through sysfs, so the kernel can suspend it within
+ * the pauses; the next poll resumes it.  This needs write access to sysfs
+ * and is skipped without it.  The previous settings are restored after the
+ * wait.  poll_wakeups and poll_time_us of libthinkfinger_get_stats give the
+ * wakeups per minute.
+ *
+ * @param tf struct libthinkfinger
+ * @param policy the policy to apply, the autosuspend delay has to be shorter than the wake latency
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_set_power_policy(libthinkfinger *tf, const libthinkfinger_power_policy *policy);
+
+/** @brief get the power policy of the wait for a swipe
+ *
+ * @param tf struct libthinkfinger
+ * @param policy filled with the policy
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_get_power_policy(libthinkfinger *tf, libthinkfinger_power_policy *policy);
+
+/** @brief get the statistics of an instance of libthinkfinger
+ *
+ * A task which fails with a USB or communication error is retried after
+ * recovering the reader.  Recovery escalates from resynchronizing the
+ * endpoints over a USB port reset to a full reinitialization; each tier
+ * has a bounded time budget.  The statistics count the recoveries done at
+ * each tier since the instance was created.
+ *
+ * The device keeps its state while the USB handle stays open, so a task
+ * following one which ended with a result skips the initialization.  If
+ * that task fails, the device is initialized the long way and the task
+ * is run again; the statistics count how often each path was taken.
+ *
+ * @param tf struct libthinkfinger
+ * @param stats filled with the statistics
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_get_stats(libthinkfinger *tf, libthinkfinger_stats *stats);
+
 /** @brief create a struct libthinkfinger
  *
  * create a struct libthinkfinger and return a pointer to struct libthinkfinger on success.
@@ -165,7 +660,58 @@ libthinkfinger_result libthinkfinger_verify(libthinkfinger *tf);
  */
 libthinkfinger *libthinkfinger_new(libthinkfinger_init_status* init_status);
 
+/** @brief create a struct libthinkfinger
+ *
+ * like libthinkfinger_new, but with TF_FLAG_PROBE set the device is only
+ * looked up and claimed.  Initializing it is left to the first acquire or
+ * verify, which has to initialize the device anyway.
+ *
+ * TF_FLAG_PIPELINE sends the frames of the initialization sequence back to
+ * back instead of waiting for the reply to each of them.  The replies are
+ * checked afterwards; if any of them is missing or malformed the sequence
+ * is repeated in lock-step, which is used from then on.  The first
+ * sequence always runs in lock-step to measure the time pipelining saves,
+ * see libthinkfinger_get_stats.
+ *
+ * TF_FLAG_CALLBACK_QUEUE hands state changes to the caller through a queue
+ * instead of calling back from the task, see libthinkfinger_get_event_fd.
+ *
+ * TF_FLAG_LEASE makes the processes using the reader take turns instead of
+ * racing for the USB interface.  They queue in the order they asked for
+ * it, through a lease in the runtime directory, and the next one is woken
+ * as soon as the device is handed back at the end of a task.  Only the
+ * processes of one user share a lease, root's in TF_RUNDIR and any other
+ * user's in $XDG_RUNTIME_DIR; without it they are not arbitrated.  A
+ * probe does not wait for a busy device.  An initialized device is kept
+ * for the next task on tf, which skips the initialization, until another
+ * process queues for it or for at most 10 s, as a claimed reader does not
+ * suspend.
+ *
+ * @param reference to libthinkfinger_init_status
+ * @param flags bitwise or of libthinkfinger_flag
+ *
+ * @return pointer to struct libthinkfinger on success, else NULL
+ */
+libthinkfinger *libthinkfinger_new_flags(libthinkfinger_init_status* init_status, int flags);
+
+/** @brief cancel the tasks of tf
+ *
+ * A task running in another thread, including one still waiting for the
+ * lease, returns TF_RESULT_SIGINT as soon as the reader allows.  The
+ * cancellation sticks: every later task returns TF_RESULT_SIGINT at once.
+ *
+ * @param tf pointer to struct libthinkfinger
+ *
+ * @return 0 on success, else -1
+ */
+int libthinkfinger_cancel(libthinkfinger *tf);
+
 /** @brief free an instance of libthinkfinger
+ *
+ * A task running in another thread is cancelled and has returned before
+ * tf is freed.  The caller must not start a task on tf afterwards, nor
+ * use tf once the task returned; libthinkfinger_cancel is meant for
+ * ending a task that another thread still needs tf after.
  *
  * @param tf pointer to struct libthinkfinger
  *
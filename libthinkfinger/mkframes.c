@@ -0,0 +1,228 @@
+/*
+ *   ThinkFinger - A driver for the UPEK/SGS Thomson Microelectronics
+ *   fingerprint reader.
+ *
+ *   mkframes - Generates the constant frames of the device protocol
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the
+ *   Free Software Foundation, Inc.,
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *   Every frame starts with "Ciao", a flags byte, the sequence number in the
+ *   upper nibble of byte 5 and the 12 bit payload length in the rest of
+ *   bytes 5 and 6.  The payload is followed by the CRC of everything after
+ *   the magic.  Command payloads (0x28) carry their own length once more.
+ *
+ *   This program assembles the frames libthinkfinger sends from their
+ *   payloads, computes the lengths and CRCs, and writes them as C arrays
+ *   to stdout.  The scan request only differs in its sequence byte and its
+ *   termination byte, so a table of all its CRCs is written as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libthinkfinger.h"
+#include "libthinkfinger-crc.h"
+
+#define FRAME_MAX     4095
+#define FRAME_COMMAND 0x28
+
+struct frame {
+	const char *name;
+	unsigned char flags;
+	unsigned char sequence;
+	_Bool command;
+	const unsigned char *payload;
+	unsigned int len;
+};
+
+static const unsigned char init_a[] = {
+	0x01, 0x00, 0xe8, 0x03, 0x00, 0x00, 0xff, 0x07
+};
+
+static const unsigned char init_b[] = {
+	0x06, 0x04
+};
+
+static const unsigned char init_c[] = {
+	0x07, 0x04
+};
+
+static const unsigned char init_d[] = {
+	0x08, 0x04, 0x83, 0x00, 0x2c, 0x22, 0x23, 0x97,
+	0xc9, 0xa7, 0x15, 0xa0, 0x8a, 0xab, 0x3c, 0xd0,
+	0xbf, 0xdb, 0xf3, 0x92, 0x6f, 0xae, 0x3b, 0x1e,
+	0x44, 0xc4
+};
+
+static const unsigned char init_e[] = {
+	0x0c, 0x04, 0x03, 0x00, 0x00, 0x00
+};
+
+static const unsigned char init_end[] = {
+	0x0b, 0x04, 0x03, 0x00, 0x00, 0x00, 0x60, 0x00,
+	0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0xf4, 0x01, 0x00, 0x00, 0x64, 0x01,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00,
+	0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x03, 0x00, 0x01, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x0a, 0x00, 0x0a, 0x00, 0x64, 0x00,
+	0xf4, 0x01, 0x32, 0x00, 0x00, 0x00, 0x00, 0x10,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x08, 0x00
+};
+
+static const unsigned char deinit[] = {
+	0x00
+};
+
+static const unsigned char enroll_init[] = {
+	0x02, 0x02, 0xc0, 0xd4, 0x01, 0x00, 0x04, 0x00,
+	0x08
+};
+
+static const unsigned char scan_sequence[] = {
+	0x00, 0x30, 0x01
+};
+
+/* asks for the raw strips of the next swipe; the image mode of the reader
+ * is not documented, this is the request tf-sim streams strips for */
+static const unsigned char capture_init[] = {
+	0x04, 0x02
+};
+
+/* asks the reader to match the next swipe against the template it holds
+ * since the last upload; like the image mode this is not documented, it
+ * is the request tf-sim re-arms a verification for.  Only sent with
+ * TF_FLAG_REARM */
+static const unsigned char verify_rearm[] = {
+	0x05, 0x02
+};
+
+/* the template and the CRC follow, see _libthinkfinger_load_template */
+static const unsigned char upload_header[] = {
+	0x03, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xd4,
+	0x01, 0x00, 0x20, 0x00, 0x00, 0x00, 0x03, 0x00,
+	0x00, 0x00
+};
+
+static const struct frame frames[] = {
+	{ "init_a",        0x04, 0x00, false, init_a,        sizeof (init_a) },
+	{ "init_b",        0x00, 0x00, true,  init_b,        sizeof (init_b) },
+	{ "init_c",        0x00, 0x10, true,  init_c,        sizeof (init_c) },
+	{ "init_d",        0x00, 0x20, true,  init_d,        sizeof (init_d) },
+	{ "init_e",        0x00, 0x30, true,  init_e,        sizeof (init_e) },
+	{ "init_end",      0x00, 0x40, true,  init_end,      sizeof (init_end) },
+	{ "deinit",        0x07, 0x00, false, deinit,        sizeof (deinit) },
+	{ "device_busy",   0x09, 0x00, false, NULL,          0 },
+	{ "enroll_init",   0x00, 0x50, true,  enroll_init,   sizeof (enroll_init) },
+	{ "capture_init",  0x00, 0x50, true,  capture_init,  sizeof (capture_init) },
+	{ "verify_rearm",  0x00, 0x50, true,  verify_rearm,  sizeof (verify_rearm) },
+	/* sequence 0x00, the CRC of every other one is in scan_sequence_crc */
+	{ "scan_sequence", 0x00, 0x00, true,  scan_sequence, sizeof (scan_sequence) },
+	{ NULL,            0x00, 0x00, false, NULL,          0 }
+};
+
+/* assembles a frame, returns its size */
+static unsigned int build (unsigned char *data, unsigned char flags, unsigned char sequence,
+			   _Bool command, const unsigned char *payload, unsigned int len)
+{
+	unsigned int size = 7;
+	u16 crc;
+
+	if (command) {
+		data[size++] = FRAME_COMMAND;
+		data[size++] = (len + 2) & 0xff;
+		data[size++] = ((len + 2) >> 8) & 0xff;
+		data[size++] = 0x00;
+		data[size++] = 0x00;
+	}
+	if (len > 0)
+		memcpy (data + size, payload, len);
+	size += len;
+
+	memcpy (data, "Ciao", 4);
+	data[4] = flags;
+	data[5] = (sequence & 0xf0) | (((size - 7) >> 8) & 0x0f);
+	data[6] = (size - 7) & 0xff;
+
+	crc = udf_crc (data + 4, size - 4, 0);
+	data[size++] = crc & 0xff;
+	data[size++] = crc >> 8;
+
+	return size;
+}
+
+static void print_array (const char *type, const char *name, const unsigned char *data, unsigned int size)
+{
+	unsigned int i;
+
+	printf ("static %s %s[%u] = {", type, name, size);
+	for (i = 0; i < size; i++)
+		printf ("%s0x%02x%s", i % 8 ? " " : "\n\t", data[i], i + 1 < size ? "," : "");
+	printf ("\n};\n\n");
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned char data[FRAME_MAX + 9];
+	unsigned int size;
+	unsigned int termination;
+	unsigned int sequence;
+	int i;
+
+	printf ("/* Generated by mkframes, do not edit. */\n\n"
+		"#ifndef LIBTHINKFINGER_FRAMES_H\n"
+		"#define LIBTHINKFINGER_FRAMES_H\n\n");
+
+	for (i = 0; frames[i].name != NULL; i++) {
+		if (frames[i].len + 5 > FRAME_MAX) {
+			fprintf (stderr, "mkframes: %s is too long.\n", frames[i].name);
+			return EXIT_FAILURE;
+		}
+		size = build (data, frames[i].flags, frames[i].sequence,
+			      frames[i].command, frames[i].payload, frames[i].len);
+		print_array ("char", frames[i].name, data, size);
+	}
+
+	/* sequence byte 5 and termination byte 14 of the scan request */
+	printf ("static const u16 scan_sequence_crc[2][256] = {");
+	for (termination = 0; termination < 2; termination++) {
+		printf ("%s\n\t{", termination ? "," : "");
+		for (sequence = 0; sequence < 256; sequence++) {
+			build (data, 0x00, 0x00, true, scan_sequence, sizeof (scan_sequence));
+			data[5] = sequence;
+			data[14] = termination;
+			printf ("%s0x%04x%s", sequence % 8 ? " " : "\n\t\t",
+				udf_crc (data + 4, 11, 0), sequence < 255 ? "," : "");
+		}
+		printf ("\n\t}");
+	}
+	printf ("\n};\n\n");
+
+	/* lengths and CRC are filled in per template */
+	size = build (data, 0x00, 0x50, true, upload_header, sizeof (upload_header));
+	print_array ("const char", "upload_header", data, size - 2);
+
+	printf ("#endif /* LIBTHINKFINGER_FRAMES_H */\n");
+
+	return fflush (stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
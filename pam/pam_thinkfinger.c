@@ -27,6 +27,7 @@
 #include <pam_thinkfinger-uinput.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <termios.h>
 #include <unistd.h>
@@ -34,6 +35,7 @@
 #include <syslog.h>
 #include <security/pam_modules.h>
 #include <pwd.h>
+#include <sys/stat.h>
 #ifdef HAVE_OLD_PAM
 #include "pam_thinkfinger-compat.h"
 #else
@@ -42,6 +44,10 @@
 
 #define MAX_PATH 256
 
+/* successful verdicts, readable and writable by root only */
+#define GRACE_DIR TF_RUNDIR "/grace"
+#define BOOT_ID_LEN 36
+
 #define PAM_SM_AUTH
 
 volatile static int pam_tf_debug = 0;
@@ -49,6 +55,7 @@ volatile static int pam_tf_debug = 0;
 typedef struct {
 	libthinkfinger *tf;
 	const char *user;
+	uid_t uid;
 	char bir_file[MAX_PATH];
 	pthread_t t_pam_prompt;
 	pthread_t t_thinkfinger;
@@ -56,9 +63,19 @@ typedef struct {
 	int prompt_retval;
 	int isatty;
 	int uinput_fd;
+	unsigned int timeout;
+	unsigned int wake_latency;
+	unsigned int grace;
 	pam_handle_t *pamh;
 } pam_thinkfinger_s;
 
+/* a verdict in the grace cache: when the finger matched, in us of
+ * CLOCK_BOOTTIME, which goes on in suspend, and in which boot */
+typedef struct {
+	char boot_id[BOOT_ID_LEN];
+	unsigned long long stamp;
+} pam_thinkfinger_grace;
+
 static void pam_thinkfinger_log (const pam_thinkfinger_s *pam_thinkfinger, int type, const char *format, ...)
 {
 	char message[LINE_MAX];
@@ -72,13 +89,19 @@ static void pam_thinkfinger_log (const pam_thinkfinger_s *pam_thinkfinger, int t
 	}
 }
 
-static void pam_thinkfinger_options (const pam_thinkfinger_s *pam_thinkfinger, int argc, const char **argv)
+static void pam_thinkfinger_options (pam_thinkfinger_s *pam_thinkfinger, int argc, const char **argv)
 {
 	int i;
 
 	for (i = 0; i < argc; i++) {
 		if (!strcmp(argv[i], "debug"))
 			pam_tf_debug = 1;
+		else if (!strncmp(argv[i], "timeout=", 8))
+			pam_thinkfinger->timeout = strtoul (argv[i] + 8, NULL, 10);
+		else if (!strncmp(argv[i], "wake_latency=", 13))
+			pam_thinkfinger->wake_latency = strtoul (argv[i] + 13, NULL, 10);
+		else if (!strncmp(argv[i], "grace=", 6))
+			pam_thinkfinger->grace = strtoul (argv[i] + 6, NULL, 10);
 		else if (!strcmp(argv[i], " ") || !strcmp(argv[i], "\t"))
 			continue;
 		else
@@ -108,6 +131,7 @@ static int pam_thinkfinger_user_bir_check (pam_thinkfinger_s *pam_thinkfinger)
 				     "getpwnam(\"%s\") failed: %s.", pam_thinkfinger->user, strerror (errno));
 		goto out;
 	}
+	pam_thinkfinger->uid = pw->pw_uid;
 
 	snprintf (pam_thinkfinger->bir_file, MAX_PATH, "%s/.thinkfinger.bir", pw->pw_dir);
 	fd = open (pam_thinkfinger->bir_file, O_RDONLY | O_NOFOLLOW);
@@ -133,21 +157,227 @@ out:
 	return retval;
 }
 
+/* monotonic time in microseconds: the verification deadline and its
+ * retries are kept in this unit, the probe is logged in it */
+static unsigned long long pam_thinkfinger_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* makes sure GRACE_DIR exists and nobody but root can get at it */
+static int pam_thinkfinger_grace_dir (const pam_thinkfinger_s *pam_thinkfinger)
+{
+	struct stat st;
+	int retval = -1;
+
+	if (geteuid () != 0)
+		goto out;
+	if (mkdir (TF_RUNDIR, 0755) < 0 && errno != EEXIST)
+		goto out_error;
+	if (mkdir (GRACE_DIR, 0700) < 0 && errno != EEXIST)
+		goto out_error;
+	if (lstat (GRACE_DIR, &st) < 0)
+		goto out_error;
+	if (!S_ISDIR (st.st_mode) || st.st_uid != 0 || (st.st_mode & 077) != 0) {
+		pam_thinkfinger_log (pam_thinkfinger, LOG_ERR, "Ignoring '%s', it is not a directory private to root.", GRACE_DIR);
+		goto out;
+	}
+
+	retval = 0;
+	goto out;
+out_error:
+	pam_thinkfinger_log (pam_thinkfinger, LOG_ERR, "Could not create '%s': %s.", GRACE_DIR, strerror (errno));
+out:
+	return retval;
+}
+
+/* names the verdict of the user, asked for by the calling user from the
+ * same audit session and terminal; without an audit session (which
+ * pam_loginuid sets up) or a terminal verdicts are not cached, else every
+ * process of the session without one, e.g. a polkit agent and a setsid
+ * sudo, would share the verdict */
+static int pam_thinkfinger_grace_path (const pam_thinkfinger_s *pam_thinkfinger, char *path, size_t size)
+{
+	const char *tty = NULL;
+	char dev[MAX_PATH];
+	struct stat st;
+	unsigned long long rdev = 0;
+	unsigned int session;
+	FILE *file;
+	int retval = -1;
+
+	file = fopen ("/proc/self/sessionid", "r");
+	if (file == NULL)
+		goto out;
+	if (fscanf (file, "%u", &session) != 1)
+		session = (unsigned int) -1;
+	fclose (file);
+	if (session == (unsigned int) -1)
+		goto out;
+
+	pam_get_item (pam_thinkfinger->pamh, PAM_TTY, (const void **)(const void *) &tty);
+	if (tty != NULL && tty[0] != '\0') {
+		snprintf (dev, sizeof (dev), "%s%s", tty[0] == '/' ? "" : "/dev/", tty);
+		if (stat (dev, &st) == 0 && S_ISCHR (st.st_mode))
+			rdev = st.st_rdev;
+	}
+	if (rdev == 0 && pam_thinkfinger->isatty == 1 &&
+	    fstat (STDIN_FILENO, &st) == 0 && S_ISCHR (st.st_mode))
+		rdev = st.st_rdev;
+	if (rdev == 0)
+		goto out;
+
+	snprintf (path, size, "%s/%u-%u-%u-%llx", GRACE_DIR,
+		  (unsigned int) pam_thinkfinger->uid, (unsigned int) getuid (), session, rdev);
+	retval = 0;
+out:
+	return retval;
+}
+
+static int pam_thinkfinger_grace_now (pam_thinkfinger_grace *grace)
+{
+	struct timespec ts;
+	int retval = -1;
+	int fd;
+
+	fd = open ("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	if (read (fd, grace->boot_id, BOOT_ID_LEN) != BOOT_ID_LEN) {
+		close (fd);
+		goto out;
+	}
+	close (fd);
+
+	if (clock_gettime (CLOCK_BOOTTIME, &ts) < 0)
+		goto out;
+	grace->stamp = (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	retval = 0;
+out:
+	return retval;
+}
+
+/* returns the age in s of a verdict still within the grace period, -1 if
+ * there is none; an expired one is removed */
+static long long pam_thinkfinger_grace_check (const pam_thinkfinger_s *pam_thinkfinger)
+{
+	pam_thinkfinger_grace now;
+	pam_thinkfinger_grace grace;
+	char path[MAX_PATH];
+	struct stat st;
+	long long retval = -1;
+	int fd;
+
+	if (pam_thinkfinger_grace_dir (pam_thinkfinger) < 0 ||
+	    pam_thinkfinger_grace_path (pam_thinkfinger, path, sizeof (path)) < 0 ||
+	    pam_thinkfinger_grace_now (&now) < 0)
+		goto out;
+
+	fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || st.st_uid != 0 ||
+	    st.st_size != sizeof (grace) || read (fd, &grace, sizeof (grace)) != sizeof (grace)) {
+		close (fd);
+		goto out_remove;
+	}
+	close (fd);
+
+	if (memcmp (grace.boot_id, now.boot_id, BOOT_ID_LEN) != 0 || grace.stamp > now.stamp ||
+	    now.stamp - grace.stamp >= pam_thinkfinger->grace * 1000000ULL)
+		goto out_remove;
+
+	retval = (now.stamp - grace.stamp) / 1000000;
+	goto out;
+out_remove:
+	unlink (path);
+out:
+	return retval;
+}
+
+/* records a successful verdict, the grace period starts with the swipe and
+ * is not extended by the verdicts taken from the cache */
+static void pam_thinkfinger_grace_store (const pam_thinkfinger_s *pam_thinkfinger)
+{
+	pam_thinkfinger_grace grace;
+	char path[MAX_PATH];
+	char tmp[MAX_PATH + 8];
+	int fd;
+
+	if (pam_thinkfinger_grace_dir (pam_thinkfinger) < 0 ||
+	    pam_thinkfinger_grace_path (pam_thinkfinger, path, sizeof (path)) < 0 ||
+	    pam_thinkfinger_grace_now (&grace) < 0)
+		goto out;
+
+	snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+	fd = mkstemp (tmp);
+	if (fd < 0)
+		goto out_error;
+	if (write (fd, &grace, sizeof (grace)) != sizeof (grace)) {
+		close (fd);
+		unlink (tmp);
+		goto out_error;
+	}
+	close (fd);
+	if (rename (tmp, path) < 0) {
+		unlink (tmp);
+		goto out_error;
+	}
+	goto out;
+out_error:
+	pam_thinkfinger_log (pam_thinkfinger, LOG_ERR, "Could not store the verdict in '%s': %s.", path, strerror (errno));
+out:
+	return;
+}
+
 static libthinkfinger_state pam_thinkfinger_verify (const pam_thinkfinger_s *pam_thinkfinger)
 {
 	libthinkfinger_state tf_state = TF_STATE_VERIFY_FAILED;
+	unsigned long long deadline = 0;
+	unsigned long long now;
+	unsigned int remaining = 0;
+	libthinkfinger_lease lease;
 	int retry = 20;
 
 	if (pam_thinkfinger->tf == NULL)
 		goto out;
 
+	if (pam_thinkfinger->timeout > 0)
+		deadline = pam_thinkfinger_now () + pam_thinkfinger->timeout * 1000000ULL;
+
 	libthinkfinger_set_file (pam_thinkfinger->tf, pam_thinkfinger->bir_file);
 	/* if the USB device is being removed while verification (e.g. suspend) retry */
-	while ((tf_state = libthinkfinger_verify (pam_thinkfinger->tf)) == TF_RESULT_USB_ERROR && --retry > 0)
+	do {
+		if (deadline != 0) {
+			now = pam_thinkfinger_now ();
+			if (now >= deadline) {
+				tf_state = TF_STATE_TIMEOUT;
+				break;
+			}
+			remaining = (deadline - now + 999) / 1000;
+		}
+		tf_state = libthinkfinger_verify_deadline (pam_thinkfinger->tf, remaining);
+		if (tf_state != TF_STATE_USB_ERROR || --retry == 0)
+			break;
+		/* the retries share the deadline of the verification */
+		if (deadline != 0 && pam_thinkfinger_now () + 250000 >= deadline) {
+			tf_state = TF_STATE_TIMEOUT;
+			break;
+		}
 		usleep (250000);
+	} while (true);
 
 	if (retry == 0 && tf_state == TF_STATE_USB_ERROR)
 		pam_thinkfinger_log (pam_thinkfinger, LOG_WARNING, "USB device did not reappear in time");
+	else if (tf_state == TF_STATE_TIMEOUT)
+		pam_thinkfinger_log (pam_thinkfinger, LOG_WARNING, "Verification timed out after %u s", pam_thinkfinger->timeout);
+	else if (tf_state == TF_STATE_DEVICE_BUSY && libthinkfinger_get_lease (pam_thinkfinger->tf, &lease) == 0)
+		pam_thinkfinger_log (pam_thinkfinger, LOG_WARNING, "USB device is in use by %s (%d)",
+				     lease.holder != 0 ? lease.name : "another process", (int) lease.holder);
 out:
 	return tf_state;
 }
@@ -196,9 +426,11 @@ static void pam_prompt_thread (void *data)
 	pam_prompt (pam_thinkfinger->pamh, PAM_PROMPT_ECHO_OFF, &resp, "Password or swipe finger: ");
 	pam_set_item (pam_thinkfinger->pamh, PAM_AUTHTOK, resp);
 
-	/* ThinkFinger thread will return once we call libthinkfinger_free */
+	/* ThinkFinger thread will return once we cancel the verification, it
+	 * still uses the handle afterwards, which is freed after both threads
+	 * were joined */
 	if (pam_thinkfinger->tf != NULL)
-		libthinkfinger_free (pam_thinkfinger->tf);
+		libthinkfinger_cancel (pam_thinkfinger->tf);
 
 	pthread_exit (NULL);
 }
@@ -223,6 +455,12 @@ static const char *handle_error (libthinkfinger_init_status init_status)
 	case TF_INIT_USB_HELLO_FAILED:
 		msg = "Sending HELLO failed.";
 		break;
+	case TF_INIT_USB_HANDSHAKE_FAILED:
+		msg = "Initialization sequence failed.";
+		break;
+	case TF_INIT_DEVICE_BUSY:
+		msg = "USB device is in use by another process.";
+		break;
 	case TF_INIT_UNDEFINED:
 		msg = "Undefined error.";
 		break;
@@ -242,8 +480,12 @@ int pam_sm_authenticate (pam_handle_t *pamh, int flags, int argc, const char **a
 	pam_thinkfinger_s pam_thinkfinger;
 	struct termios term_attr;
 	libthinkfinger_init_status init_status;
+	unsigned long long start;
 
 	pam_thinkfinger.swipe_retval = PAM_SERVICE_ERR;
+	pam_thinkfinger.timeout = 0;
+	pam_thinkfinger.wake_latency = 0;
+	pam_thinkfinger.grace = 0;
 	pam_thinkfinger.pamh = pamh;
 
 	pam_thinkfinger_options (&pam_thinkfinger, argc, argv);
@@ -267,6 +509,17 @@ int pam_sm_authenticate (pam_handle_t *pamh, int flags, int argc, const char **a
 		goto out;
 	}
 
+	if (pam_thinkfinger.grace > 0) {
+		long long age = pam_thinkfinger_grace_check (&pam_thinkfinger);
+
+		if (age >= 0) {
+			pam_thinkfinger_log (&pam_thinkfinger, LOG_NOTICE,
+					     "User '%s' authenticated (fingerprint matched %lld s ago).", pam_thinkfinger.user, age);
+			retval = PAM_SUCCESS;
+			goto out;
+		}
+	}
+
 	ret = uinput_open (&pam_thinkfinger.uinput_fd);
 	if (ret != 0) {
 		pam_thinkfinger_log (&pam_thinkfinger, LOG_ERR, "Initializing uinput failed: %s.", strerror (ret));
@@ -274,13 +527,31 @@ int pam_sm_authenticate (pam_handle_t *pamh, int flags, int argc, const char **a
 		goto out;
 	}
 
-	pam_thinkfinger.tf = libthinkfinger_new (&init_status);
+	/* the verification initializes the device, probing it is enough here */
+	start = pam_thinkfinger_now ();
+	pam_thinkfinger.tf = libthinkfinger_new_flags (&init_status, TF_FLAG_PROBE | TF_FLAG_LEASE);
+	pam_thinkfinger_log (&pam_thinkfinger, LOG_INFO, "Probing the device took %llu us.", pam_thinkfinger_now () - start);
 	if (init_status != TF_INIT_SUCCESS) {
 		pam_thinkfinger_log (&pam_thinkfinger, LOG_ERR, "Error: %s", handle_error (init_status));
+		if (pam_thinkfinger.tf != NULL)
+			libthinkfinger_free (pam_thinkfinger.tf);
+		if (pam_thinkfinger.uinput_fd > 0)
+			uinput_close (&pam_thinkfinger.uinput_fd);
 		retval = PAM_AUTHINFO_UNAVAIL;
 		goto out;
 	}
 
+	if (pam_thinkfinger.wake_latency > 0) {
+		/* the reader may suspend once it was idle for half of a pause */
+		libthinkfinger_power_policy policy = {
+			pam_thinkfinger.wake_latency,
+			pam_thinkfinger.wake_latency / 2
+		};
+
+		if (libthinkfinger_set_power_policy (pam_thinkfinger.tf, &policy) < 0)
+			pam_thinkfinger_log (&pam_thinkfinger, LOG_WARNING, "Ignoring wake_latency=%u.", pam_thinkfinger.wake_latency);
+	}
+
 	ret = pthread_create (&pam_thinkfinger.t_pam_prompt, NULL, (void *) &pam_prompt_thread, &pam_thinkfinger);
 	if (ret != 0) {
 		pam_thinkfinger_log (&pam_thinkfinger, LOG_ERR, "Error calling pthread_create (%s).", strerror (ret));
@@ -301,6 +572,7 @@ int pam_sm_authenticate (pam_handle_t *pamh, int flags, int argc, const char **a
 		pam_thinkfinger_log (&pam_thinkfinger, LOG_ERR, "Error calling pthread_join (%s).", strerror (ret));
 		goto out;
 	}
+	libthinkfinger_free (pam_thinkfinger.tf);
 
 	if (pam_thinkfinger.uinput_fd > 0)
 		uinput_close (&pam_thinkfinger.uinput_fd);
@@ -308,10 +580,13 @@ int pam_sm_authenticate (pam_handle_t *pamh, int flags, int argc, const char **a
 		tcsetattr (STDIN_FILENO, TCSADRAIN, &term_attr);
 	}
 
-	if (pam_thinkfinger.swipe_retval == PAM_SUCCESS)
+	if (pam_thinkfinger.swipe_retval == PAM_SUCCESS) {
+		if (pam_thinkfinger.grace > 0)
+			pam_thinkfinger_grace_store (&pam_thinkfinger);
 		retval = PAM_SUCCESS;
-	else
+	} else {
 		retval = PAM_AUTHINFO_UNAVAIL;
+	}
 out:
 	pam_thinkfinger_log (&pam_thinkfinger, LOG_INFO,
 			     "%s returning '%d': %s.", __FUNCTION__, retval, retval ? pam_strerror (pamh, retval) : "success");
@@ -23,8 +23,10 @@
   */
 
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <errno.h>
 #include <libgen.h>
+#include <poll.h>
 #include <pwd.h>
 
 #include <config.h>
@@ -33,22 +35,29 @@
 #define MODE_UNDEFINED 0
 #define MODE_ACQUIRE   1
 #define MODE_VERIFY    2
+#define MODE_CONVERT   3
 #define MAX_USER       32
 #define MAX_PATH       256
 
 #define BIR_EXTENSION    ".bir"
 #define BANNER           "\n"PACKAGE_STRING " ("PACKAGE_BUGREPORT")\n" "Copyright (C) 2006, 2007 Timo Hoenig <thoenig@suse.de>\n"
 
-const char* usage_string = "[--acquire | --verify] [--verbose] [bir_file]\n  where --verbose and bir_file are optional.\n\n  --verbose defaults to unspecified\n    bir_file defaults to ~/.thinkfinger.bir.\n";
+const char* usage_string = "[--acquire | --verify | --convert] [--finger=n] [--verbose] [bir_file]\n  where --finger, --verbose and bir_file are optional.\n\n  --finger defaults to 0, unspecified (1 right thumb to 10 left little finger)\n  --verbose defaults to unspecified\n    bir_file defaults to ~/.thinkfinger.bir.\n  --convert converts bir_file from the format of older versions.\n";
 
 typedef struct {
 	int mode;
 	char bir[MAX_PATH];
 	_Bool verbose;
+	unsigned int finger;
 	int swipe_success;
 	int swipe_failed;
 } s_tfdata;
 
+typedef struct {
+	libthinkfinger *tf;
+	_Bool stop;
+} s_dispatcher;
+
 static void print_status (int swipe_success, int swiped_required, int swipe_failed)
 {
 	printf ("\rPlease swipe your finger (successful swipes %i/%i, failed swipes: %i)...",
@@ -88,10 +97,17 @@ static void callback (libthinkfinger_state state, void *data)
 			str = "TF_STATE_COMM_FAILED";
 		else if (state == TF_STATE_INITIAL)
 			str = "TF_STATE_INITIAL";
+		else if (state == TF_STATE_DEVICE_BUSY)
+			str = "TF_STATE_DEVICE_BUSY";
 
 		printf ("tf-tool: %s (0x%02x)\n", str, state);
 	}
 
+	if (state == TF_STATE_DEVICE_BUSY) {
+		printf ("Waiting for the fingerprint reader, it is in use...\n");
+		fflush (stdout);
+	}
+
 	if (tfdata->mode == MODE_ACQUIRE) {
 		switch (state) {
 			case TF_STATE_ACQUIRE_SUCCESS:
@@ -168,6 +184,12 @@ static void raise_error (libthinkfinger_init_status init_status) {
 	case TF_INIT_USB_HELLO_FAILED:
 		msg = "Sending HELLO failed.";
 		break;
+	case TF_INIT_USB_HANDSHAKE_FAILED:
+		msg = "Initialization sequence failed.";
+		break;
+	case TF_INIT_DEVICE_BUSY:
+		msg = "USB device is in use by another process.";
+		break;
 	case TF_INIT_UNDEFINED:
 		msg = "Undefined error.";
 		break;
@@ -180,28 +202,115 @@ static void raise_error (libthinkfinger_init_status init_status) {
 	return;
 }
 
-static int acquire (const s_tfdata *tfdata)
+static void *dispatch (void *data)
+{
+	s_dispatcher *dispatcher = (s_dispatcher *) data;
+	struct pollfd pfd;
+
+	pfd.fd = libthinkfinger_get_event_fd (dispatcher->tf);
+	pfd.events = POLLIN;
+	while (__atomic_load_n (&dispatcher->stop, __ATOMIC_ACQUIRE) == false) {
+		if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		libthinkfinger_dispatch (dispatcher->tf);
+	}
+
+	return NULL;
+}
+
+/* runs task while the callbacks are dispatched on a thread of their own, so
+ * printing never holds up the reader */
+static libthinkfinger_result run_task (libthinkfinger *tf, libthinkfinger_result (*task) (libthinkfinger *))
+{
+	s_dispatcher dispatcher = { tf, false };
+	libthinkfinger_result tf_result;
+	pthread_t thread;
+	_Bool started = false;
+
+	if (libthinkfinger_get_event_fd (tf) >= 0)
+		started = pthread_create (&thread, NULL, dispatch, &dispatcher) == 0;
+
+	tf_result = task (tf);
+
+	if (started == true) {
+		__atomic_store_n (&dispatcher.stop, true, __ATOMIC_RELEASE);
+		eventfd_write (libthinkfinger_get_event_fd (tf), 1);
+		pthread_join (thread, NULL);
+	}
+	libthinkfinger_dispatch (tf);
+
+	return tf_result;
+}
+
+/* only probes the device, acquire and verify initialize it on first use */
+static libthinkfinger *initialize (const s_tfdata *tfdata)
 {
 	libthinkfinger *tf;
 	libthinkfinger_init_status init_status;
-	libthinkfinger_result tf_result;
-	int retval = -1;
+	struct timespec start, end;
 
 	printf ("Initializing...");
 	fflush (stdout);
-	tf = libthinkfinger_new (&init_status);
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	tf = libthinkfinger_new_flags (&init_status, TF_FLAG_PROBE | TF_FLAG_CALLBACK_QUEUE | TF_FLAG_LEASE);
+	clock_gettime (CLOCK_MONOTONIC, &end);
 	if (init_status != TF_INIT_SUCCESS) {
 		raise_error (init_status);
+		if (tf != NULL)
+			libthinkfinger_free (tf);
+		tf = NULL;
 		goto out;
 	}
-	printf (" done.\n");
+
+	if (tfdata->verbose == true)
+		printf (" done (%.1f ms).\n", (end.tv_sec - start.tv_sec) * 1000.0 +
+			(end.tv_nsec - start.tv_nsec) / 1000000.0);
+	else
+		printf (" done.\n");
+out:
+	return tf;
+}
+
+static void print_busy (libthinkfinger *tf)
+{
+	libthinkfinger_lease lease;
+
+	if (libthinkfinger_get_lease (tf, &lease) == 0 && lease.holder != 0)
+		printf ("Fingerprint reader is in use by %s (%d).\n", lease.name, (int) lease.holder);
+	else
+		printf ("Fingerprint reader is in use.\n");
+}
+
+static void print_poll_stats (libthinkfinger *tf)
+{
+	libthinkfinger_stats stats;
+
+	if (libthinkfinger_get_stats (tf, &stats) == 0 && stats.poll_time_us > 0)
+		printf ("Waited %.1f s for the finger, %.0f wakeups per minute.\n", stats.poll_time_us / 1000000.0,
+			stats.poll_wakeups * 60000000.0 / stats.poll_time_us);
+}
+
+static int acquire (const s_tfdata *tfdata)
+{
+	libthinkfinger *tf;
+	libthinkfinger_result tf_result;
+	int retval = -1;
+
+	tf = initialize (tfdata);
+	if (tf == NULL)
+		goto out;
 
 	if (libthinkfinger_set_file (tf, tfdata->bir) < 0)
 		goto out;
+	if (libthinkfinger_set_finger (tf, tfdata->finger) < 0)
+		goto out;
 	if (libthinkfinger_set_callback (tf, callback, (void *)tfdata) < 0)
 		goto out;
 
-	tf_result = libthinkfinger_acquire (tf);
+	tf_result = run_task (tf, libthinkfinger_acquire);
+	if (tfdata->verbose == true)
+		print_poll_stats (tf);
 	switch (tf_result) {
 		case TF_RESULT_ACQUIRE_SUCCESS:
 			retval = 0;
@@ -225,6 +334,10 @@ static int acquire (const s_tfdata *tfdata)
 			printf ("Could not acquire fingerprint (communication with fingerprint reader failed).\n");
 			retval = -1;
 			break;
+		case TF_RESULT_DEVICE_BUSY:
+			print_busy (tf);
+			retval = -1;
+			break;
 		default:
 			printf ("Undefined error occured (0x%02x).\n", tf_result);
 			retval = -1;
@@ -239,26 +352,23 @@ out:
 static int verify (const s_tfdata *tfdata)
 {
 	libthinkfinger *tf;
-	libthinkfinger_init_status init_status;
 	libthinkfinger_result tf_result;
 	int retval = -1;
 
-	printf ("Initializing...");
-	fflush (stdout);
-
-	tf = libthinkfinger_new (&init_status);
-	if (init_status != TF_INIT_SUCCESS) {
-		raise_error (init_status);
+	tf = initialize (tfdata);
+	if (tf == NULL)
 		goto out;
-	}
-	printf (" done.\n");
 
 	if (libthinkfinger_set_file (tf, tfdata->bir) < 0)
 		goto out;
+	if (libthinkfinger_set_finger (tf, tfdata->finger) < 0)
+		goto out;
 	if (libthinkfinger_set_callback (tf, callback, (void *)tfdata) < 0)
 		goto out;
 
-	tf_result = libthinkfinger_verify (tf);
+	tf_result = run_task (tf, libthinkfinger_verify);
+	if (tfdata->verbose == true)
+		print_poll_stats (tf);
 	switch (tf_result) {
 		case TF_RESULT_VERIFY_SUCCESS:
 			retval = 0;
@@ -270,6 +380,10 @@ static int verify (const s_tfdata *tfdata)
 			retval = -1;
 			printf ("Could not open '%s'.\n", tfdata->bir);
 			break;
+		case TF_RESULT_BIR_CORRUPT:
+			retval = -1;
+			printf ("'%s' is corrupt, acquire the fingerprint again.\n", tfdata->bir);
+			break;
 		case TF_RESULT_SIGINT:
 			retval = -1;
 			printf ("Interrupted\n.");
@@ -282,6 +396,10 @@ static int verify (const s_tfdata *tfdata)
 			printf ("Could not verify fingerprint (communication with fingerprint reader failed).\n");
 			retval = -1;
 			break;
+		case TF_RESULT_DEVICE_BUSY:
+			print_busy (tf);
+			retval = -1;
+			break;
 		default:
 			printf ("Undefined error occured (0x%02x).\n", tf_result);
 
@@ -294,6 +412,28 @@ out:
 	return retval;
 }
 
+/* rewrites a record of an older version as a container of its template */
+static int convert (const s_tfdata *tfdata)
+{
+	int retval = -1;
+
+	switch (libthinkfinger_convert_bir (tfdata->bir, tfdata->finger)) {
+		case 1:
+			printf ("Converted '%s'.\n", tfdata->bir);
+			retval = 0;
+			break;
+		case 0:
+			printf ("'%s' is in the current format already.\n", tfdata->bir);
+			retval = 0;
+			break;
+		default:
+			printf ("Could not convert '%s'.\n", tfdata->bir);
+			break;
+	}
+
+	return retval;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -313,6 +453,7 @@ main (int argc, char *argv[])
 
 	tfdata.mode = MODE_UNDEFINED;
 	tfdata.verbose = false;
+	tfdata.finger = 0;
 	tfdata.swipe_success = 0;
 	tfdata.swipe_failed = 0;
 
@@ -358,6 +499,38 @@ main (int argc, char *argv[])
 			}
 			snprintf (tfdata.bir, MAX_PATH-1, "%s/.thinkfinger%s", home, BIR_EXTENSION);
 			tfdata.mode = MODE_VERIFY;
+		} else if (!strcmp (arg, "--convert")) {
+			char *home = getenv ("HOME");
+			if (home == NULL) {
+				printf ("Could not determine home directory of current user.\n");
+				retval = -1;
+				goto out;
+			}
+
+			if (tfdata.mode != MODE_UNDEFINED) {
+				printf ("Mode already set.\n");
+				usage (argv [0]);
+				retval = -1;
+				goto out;
+			}
+
+			path_len = strlen (home) + strlen ("/.thinkfinger") + strlen (BIR_EXTENSION);
+			if (path_len > MAX_PATH-1) {
+				printf ("Path \"%s/.thinkfinger%s\" is too long (maximum %i chars).\n", home, BIR_EXTENSION, MAX_PATH-1);
+				retval = -1;
+				goto out;
+			}
+			snprintf (tfdata.bir, MAX_PATH-1, "%s/.thinkfinger%s", home, BIR_EXTENSION);
+			tfdata.mode = MODE_CONVERT;
+		} else if (!strncmp (arg, "--finger=", 9)) {
+			char *end;
+
+			tfdata.finger = strtoul (arg + 9, &end, 10);
+			if (end == arg + 9 || *end != '\0' || tfdata.finger > TF_BIR_FINGERS) {
+				printf ("Invalid finger \"%s\" (0 to %d).\n", arg + 9, TF_BIR_FINGERS);
+				retval = -1;
+				goto out;
+			}
 		} else if (!strcmp (arg, "--verbose")) {
 			printf ("Running in verbose mode.\n");
 			tfdata.verbose = true;
@@ -391,7 +564,7 @@ main (int argc, char *argv[])
 		goto out;
 	}
 
-	if (tfdata.verbose == true) {
+	if (tfdata.verbose == true && (tfdata.mode == MODE_ACQUIRE || tfdata.mode == MODE_VERIFY)) {
 		printf ("\n* Mode: %s\n* Biometric identification record file: \'%s\'\n\n",
 			 (tfdata.mode == MODE_ACQUIRE) ? "acquire" : "verify",
 			 tfdata.bir);
@@ -401,6 +574,8 @@ main (int argc, char *argv[])
 		retval = acquire (&tfdata);
 	} else if (tfdata.mode == MODE_VERIFY) {
 		retval = verify (&tfdata);
+	} else if (tfdata.mode == MODE_CONVERT) {
+		retval = convert (&tfdata);
 	} else {
 		usage (argv[0]);
 		retval = -1;